@@ -1,8 +1,21 @@
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
+#include <pthread.h>
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifndef GL_GLEXT_PROTOTYPES
+#define GL_GLEXT_PROTOTYPES
+#endif
 #ifdef WIN32
 #include "freeglut/include/GL/freeglut.h"
 #else
@@ -45,35 +58,6 @@ static bool keyactions[NUM_KEY_ACTIONS];
 float objx, objy;
 float movex, movey;
 
-// ==============================================
-// memory allocation
-
-void *Mem_Alloc(int numbytes)
-{
-	#define MEM_ALLOC_SIZE	16 * 1024 * 1024
-
-	typedef struct memstack_s
-	{
-		unsigned char mem[MEM_ALLOC_SIZE];
-		int allocated;
-
-	} memstack_t;
-
-	static memstack_t memstack;
-	unsigned char *mem;
-	
-	if(memstack.allocated + numbytes > MEM_ALLOC_SIZE)
-	{
-		printf("Error: Mem: no free space available\n");
-		abort();
-	}
-
-	mem = memstack.mem + memstack.allocated;
-	memstack.allocated += numbytes;
-
-	return mem;
-}
-
 // ==============================================
 // errors and warnings
 
@@ -102,6 +86,146 @@ static void Warning(const char *warning, ...)
 	fprintf(stdout, "Warning: %s", buffer);
 }
 
+// ==============================================
+// memory allocation
+//
+// all allocation comes out of linear arenas. the permanent arena holds
+// anything that lives for the whole run, the frame arena is reset at the
+// end of every glut callback and each worker thread gets its own arena
+// so temporaries never need a lock or a call to malloc
+
+#define PERM_ARENA_SIZE		(16 * 1024 * 1024)
+#define FRAME_ARENA_SIZE	(32 * 1024 * 1024)
+#define THREAD_ARENA_SIZE	(4 * 1024 * 1024)
+#define MAX_THREAD_ARENAS	32
+
+typedef struct arena_s
+{
+	const char *name;
+	unsigned char *base;
+	size_t size;
+	size_t used;
+	size_t highwater;
+	int numresets;
+
+} arena_t;
+
+typedef size_t arenamarker_t;
+
+static unsigned char permmem[PERM_ARENA_SIZE];
+static unsigned char framemem[FRAME_ARENA_SIZE];
+static arena_t permarena;
+static arena_t framearena;
+
+static arena_t threadarenas[MAX_THREAD_ARENAS];
+static int numthreadarenas;
+static thread_local arena_t *threadarena;
+
+static void Arena_Init(arena_t *arena, const char *name, void *base, size_t size)
+{
+	arena->name = name;
+	arena->base = (unsigned char*)base;
+	arena->size = size;
+	arena->used = 0;
+	arena->highwater = 0;
+	arena->numresets = 0;
+}
+
+// align must be a power of two
+static void *Arena_Alloc(arena_t *arena, size_t numbytes, size_t align)
+{
+	size_t start = (arena->used + (align - 1)) & ~(align - 1);
+
+	if (start + numbytes > arena->size)
+	{
+		Error("Mem: arena \"%s\" out of space (%zu bytes requested, %zu of %zu used)\n",
+			arena->name, numbytes, arena->used, arena->size);
+	}
+
+	arena->used = start + numbytes;
+	if (arena->used > arena->highwater)
+		arena->highwater = arena->used;
+
+	return arena->base + start;
+}
+
+static arenamarker_t Arena_GetMarker(arena_t *arena)
+{
+	return arena->used;
+}
+
+static void Arena_FreeToMarker(arena_t *arena, arenamarker_t marker)
+{
+	arena->used = marker;
+}
+
+static void Arena_Reset(arena_t *arena)
+{
+	arena->used = 0;
+	arena->numresets++;
+}
+
+static void Arena_PrintStats(arena_t *arena)
+{
+	printf("%-8s %10zu used %10zu peak %10zu size %6i resets\n",
+		arena->name, arena->used, arena->highwater, arena->size, arena->numresets);
+}
+
+// returns the calling thread's scratch arena, the main thread uses the
+// frame arena and workers get a private block on first use
+static arena_t *Mem_ThreadArena()
+{
+	if (!threadarena)
+	{
+		int index = __sync_fetch_and_add(&numthreadarenas, 1);
+		if (index >= MAX_THREAD_ARENAS)
+			Error("Mem: too many thread arenas\n");
+
+		void *base = malloc(THREAD_ARENA_SIZE);
+		if (!base)
+			Error("Mem: failed to allocate thread arena\n");
+
+		Arena_Init(&threadarenas[index], "thread", base, THREAD_ARENA_SIZE);
+		threadarena = &threadarenas[index];
+	}
+
+	return threadarena;
+}
+
+static void Mem_PrintStats()
+{
+	Arena_PrintStats(&permarena);
+	Arena_PrintStats(&framearena);
+	for (int i = 0; i < numthreadarenas && i < MAX_THREAD_ARENAS; i++)
+		Arena_PrintStats(&threadarenas[i]);
+}
+
+static void Mem_Init()
+{
+	Arena_Init(&permarena, "perm", permmem, PERM_ARENA_SIZE);
+	Arena_Init(&framearena, "frame", framemem, FRAME_ARENA_SIZE);
+	threadarena = &framearena;
+
+	atexit(Mem_PrintStats);
+}
+
+// allocations that live for the whole run
+void *Mem_Alloc(int numbytes)
+{
+	return Arena_Alloc(&permarena, numbytes, 16);
+}
+
+// temporaries that die at the end of the current frame or job
+static void *Mem_FrameAlloc(size_t numbytes)
+{
+	return Arena_Alloc(Mem_ThreadArena(), numbytes, 16);
+}
+
+static void Mem_EndFrame()
+{
+	Arena_Reset(Mem_ThreadArena());
+}
+
 // ==============================================
 // vector utils
 
@@ -111,15 +235,20 @@ static void Vec2_Copy(float a[2], float b[2])
 	a[1] = b[1];
 }
 
-static void Vec2_Normalize(float *v)
+// returns the length, a zero length vector is left alone
+static float Vec2_Normalize(float *v)
 {
 	float len, invlen;
 
 	len = sqrtf((v[0] * v[0]) + (v[1] * v[1]));
+	if (!len)
+		return 0.0f;
 	invlen = 1.0f / len;
 
 	v[0] *= invlen;
 	v[1] *= invlen;
+
+	return len;
 }
 
 // return the circular distance
@@ -163,6 +292,8 @@ static float PlaneDistance(float abc[3], float xy[2])
 // Called every frame to process the current mouse input state
 // We only get updates when the mouse moves so the current mouse
 // position is stored and may be used for mulitple frames
+static bool lbuttonclicked;
+
 static void ProcessInput()
 {
 	// mousepos has current "frame" mouse pos
@@ -239,250 +370,2201 @@ static float RoundedBoxDistance(float halfsize[2], float r, float p[2])
 	d[0] = fabs(p[0]) - halfsize[0];
 	d[1] = fabs(p[1]) - halfsize[1];
 
-	if (d[0] >= 0.0f && d[1] >= 0.0f)
+	if (d[0] >= 0.0f && d[1] >= 0.0f)
+	{
+		float d2[2] = { d[0], d[1] };
+		return Vec2_Length(d2) - r;
+	}
+	else
+	{
+		float d2[2] = { max(d[0] - r, 0.0f), max(d[1] - r, 0.0f) };
+		return min(max(d[0] - r, d[1] - r), 0.0f) + Vec2_Length(d2);
+	}
+#if 0
+	else if (d[1] >= 0.0f)
+	{
+		return d[1] - r;
+	}
+	else if (d[0] >= 0.0f)
+	{
+		return d[0] - r;
+	}
+	else
+	{
+		return max(d[0] - r, d[1] - r);
+	}
+#endif
+}
+
+// ==============================================
+// map
+//
+// the world is mapw x maph cells and '1' is solid. without a map file
+// it's the builtin room below. a map file has a line of '0' and '1' per
+// row and, like data[], the first line is row 0 at the bottom of the
+// world. short lines are padded with empty cells. anything off the edge
+// of the map is solid
+
+static char data [] =
+{
+	"11111111"
+	"10000001"
+	"10011001"
+	"10011001"
+	"10001001"
+	"10000001"
+	"10000001"
+	"11111111"
+};
+
+// occupancy is kept as bits. by default it's 64 cells to a word along
+// each row, bit n of a word holding the cell n to the right of the word's
+// first. built with MAP_MORTON (make LAYOUT=morton) a word holds an 8 x 8
+// block instead, bit n of byte r being cell n of the block's row r, and
+// the blocks of each MAP_TILE_BLOCKS square tile are stored in Morton
+// order so the cells around a point share a cache line or two instead of
+// taking a line per row. the region queries below mask off the cells
+// they weren't asked about and answer a word at a time, so empty space
+// costs a word test rather than a test per cell. bits past the edge of
+// the map are never read
+//
+// a streamed map has no map bits at all. it's split into
+// STREAM_CHUNK_SIZE square chunks and a resident chunk's cells are a 32
+// bit word per row in the streaming slot holding it, in either layout.
+// mapchunks points at those rows and a chunk without any reads as solid,
+// so the memory follows the resident chunks rather than the world
+
+#define STREAM_CHUNK_SHIFT	5
+#define STREAM_CHUNK_SIZE	(1 << STREAM_CHUNK_SHIFT)
+
+static uint64_t *mapbits;
+static uint32_t **mapchunks;		// NULL unless streaming
+static int mapchunksx, mapchunksy;
+static int mapw;
+static int maph;
+
+#ifdef MAP_MORTON
+#define MAP_TILE_SHIFT		4
+#define MAP_TILE_BLOCKS		(1 << MAP_TILE_SHIFT)
+
+static int mapblocksx, mapblocksy;
+static int maptilesx;
+#else
+static int mapwords;		// words in a row
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static int Bits_Count(uint64_t bits) { return (int)__popcnt64(bits); }
+static int Bits_First(uint64_t bits) { unsigned long i; _BitScanForward64(&i, bits); return (int)i; }
+#else
+static int Bits_Count(uint64_t bits) { return __builtin_popcountll(bits); }
+static int Bits_First(uint64_t bits) { return __builtin_ctzll(bits); }
+#endif
+
+// the bits of a width cell span starting at first that fall in x0 to x1
+// (exclusive)
+static uint64_t Map_SpanMask(int first, int width, int x0, int x1)
+{
+	int lo = x0 - first;
+	int hi = x1 - first;
+	lo = max(lo, 0);
+	hi = min(hi, width);
+	if (hi <= lo)
+		return 0;
+
+	uint64_t mask = hi == 64 ? ~0ull : (1ull << hi) - 1;
+	return mask & (~0ull << lo);
+}
+
+#ifdef MAP_MORTON
+// spreads the low bits of v out to every other bit
+static int Map_Spread(int v)
+{
+	v = (v | (v << 2)) & 0x33;
+	v = (v | (v << 1)) & 0x55;
+	return v;
+}
+
+static uint64_t *Map_Block(int bx, int by)
+{
+	int tile = (by >> MAP_TILE_SHIFT) * maptilesx + (bx >> MAP_TILE_SHIFT);
+	int inside = Map_Spread(bx & (MAP_TILE_BLOCKS - 1)) | (Map_Spread(by & (MAP_TILE_BLOCKS - 1)) << 1);
+	return &mapbits[tile * MAP_TILE_BLOCKS * MAP_TILE_BLOCKS + inside];
+}
+#endif
+
+// an empty w x h map
+static void Map_Alloc(int w, int h)
+{
+#ifdef MAP_MORTON
+	mapblocksx = (w + 7) / 8;
+	mapblocksy = (h + 7) / 8;
+	maptilesx = (mapblocksx + MAP_TILE_BLOCKS - 1) / MAP_TILE_BLOCKS;
+	int maptilesy = (mapblocksy + MAP_TILE_BLOCKS - 1) / MAP_TILE_BLOCKS;
+	size_t numwords = (size_t)maptilesx * maptilesy * MAP_TILE_BLOCKS * MAP_TILE_BLOCKS;
+#else
+	mapwords = (w + 63) / 64;
+	size_t numwords = (size_t)mapwords * h;
+#endif
+
+	mapbits = (uint64_t*)calloc(numwords, sizeof(uint64_t));
+	if (!mapbits)
+		Error("Map_Alloc: out of memory for a %i x %i map\n", w, h);
+
+	mapw = w;
+	maph = h;
+}
+
+// a w x h map made of chunks, none of them resident
+static void Map_AllocChunks(int w, int h)
+{
+	mapchunksx = (w + STREAM_CHUNK_SIZE - 1) / STREAM_CHUNK_SIZE;
+	mapchunksy = (h + STREAM_CHUNK_SIZE - 1) / STREAM_CHUNK_SIZE;
+	mapchunks = (uint32_t**)calloc((size_t)mapchunksx * mapchunksy, sizeof(uint32_t*));
+	if (!mapchunks)
+		Error("Map_AllocChunks: out of memory for a %i x %i map\n", w, h);
+
+	mapw = w;
+	maph = h;
+}
+
+// the row of the chunk holding x, y, or NULL if it isn't resident
+static uint32_t *Map_ChunkRow(int x, int y)
+{
+	uint32_t *rows = mapchunks[(y >> STREAM_CHUNK_SHIFT) * mapchunksx + (x >> STREAM_CHUNK_SHIFT)];
+	return rows ? &rows[y & (STREAM_CHUNK_SIZE - 1)] : NULL;
+}
+
+// anything off the edge of the map is solid
+static bool Map_Solid(int x, int y)
+{
+	if (x < 0 || y < 0 || x >= mapw || y >= maph)
+		return true;
+
+	if (mapchunks)
+	{
+		const uint32_t *row = Map_ChunkRow(x, y);
+		return !row || ((*row >> (x & (STREAM_CHUNK_SIZE - 1))) & 1);
+	}
+
+#ifdef MAP_MORTON
+	return (*Map_Block(x >> 3, y >> 3) >> (((y & 7) << 3) | (x & 7))) & 1;
+#else
+	return (mapbits[y * mapwords + (x >> 6)] >> (x & 63)) & 1;
+#endif
+}
+
+// a chunk that isn't resident can't be changed
+static void Map_SetSolid(int x, int y, bool solid)
+{
+	if (mapchunks)
+	{
+		uint32_t *row = Map_ChunkRow(x, y);
+		uint32_t bit = 1u << (x & (STREAM_CHUNK_SIZE - 1));
+		if (row)
+			*row = solid ? *row | bit : *row & ~bit;
+		return;
+	}
+
+#ifdef MAP_MORTON
+	uint64_t *word = Map_Block(x >> 3, y >> 3);
+	uint64_t bit = 1ull << (((y & 7) << 3) | (x & 7));
+#else
+	uint64_t *word = &mapbits[y * mapwords + (x >> 6)];
+	uint64_t bit = 1ull << (x & 63);
+#endif
+
+	if (solid)
+		*word |= bit;
+	else
+		*word &= ~bit;
+}
+
+// the first solid cell in row y from x0 up to x1 (exclusive), or -1. the
+// cells of a rectangle are walked with
+// for (x = Map_FirstSolid(y, x0, x1); x >= 0; x = Map_FirstSolid(y, x + 1, x1))
+static int Map_FirstSolid(int y, int x0, int x1)
+{
+	x0 = max(x0, 0);
+	x1 = min(x1, mapw);
+	if (y < 0 || y >= maph || x0 >= x1)
+		return -1;
+
+	if (mapchunks)
+	{
+		for (int cx = x0 >> STREAM_CHUNK_SHIFT; cx <= (x1 - 1) >> STREAM_CHUNK_SHIFT; cx++)
+		{
+			const uint32_t *row = Map_ChunkRow(cx * STREAM_CHUNK_SIZE, y);
+			uint64_t bits = (row ? *row : ~0u) & Map_SpanMask(cx * STREAM_CHUNK_SIZE, STREAM_CHUNK_SIZE, x0, x1);
+			if (bits)
+				return cx * STREAM_CHUNK_SIZE + Bits_First(bits);
+		}
+		return -1;
+	}
+
+#ifdef MAP_MORTON
+	int shift = (y & 7) << 3;
+	for (int bx = x0 >> 3; bx <= (x1 - 1) >> 3; bx++)
+	{
+		uint64_t bits = (*Map_Block(bx, y >> 3) >> shift) & Map_SpanMask(bx * 8, 8, x0, x1);
+		if (bits)
+			return bx * 8 + Bits_First(bits);
+	}
+#else
+	const uint64_t *row = &mapbits[y * mapwords];
+	for (int word = x0 >> 6; word <= (x1 - 1) >> 6; word++)
+	{
+		uint64_t bits = row[word] & Map_SpanMask(word * 64, 64, x0, x1);
+		if (bits)
+			return word * 64 + Bits_First(bits);
+	}
+#endif
+
+	return -1;
+}
+
+// the number of solid cells in x0, y0 to x1, y1 (exclusive) on the map
+static int Map_CountSolid(int x0, int y0, int x1, int y1)
+{
+	x0 = max(x0, 0);
+	y0 = max(y0, 0);
+	x1 = min(x1, mapw);
+	y1 = min(y1, maph);
+	if (x0 >= x1 || y0 >= y1)
+		return 0;
+
+	int count = 0;
+
+	if (mapchunks)
+	{
+		for (int y = y0; y < y1; y++)
+		{
+			for (int cx = x0 >> STREAM_CHUNK_SHIFT; cx <= (x1 - 1) >> STREAM_CHUNK_SHIFT; cx++)
+			{
+				const uint32_t *row = Map_ChunkRow(cx * STREAM_CHUNK_SIZE, y);
+				uint64_t mask = Map_SpanMask(cx * STREAM_CHUNK_SIZE, STREAM_CHUNK_SIZE, x0, x1);
+				count += Bits_Count((row ? *row : ~0u) & mask);
+			}
+		}
+		return count;
+	}
+
+#ifdef MAP_MORTON
+	// a byte per row of the block, the column mask repeated in each
+	for (int by = y0 >> 3; by <= (y1 - 1) >> 3; by++)
+	{
+		uint64_t rows = Map_SpanMask(by * 64, 64, y0 * 8, y1 * 8);
+		for (int bx = x0 >> 3; bx <= (x1 - 1) >> 3; bx++)
+		{
+			uint64_t mask = rows & (Map_SpanMask(bx * 8, 8, x0, x1) * 0x0101010101010101ull);
+			count += Bits_Count(*Map_Block(bx, by) & mask);
+		}
+	}
+#else
+	for (int y = y0; y < y1; y++)
+	{
+		const uint64_t *row = &mapbits[y * mapwords];
+		for (int word = x0 >> 6; word <= (x1 - 1) >> 6; word++)
+		{
+			uint64_t mask = Map_SpanMask(word * 64, 64, x0, x1);
+			count += Bits_Count(row[word] & mask);
+		}
+	}
+#endif
+
+	return count;
+}
+
+// the builtin room
+static void Map_Init()
+{
+	Map_Alloc(8, 8);
+
+	for (int y = 0; y < maph; y++)
+		for (int x = 0; x < mapw; x++)
+			Map_SetSolid(x, y, data[y * 8 + x] == '1');
+}
+
+// ==============================================
+// chunk streaming
+//
+// with -stream the map file isn't read up front. the world is split
+// into STREAM_CHUNK_SIZE square chunks and the ones within the prefetch
+// radius of the player are read by a worker thread into a fixed pool of
+// slots, nearest first. chunks outside the radius keep their slot until
+// it's needed and then go least recently wanted first. a cell in a chunk
+// that isn't resident reads as solid, so while a chunk is on its way the
+// player is held back rather than walking through walls that haven't
+// arrived. the worker reads a chunk into its slot's rows and the main
+// thread points the map at them once the slot's handed back, so the
+// slots are the only cell storage there is
+
+#define MAX_STREAM_SLOTS	256
+#define MAX_STREAM_RADIUS	5
+#define MAX_STREAM_SAMPLES	4096
+
+typedef struct streamslot_s
+{
+	uint32_t rows[STREAM_CHUNK_SIZE];	// the chunk's cells once it's resident
+	int chunk;				// -1 when the slot is free
+	bool loading;
+	bool modified;			// edited, kept since it can't be written back
+	int lastwanted;			// tick it was last inside the prefetch radius
+	double requesttime;		// ms
+	struct streamslot_s *next;
+
+} streamslot_t;
+
+typedef struct streamstats_s
+{
+	int loads;
+	int evictions;
+	int poolfull;
+
+	// stalls are ticks where the cells around the player weren't resident
+	int stalls;
+	int stallticks;
+	double stallms;
+	double stallstart;
+
+	double latency[MAX_STREAM_SAMPLES];
+	int numsamples;
+
+} streamstats_t;
+
+static bool streaming = false;
+static int streamradius = 2;
+static int streamfd = -1;
+static long *streamrowofs;
+static int *streamrowlen;
+static int *streamchunks;		// slot of each chunk, -1 when not resident
+static streamslot_t streamslots[MAX_STREAM_SLOTS];
+static int streamtick;
+static streamstats_t streamstats;
+
+static pthread_t streamthread;
+static pthread_mutex_t streamlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t streamcond = PTHREAD_COND_INITIALIZER;
+static streamslot_t *streampending, *streampendingtail;
+static streamslot_t *streamfinished;
+
+// reads the rows of a chunk straight out of the map file. runs on the
+// worker and only touches the slot's rows
+static void Stream_ReadChunk(streamslot_t *slot)
+{
+	int x0 = (slot->chunk % mapchunksx) * STREAM_CHUNK_SIZE;
+	int y0 = (slot->chunk / mapchunksx) * STREAM_CHUNK_SIZE;
+	char row[STREAM_CHUNK_SIZE];
+
+	memset(slot->rows, 0, sizeof(slot->rows));
+
+	for (int r = 0; r < STREAM_CHUNK_SIZE && y0 + r < maph; r++)
+	{
+		int n = min(STREAM_CHUNK_SIZE, streamrowlen[y0 + r] - x0);
+		if (n <= 0)
+			continue;
+
+		if (pread(streamfd, row, n, streamrowofs[y0 + r] + x0) != n)
+			Error("Stream_ReadChunk: read failed\n");
+
+		for (int i = 0; i < n; i++)
+		{
+			if (row[i] == '1')
+				slot->rows[r] |= 1u << i;
+		}
+	}
+}
+
+static void *Stream_Worker(void *arg)
+{
+	for (;;)
+	{
+		pthread_mutex_lock(&streamlock);
+		while (!streampending)
+			pthread_cond_wait(&streamcond, &streamlock);
+		streamslot_t *slot = streampending;
+		streampending = slot->next;
+		if (!streampending)
+			streampendingtail = NULL;
+		pthread_mutex_unlock(&streamlock);
+
+		Stream_ReadChunk(slot);
+
+		pthread_mutex_lock(&streamlock);
+		slot->next = streamfinished;
+		streamfinished = slot;
+		pthread_mutex_unlock(&streamlock);
+	}
+
+	return NULL;
+}
+
+static int Stream_CompareMs(const void *a, const void *b)
+{
+	double da = *(const double*)a;
+	double db = *(const double*)b;
+	return (da > db) - (da < db);
+}
+
+static void Stream_PrintStats()
+{
+	streamstats_t *ss = &streamstats;
+
+	printf("stream: %i loads, %i evictions, %i requests with the pool full\n",
+		ss->loads, ss->evictions, ss->poolfull);
+	printf("stream: %i stalls, %i ticks, %.1f ms waiting for chunks around the player\n",
+		ss->stalls, ss->stallticks, ss->stallms);
+
+	if (ss->numsamples)
+	{
+		qsort(ss->latency, ss->numsamples, sizeof(double), Stream_CompareMs);
+		printf("stream: load latency p50 %.3f ms, p95 %.3f ms, max %.3f ms\n",
+			ss->latency[ss->numsamples / 2], ss->latency[(ss->numsamples * 95) / 100], ss->latency[ss->numsamples - 1]);
+	}
+}
+
+static int streamrows, streammaxrows;
+
+static void Stream_AddRow(long ofs, int len)
+{
+	if (streamrows == streammaxrows)
+	{
+		streammaxrows = streammaxrows ? streammaxrows * 2 : 1024;
+		streamrowofs = (long*)realloc(streamrowofs, streammaxrows * sizeof(long));
+		streamrowlen = (int*)realloc(streamrowlen, streammaxrows * sizeof(int));
+		if (!streamrowofs || !streamrowlen)
+			Error("Stream_AddRow: out of memory\n");
+	}
+
+	streamrowofs[streamrows] = ofs;
+	streamrowlen[streamrows] = len;
+	streamrows++;
+}
+
+// indexes the rows of the map file so chunks can be read from it
+// directly, then starts the worker. nothing is resident until the first
+// Stream_Update
+static void Stream_Open(const char *filename)
+{
+	streamfd = open(filename, O_RDONLY);
+	if (streamfd < 0)
+		Error("Stream_Open: couldn't open \"%s\"\n", filename);
+
+	// the widest line sets the width, like Map_Load
+	static char buffer[65536];
+	long base = 0, rowstart = 0;
+	int w = 0, len = 0;
+	for (;;)
+	{
+		int n = read(streamfd, buffer, sizeof(buffer));
+		if (n < 0)
+			Error("Stream_Open: couldn't read \"%s\"\n", filename);
+		if (!n)
+			break;
+
+		for (int i = 0; i < n; i++)
+		{
+			if (buffer[i] != '\n')
+			{
+				if (buffer[i] != '\r')
+					len++;
+				continue;
+			}
+
+			Stream_AddRow(rowstart, len);
+			w = max(w, len);
+			len = 0;
+			rowstart = base + i + 1;
+		}
+
+		base += n;
+	}
+
+	if (len)
+	{
+		Stream_AddRow(rowstart, len);
+		w = max(w, len);
+	}
+
+	int h = streamrows;
+	if (!w || !h)
+		Error("Stream_Open: \"%s\" is empty\n", filename);
+
+	Map_AllocChunks(w, h);
+	streaming = true;
+
+	streamchunks = (int*)Mem_Alloc(mapchunksx * mapchunksy * sizeof(int));
+	for (int i = 0; i < mapchunksx * mapchunksy; i++)
+		streamchunks[i] = -1;
+	for (int i = 0; i < MAX_STREAM_SLOTS; i++)
+		streamslots[i].chunk = -1;
+
+	streamradius = max(0, min(streamradius, MAX_STREAM_RADIUS));
+
+	if (pthread_create(&streamthread, NULL, Stream_Worker, NULL))
+		Error("Stream_Open: failed to start the worker\n");
+
+	atexit(Stream_PrintStats);
+
+	printf("streaming \"%s\", %i x %i in %i x %i chunks\n", filename, mapw, maph, mapchunksx, mapchunksy);
+}
+
+static void Map_Load(const char *filename)
+{
+	FILE *fp = fopen(filename, "rb");
+	if (!fp)
+		Error("Map_Load: couldn't open \"%s\"\n", filename);
+
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	char *text = (char*)malloc(size);
+	if (!text || fread(text, 1, size, fp) != (size_t)size)
+		Error("Map_Load: couldn't read \"%s\"\n", filename);
+	fclose(fp);
+
+	// the widest line sets the width
+	int w = 0, h = 0, len = 0;
+	for (long i = 0; i < size; i++)
+	{
+		if (text[i] == '\n')
+		{
+			w = max(w, len);
+			h++;
+			len = 0;
+		}
+		else if (text[i] != '\r')
+			len++;
+	}
+	if (len)
+	{
+		w = max(w, len);
+		h++;
+	}
+
+	if (!w || !h)
+		Error("Map_Load: \"%s\" is empty\n", filename);
+
+	Map_Alloc(w, h);
+
+	for (long i = 0, x = 0, y = 0; i < size; i++)
+	{
+		if (text[i] == '\n')
+		{
+			x = 0;
+			y++;
+		}
+		else if (text[i] != '\r')
+		{
+			if (text[i] == '1')
+				Map_SetSolid(x, y, true);
+			x++;
+		}
+	}
+
+	free(text);
+
+	printf("loaded \"%s\", %i x %i\n", filename, mapw, maph);
+}
+
+// ==============================================
+// dynamic primitives
+//
+// moving geometry like platforms and doors isn't part of the cells. it's
+// a short list of primitives evaluated live and min-combined with the
+// static field, so moving one never touches the pyramid or the baked
+// field texture. every tick they move and are hashed by their bounds
+// into DYN_BUCKET_SIZE square buckets, and a query only tests the ones
+// in the buckets its search area covers. the cost follows the dynamics
+// near the point rather than all of them
+
+#define MAX_DYNAMICS		256
+#define MAX_DYN_ENTRIES		4096
+#define DYN_BUCKET_SIZE		4.0f
+#define DYN_HASH_SIZE		1024		// power of two
+#define DYN_MAX_BUCKETS		16			// bigger than this goes on the always tested list
+
+typedef enum
+{
+	dyn_box,
+	dyn_roundedbox,
+	dyn_circle,
+	NUM_DYN_TYPES
+
+} dyntype_t;
+
+typedef struct dynprim_s
+{
+	dyntype_t type;
+	float halfsize[2];		// boxes
+	float radius;			// rounding, or the circle's radius
+
+	// where it is this tick
+	float origin[2];
+	float angle;
+
+	// slides from base to base + travel and back every period ticks,
+	// turning spin radians a tick
+	float base[2];
+	float travel[2];
+	int period;
+	float spin;
+
+	float mins[2], maxs[2];
+	int querystamp;
+
+} dynprim_t;
+
+typedef struct dynentry_s
+{
+	int prim;
+	int next;
+
+} dynentry_t;
+
+typedef struct dynstats_s
+{
+	long long queries;
+	long long tested;		// primitives evaluated
+	long long brute;		// queries too wide for the buckets
+
+} dynstats_t;
+
+static dynprim_t dynprims[MAX_DYNAMICS];
+static int numdynprims;
+static int dyntick;
+static int dynstamp;
+
+static int dynhash[DYN_HASH_SIZE];
+static dynentry_t dynentries[MAX_DYN_ENTRIES];
+static int numdynentries;
+static int dynlarge[MAX_DYNAMICS];
+static int numdynlarge;
+static dynstats_t dynstats;
+
+static void Dyn_PrintStats()
+{
+	dynstats_t *ds = &dynstats;
+
+	printf("dynamics: %i primitives, %lld queries, %.2f tested a query, %lld too wide for the buckets\n",
+		numdynprims, ds->queries, ds->queries ? (double)ds->tested / ds->queries : 0.0, ds->brute);
+}
+
+static dynprim_t *Dyn_Add(dyntype_t type, const float origin[2])
+{
+	if (numdynprims == MAX_DYNAMICS)
+		Error("Dyn_Add: MAX_DYNAMICS\n");
+	if (!numdynprims)
+		atexit(Dyn_PrintStats);
+
+	dynprim_t *prim = &dynprims[numdynprims++];
+	memset(prim, 0, sizeof(*prim));
+	prim->type = type;
+	prim->base[0] = prim->origin[0] = origin[0];
+	prim->base[1] = prim->origin[1] = origin[1];
+	prim->halfsize[0] = prim->halfsize[1] = 0.5f;
+	prim->querystamp = -1;
+
+	return prim;
+}
+
+static int Dyn_Hash(int bx, int by)
+{
+	return (int)(((unsigned)bx * 73856093u) ^ ((unsigned)by * 19349663u)) & (DYN_HASH_SIZE - 1);
+}
+
+static float Dyn_PrimDistance(dynprim_t *prim, const float p[2])
+{
+	// into the primitive's frame
+	float dx = p[0] - prim->origin[0];
+	float dy = p[1] - prim->origin[1];
+	float c = cosf(prim->angle);
+	float s = sinf(prim->angle);
+	float local[2] = { c * dx + s * dy, -s * dx + c * dy };
+
+	switch (prim->type)
+	{
+	case dyn_box:
+		return BoxDistance(prim->halfsize, local);
+	case dyn_roundedbox:
+		return RoundedBoxDistance(prim->halfsize, prim->radius, local);
+	default:
+		return CircleDistance(local, prim->radius);
+	}
+}
+
+// moves everything and hashes it again, called once a tick
+static void Dyn_Frame()
+{
+	dyntick++;
+
+	for (int i = 0; i < DYN_HASH_SIZE; i++)
+		dynhash[i] = -1;
+	numdynentries = 0;
+	numdynlarge = 0;
+
+	for (int i = 0; i < numdynprims; i++)
+	{
+		dynprim_t *prim = &dynprims[i];
+
+		float f = 0.0f;
+		if (prim->period > 0)
+			f = 0.5f - 0.5f * cosf(2.0f * PI * (float)(dyntick % prim->period) / (float)prim->period);
+		prim->origin[0] = prim->base[0] + f * prim->travel[0];
+		prim->origin[1] = prim->base[1] + f * prim->travel[1];
+		prim->angle += prim->spin;
+
+		// bounds that hold it at any angle
+		float reach = prim->radius;
+		if (prim->type != dyn_circle)
+			reach += Vec2_Length(prim->halfsize);
+		prim->mins[0] = prim->origin[0] - reach;
+		prim->mins[1] = prim->origin[1] - reach;
+		prim->maxs[0] = prim->origin[0] + reach;
+		prim->maxs[1] = prim->origin[1] + reach;
+
+		int bx0 = (int)floorf(prim->mins[0] / DYN_BUCKET_SIZE);
+		int by0 = (int)floorf(prim->mins[1] / DYN_BUCKET_SIZE);
+		int bx1 = (int)floorf(prim->maxs[0] / DYN_BUCKET_SIZE);
+		int by1 = (int)floorf(prim->maxs[1] / DYN_BUCKET_SIZE);
+		int numbuckets = (bx1 - bx0 + 1) * (by1 - by0 + 1);
+
+		if (numbuckets > DYN_MAX_BUCKETS || numdynentries + numbuckets > MAX_DYN_ENTRIES)
+		{
+			dynlarge[numdynlarge++] = i;
+			continue;
+		}
+
+		for (int by = by0; by <= by1; by++)
+		{
+			for (int bx = bx0; bx <= bx1; bx++)
+			{
+				int h = Dyn_Hash(bx, by);
+				dynentry_t *e = &dynentries[numdynentries];
+				e->prim = i;
+				e->next = dynhash[h];
+				dynhash[h] = numdynentries++;
+			}
+		}
+	}
+}
+
+// tests a primitive unless this query already has, returning the
+// smaller of best and its distance
+static float Dyn_Test(int index, const float p[2], float best)
+{
+	dynprim_t *prim = &dynprims[index];
+
+	if (prim->querystamp == dynstamp)
+		return best;
+	prim->querystamp = dynstamp;
+
+	// the distance to the bounds can't be more than to the primitive
+	float out[2] = { max(prim->mins[0] - p[0], p[0] - prim->maxs[0]), max(prim->mins[1] - p[1], p[1] - prim->maxs[1]) };
+	if (out[0] >= best || out[1] >= best)
+		return best;
+
+	dynstats.tested++;
+	float d = Dyn_PrimDistance(prim, p);
+	return min(best, d);
+}
+
+// the smaller of best and the distance to the nearest dynamic primitive.
+// only primitives within best of p can change the answer so only the
+// buckets that far around p are looked at
+static float Dyn_Distance(const float p[2], float best)
+{
+	if (!numdynprims)
+		return best;
+
+	dynstats.queries++;
+	dynstamp++;
+
+	for (int i = 0; i < numdynlarge; i++)
+		best = Dyn_Test(dynlarge[i], p, best);
+
+	// inside something already, still anything overlapping p can go deeper
+	float reach = min(best, 1e6f);
+	reach = max(reach, 0.0f);
+	int bx0 = (int)floorf((p[0] - reach) / DYN_BUCKET_SIZE);
+	int by0 = (int)floorf((p[1] - reach) / DYN_BUCKET_SIZE);
+	int bx1 = (int)floorf((p[0] + reach) / DYN_BUCKET_SIZE);
+	int by1 = (int)floorf((p[1] + reach) / DYN_BUCKET_SIZE);
+
+	// wider than the table, it's quicker to test everything
+	if ((double)(bx1 - bx0 + 1) * (by1 - by0 + 1) > DYN_HASH_SIZE)
+	{
+		dynstats.brute++;
+		for (int i = 0; i < numdynprims; i++)
+			best = Dyn_Test(i, p, best);
+		return best;
+	}
+
+	for (int by = by0; by <= by1; by++)
+	{
+		for (int bx = bx0; bx <= bx1; bx++)
+		{
+			for (int e = dynhash[Dyn_Hash(bx, by)]; e >= 0; e = dynentries[e].next)
+				best = Dyn_Test(dynentries[e].prim, p, best);
+		}
+	}
+
+	return best;
+}
+
+static bool Dyn_DistanceAtLeast(const float p[2], float dist)
+{
+	return Dyn_Distance(p, dist) >= dist;
+}
+
+// scatters count random moving primitives over the empty cells
+static void Dyn_SpawnMovers(int count)
+{
+	srand(1);
+
+	for (int i = 0; i < count && numdynprims < MAX_DYNAMICS; i++)
+	{
+		int x = 0, y = 0;
+		for (int tries = 0; tries < 100; tries++)
+		{
+			x = rand() % mapw;
+			y = rand() % maph;
+			if (!Map_Solid(x, y))
+				break;
+		}
+
+		float origin[2] = { x + 0.5f, y + 0.5f };
+		dynprim_t *prim = Dyn_Add((dyntype_t)(i % NUM_DYN_TYPES), origin);
+		prim->halfsize[0] = 0.2f + 0.3f * (rand() % 100) / 100.0f;
+		prim->halfsize[1] = 0.1f + 0.2f * (rand() % 100) / 100.0f;
+		prim->radius = prim->type == dyn_circle ? 0.3f : 0.1f;
+		prim->travel[0] = (float)(rand() % 7 - 3);
+		prim->travel[1] = (float)(rand() % 7 - 3);
+		prim->period = 120 + rand() % 240;
+		if (i % 4 == 3)
+			prim->spin = 0.02f;
+	}
+}
+
+// ==============================================
+// distance pyramid
+//
+// level 0 holds, for every cell, the chessboard distance in cells to the
+// nearest solid cell, capped at PYRAMID_MAX_DIST. each level above holds
+// the smallest of the 2 x 2 nodes below it, so a node's value is a lower
+// bound on the distance from anywhere inside it to anything solid. a
+// query walks down from the coarsest level toward the cell holding the
+// point and stops as soon as a level proves the clearance it was asked
+// for, so movers in open space are answered by one or two lookups.
+// Distance uses the same bound to only look at the cells that can hold
+// the nearest solid one. edits mark a rectangle dirty and it's rebuilt
+// on the next query, which only has to look PYRAMID_MAX_DIST cells past
+// it since nothing further can change a capped value
+//
+// a streamed map has no pyramid over the world. each streaming slot has
+// the levels of its own chunk, from a node per cell up to one node for
+// the chunk, and they're recycled with the slot. a chunk that isn't
+// resident proves nothing. cells that aren't resident read as solid so
+// a chunk's distances stay a lower bound whatever its neighbours are
+// doing, and a chunk coming or going marks the chunks within
+// PYRAMID_MAX_DIST of it for a rebuild
+
+#define MAX_PYRAMID_LEVELS	16
+#define PYRAMID_MAX_DIST	32
+#define PYRAMID_CHUNK_LEVELS	(STREAM_CHUNK_SHIFT + 1)
+#define PYRAMID_CHUNK_NODES	1365	// 32 * 32 + 16 * 16 + ... + 1
+
+// where each level starts in a chunk's nodes
+static const int pyramidchunkofs[PYRAMID_CHUNK_LEVELS] = { 0, 1024, 1280, 1344, 1360, 1364 };
+
+// the radius the solid cells are rounded by in the field
+#define SOLID_RADIUS		0.3f
+
+typedef struct pyramidstats_s
+{
+	long long queries;
+	long long proven[MAX_PYRAMID_LEVELS];	// answered at each level
+	long long failed;						// reached level 0 without proving it
+	int rebuilds;
+	long long rebuildcells;
+
+} pyramidstats_t;
+
+typedef struct pyramid_s
+{
+	int numlevels;
+	int w[MAX_PYRAMID_LEVELS];
+	int h[MAX_PYRAMID_LEVELS];
+	unsigned char *levels[MAX_PYRAMID_LEVELS];
+
+	// cells that changed since the last rebuild, x1 and y1 exclusive
+	bool dirty;
+	int dirtymins[2], dirtymaxs[2];
+
+	// PYRAMID_CHUNK_NODES for each streaming slot when streaming
+	unsigned char *chunknodes;
+	bool chunkdirty[MAX_STREAM_SLOTS];
+
+	pyramidstats_t stats;
+
+} pyramid_t;
+
+static pyramid_t pyramid;
+
+static void Pyramid_PrintStats()
+{
+	pyramidstats_t *ps = &pyramid.stats;
+
+	printf("pyramid: %lld clearance queries, %lld not proven, %i rebuilds of %lld cells\n",
+		ps->queries, ps->failed, ps->rebuilds, ps->rebuildcells);
+	for (int i = pyramid.numlevels - 1; i >= 0; i--)
+	{
+		if (ps->proven[i])
+			printf("pyramid: level %i (%i x %i) proved %lld\n", i, pyramid.w[i], pyramid.h[i], ps->proven[i]);
+	}
+}
+
+// the capped distances of the cells in x0, y0 to x1, y1 (exclusive), a
+// row at a time into dist, found with a two pass chamfer. only solid
+// cells inside the area are seen
+static void Pyramid_Chamfer(unsigned char *dist, int x0, int y0, int x1, int y1)
+{
+	int w = x1 - x0;
+	int h = y1 - y0;
+
+	memset(dist, PYRAMID_MAX_DIST, (size_t)w * h);
+	for (int y = 0; y < h; y++)
+		for (int x = Map_FirstSolid(y0 + y, x0, x1); x >= 0; x = Map_FirstSolid(y0 + y, x + 1, x1))
+			dist[y * w + x - x0] = 0;
+
+	for (int y = 0; y < h; y++)
+	{
+		for (int x = 0; x < w; x++)
+		{
+			unsigned char d = dist[y * w + x];
+			if (x > 0)
+				d = min(d, dist[y * w + x - 1] + 1);
+			if (y > 0)
+			{
+				unsigned char *up = &dist[(y - 1) * w + x];
+				d = min(d, up[0] + 1);
+				if (x > 0)
+					d = min(d, up[-1] + 1);
+				if (x < w - 1)
+					d = min(d, up[1] + 1);
+			}
+			dist[y * w + x] = d;
+		}
+	}
+
+	for (int y = h - 1; y >= 0; y--)
+	{
+		for (int x = w - 1; x >= 0; x--)
+		{
+			unsigned char d = dist[y * w + x];
+			if (x < w - 1)
+				d = min(d, dist[y * w + x + 1] + 1);
+			if (y < h - 1)
+			{
+				unsigned char *down = &dist[(y + 1) * w + x];
+				d = min(d, down[0] + 1);
+				if (x > 0)
+					d = min(d, down[-1] + 1);
+				if (x < w - 1)
+					d = min(d, down[1] + 1);
+			}
+			dist[y * w + x] = d;
+		}
+	}
+}
+
+// recomputes level 0 for the cells in mins to maxs and the levels above
+// them. the chamfer covers the area grown by PYRAMID_MAX_DIST so solid
+// cells just outside are seen. a changed cell moves the distances up to
+// PYRAMID_MAX_DIST away, so after an edit this is called with the
+// changed cells grown by that much
+static void Pyramid_Rebuild(const int mins[2], const int maxs[2])
+{
+	pyramid_t *py = &pyramid;
+
+	int x0 = max(0, mins[0] - PYRAMID_MAX_DIST);
+	int y0 = max(0, mins[1] - PYRAMID_MAX_DIST);
+	int x1 = min(mapw, maxs[0] + PYRAMID_MAX_DIST);
+	int y1 = min(maph, maxs[1] + PYRAMID_MAX_DIST);
+	int w = x1 - x0;
+	int h = y1 - y0;
+
+	arenamarker_t marker = Arena_GetMarker(Mem_ThreadArena());
+	unsigned char *dist = (unsigned char*)Mem_FrameAlloc((size_t)w * h);
+	Pyramid_Chamfer(dist, x0, y0, x1, y1);
+
+	// only the rebuilt cells are copied out, the margin was just for reading
+	int cx0 = max(0, mins[0]);
+	int cy0 = max(0, mins[1]);
+	int cx1 = min(mapw, maxs[0]);
+	int cy1 = min(maph, maxs[1]);
+	for (int y = cy0; y < cy1; y++)
+		memcpy(py->levels[0] + y * mapw + cx0, dist + (y - y0) * w + (cx0 - x0), cx1 - cx0);
+
+	Arena_FreeToMarker(Mem_ThreadArena(), marker);
+
+	// each level above is the min of the nodes below
+	for (int l = 1; l < py->numlevels; l++)
+	{
+		cx0 >>= 1;
+		cy0 >>= 1;
+		cx1 = (cx1 + 1) >> 1;
+		cy1 = (cy1 + 1) >> 1;
+
+		unsigned char *below = py->levels[l - 1];
+		int bw = py->w[l - 1];
+		int bh = py->h[l - 1];
+
+		for (int y = cy0; y < cy1; y++)
+		{
+			for (int x = cx0; x < cx1; x++)
+			{
+				int bx = x * 2, by = y * 2;
+				unsigned char d = below[by * bw + bx];
+				if (bx + 1 < bw)
+					d = min(d, below[by * bw + bx + 1]);
+				if (by + 1 < bh)
+				{
+					d = min(d, below[(by + 1) * bw + bx]);
+					if (bx + 1 < bw)
+						d = min(d, below[(by + 1) * bw + bx + 1]);
+				}
+				py->levels[l][y * py->w[l] + x] = d;
+			}
+		}
+	}
+
+	py->stats.rebuilds++;
+	py->stats.rebuildcells += (long long)w * h;
+}
+
+// recomputes the nodes of the chunk in a streaming slot. cells past the
+// edge of the map are left at the cap so they don't drag the levels
+// above them down, nothing is ever asked about them
+static void Pyramid_RebuildChunk(int slot)
+{
+	pyramid_t *py = &pyramid;
+	unsigned char *nodes = py->chunknodes + slot * PYRAMID_CHUNK_NODES;
+
+	int chunk = streamslots[slot].chunk;
+	int cx0 = (chunk % mapchunksx) * STREAM_CHUNK_SIZE;
+	int cy0 = (chunk / mapchunksx) * STREAM_CHUNK_SIZE;
+	int cx1 = min(mapw, cx0 + STREAM_CHUNK_SIZE);
+	int cy1 = min(maph, cy0 + STREAM_CHUNK_SIZE);
+
+	int x0 = max(0, cx0 - PYRAMID_MAX_DIST);
+	int y0 = max(0, cy0 - PYRAMID_MAX_DIST);
+	int x1 = min(mapw, cx1 + PYRAMID_MAX_DIST);
+	int y1 = min(maph, cy1 + PYRAMID_MAX_DIST);
+	int w = x1 - x0;
+
+	arenamarker_t marker = Arena_GetMarker(Mem_ThreadArena());
+	unsigned char *dist = (unsigned char*)Mem_FrameAlloc((size_t)w * (y1 - y0));
+	Pyramid_Chamfer(dist, x0, y0, x1, y1);
+
+	memset(nodes, PYRAMID_MAX_DIST, STREAM_CHUNK_SIZE * STREAM_CHUNK_SIZE);
+	for (int y = cy0; y < cy1; y++)
+		memcpy(nodes + (y - cy0) * STREAM_CHUNK_SIZE, dist + (y - y0) * w + (cx0 - x0), cx1 - cx0);
+
+	Arena_FreeToMarker(Mem_ThreadArena(), marker);
+
+	for (int l = 1; l < PYRAMID_CHUNK_LEVELS; l++)
+	{
+		const unsigned char *below = nodes + pyramidchunkofs[l - 1];
+		unsigned char *level = nodes + pyramidchunkofs[l];
+		int bw = STREAM_CHUNK_SIZE >> (l - 1);
+		int size = STREAM_CHUNK_SIZE >> l;
+
+		for (int y = 0; y < size; y++)
+		{
+			for (int x = 0; x < size; x++)
+			{
+				const unsigned char *b = below + (y * 2) * bw + x * 2;
+				level[y * size + x] = min(min(b[0], b[1]), min(b[bw], b[bw + 1]));
+			}
+		}
+	}
+
+	py->stats.rebuilds++;
+	py->stats.rebuildcells += (long long)w * (y1 - y0);
+}
+
+// the level l node over cell x, y of a streamed map, or NULL when its
+// chunk isn't resident
+static const unsigned char *Pyramid_ChunkNode(int l, int x, int y)
+{
+	int slot = streamchunks[(y >> STREAM_CHUNK_SHIFT) * mapchunksx + (x >> STREAM_CHUNK_SHIFT)];
+	if (slot < 0 || streamslots[slot].loading)
+		return NULL;
+
+	int size = STREAM_CHUNK_SIZE >> l;
+	int nx = (x & (STREAM_CHUNK_SIZE - 1)) >> l;
+	int ny = (y & (STREAM_CHUNK_SIZE - 1)) >> l;
+	return pyramid.chunknodes + slot * PYRAMID_CHUNK_NODES + pyramidchunkofs[l] + ny * size + nx;
+}
+
+static void Pyramid_Init()
+{
+	pyramid_t *py = &pyramid;
+
+	atexit(Pyramid_PrintStats);
+
+	// the slots' chunks are built as they come in
+	if (streaming)
+	{
+		py->numlevels = PYRAMID_CHUNK_LEVELS;
+		for (int l = 0; l < PYRAMID_CHUNK_LEVELS; l++)
+			py->w[l] = py->h[l] = STREAM_CHUNK_SIZE >> l;
+
+		py->chunknodes = (unsigned char*)Mem_Alloc(MAX_STREAM_SLOTS * PYRAMID_CHUNK_NODES);
+		return;
+	}
+
+	// halve until a single node covers the map
+	int w = mapw, h = maph;
+	py->numlevels = 0;
+	for (;;)
+	{
+		if (py->numlevels == MAX_PYRAMID_LEVELS)
+			Error("Pyramid_Init: %i x %i is too big\n", mapw, maph);
+
+		py->w[py->numlevels] = w;
+		py->h[py->numlevels] = h;
+		py->levels[py->numlevels] = (unsigned char*)malloc((size_t)w * h);
+		if (!py->levels[py->numlevels])
+			Error("Pyramid_Init: out of memory for a %i x %i level\n", w, h);
+		py->numlevels++;
+
+		if (w == 1 && h == 1)
+			break;
+		w = (w + 1) >> 1;
+		h = (h + 1) >> 1;
+	}
+
+	int mins[2] = { 0, 0 };
+	int maxs[2] = { mapw, maph };
+	Pyramid_Rebuild(mins, maxs);
+	py->dirty = false;
+}
+
+// marks the cells in x0, y0 to x1, y1 (exclusive) as changed
+static void Pyramid_Invalidate(int x0, int y0, int x1, int y1)
+{
+	pyramid_t *py = &pyramid;
+
+	if (!py->numlevels)
+		return;
+
+	// every resident chunk within reach of the cells
+	if (streaming)
+	{
+		int cx0 = max(0, (x0 - PYRAMID_MAX_DIST) >> STREAM_CHUNK_SHIFT);
+		int cy0 = max(0, (y0 - PYRAMID_MAX_DIST) >> STREAM_CHUNK_SHIFT);
+		int cx1 = min(mapchunksx - 1, (x1 - 1 + PYRAMID_MAX_DIST) >> STREAM_CHUNK_SHIFT);
+		int cy1 = min(mapchunksy - 1, (y1 - 1 + PYRAMID_MAX_DIST) >> STREAM_CHUNK_SHIFT);
+
+		for (int cy = cy0; cy <= cy1; cy++)
+		{
+			for (int cx = cx0; cx <= cx1; cx++)
+			{
+				int slot = streamchunks[cy * mapchunksx + cx];
+				if (slot >= 0)
+				{
+					py->chunkdirty[slot] = true;
+					py->dirty = true;
+				}
+			}
+		}
+		return;
+	}
+
+	if (!py->dirty)
+	{
+		py->dirtymins[0] = x0;
+		py->dirtymins[1] = y0;
+		py->dirtymaxs[0] = x1;
+		py->dirtymaxs[1] = y1;
+		py->dirty = true;
+		return;
+	}
+
+	py->dirtymins[0] = min(py->dirtymins[0], x0);
+	py->dirtymins[1] = min(py->dirtymins[1], y0);
+	py->dirtymaxs[0] = max(py->dirtymaxs[0], x1);
+	py->dirtymaxs[1] = max(py->dirtymaxs[1], y1);
+}
+
+static void Pyramid_Update()
+{
+	pyramid_t *py = &pyramid;
+
+	if (!py->dirty)
+		return;
+
+	// a chunk still loading is marked again when it arrives
+	if (streaming)
+	{
+		for (int i = 0; i < MAX_STREAM_SLOTS; i++)
+		{
+			if (py->chunkdirty[i] && streamslots[i].chunk >= 0 && !streamslots[i].loading)
+				Pyramid_RebuildChunk(i);
+			py->chunkdirty[i] = false;
+		}
+		py->dirty = false;
+		return;
+	}
+
+	int mins[2] = { py->dirtymins[0] - PYRAMID_MAX_DIST, py->dirtymins[1] - PYRAMID_MAX_DIST };
+	int maxs[2] = { py->dirtymaxs[0] + PYRAMID_MAX_DIST, py->dirtymaxs[1] + PYRAMID_MAX_DIST };
+	Pyramid_Rebuild(mins, maxs);
+	py->dirty = false;
+}
+
+// the chessboard distance in cells from the cell holding p to the nearest
+// solid one, or -1 off the map. a cell that isn't resident is solid
+static int Pyramid_CellDistance(const float p[2])
+{
+	int x = (int)floorf(p[0]);
+	int y = (int)floorf(p[1]);
+	if (x < 0 || y < 0 || x >= mapw || y >= maph)
+		return -1;
+
+	Pyramid_Update();
+
+	if (streaming)
+	{
+		const unsigned char *node = Pyramid_ChunkNode(0, x, y);
+		return node ? *node : 0;
+	}
+
+	return pyramid.levels[0][y * mapw + x];
+}
+
+// true when Distance(p) is known to be at least dist, the dynamics
+// included. a node at chessboard
+// distance d from anything solid keeps every point inside it d - 1 cells
+// clear of the solid cells' boxes, less the rounding in the field
+static bool DistanceAtLeast(const float p[2], float dist)
+{
+	pyramid_t *py = &pyramid;
+
+	int x = (int)floorf(p[0]);
+	int y = (int)floorf(p[1]);
+	if (x < 0 || y < 0 || x >= mapw || y >= maph)
+		return false;
+
+	Pyramid_Update();
+	py->stats.queries++;
+
+	// anything capped can't prove more than the cap
+	float need = dist + SOLID_RADIUS + 1.0f;
+	if (need > PYRAMID_MAX_DIST)
+	{
+		py->stats.failed++;
+		return false;
+	}
+
+	for (int l = py->numlevels - 1; l >= 0; l--)
+	{
+		unsigned char d;
+		if (streaming)
+		{
+			const unsigned char *node = Pyramid_ChunkNode(l, x, y);
+			if (!node)
+				break;
+			d = *node;
+		}
+		else
+			d = py->levels[l][(y >> l) * py->w[l] + (x >> l)];
+
+		if (d >= need)
+		{
+			py->stats.proven[l]++;
+			return Dyn_DistanceAtLeast(p, dist);
+		}
+	}
+
+	py->stats.failed++;
+	return false;
+}
+
+// just the cells, what the field texture is baked from
+static float StaticDistance(float p[2])
+{
+	// the nearest solid cell is d cells away on the chessboard so it's
+	// within sqrt(2) * (d + 1) in the world, and a cell more than that
+	// many cells away can't be nearer. when nothing is within the cap a
+	// streamed map only has the chunks around the player and anything
+	// past the prefetch radius is too far away to matter
+	int x0 = 0, y0 = 0, x1 = mapw, y1 = maph;
+	int d0 = Pyramid_CellDistance(p);
+	if (d0 >= 0 && d0 < PYRAMID_MAX_DIST)
+	{
+		int reach = (int)ceilf(1.41422f * (d0 + 1)) + 1;
+		int px = (int)floorf(p[0]);
+		int py = (int)floorf(p[1]);
+		x0 = max(0, px - reach);
+		y0 = max(0, py - reach);
+		x1 = min(mapw, px + reach + 1);
+		y1 = min(maph, py + reach + 1);
+	}
+	else if (streaming)
+	{
+		int reach = (streamradius + 1) * STREAM_CHUNK_SIZE;
+		int px = (int)floorf(p[0]);
+		int py = (int)floorf(p[1]);
+		x0 = max(0, px - reach);
+		y0 = max(0, py - reach);
+		x1 = min(mapw, px + reach);
+		y1 = min(maph, py + reach);
+	}
+
+	float d = 1e30f;
+	for (int y = y0; y < y1; y++)
+	{
+		for (int x = Map_FirstSolid(y, x0, x1); x >= 0; x = Map_FirstSolid(y, x + 1, x1))
+		{
+			float center[2] = { x + 0.5f, y + 0.5f };
+			float half[2] = { 0.5f, 0.5f };
+
+			// convert p to the local box coodinate system
+			float pp[2] = { p[0] - center[0], p[1] - center[1] };
+		
+			// expand the bounds by the player
+			//half[0] += 0.1f;
+			//half[1] += 0.1f;
+
+			//float q = BoxDistance(half, pp);
+			float q = RoundedBoxDistance(half, SOLID_RADIUS, pp);
+
+			d = min(d, q);
+		}
+	}
+
+	return d;
+}
+
+// the cells and whatever dynamics are near enough to matter
+static float Distance(float p[2])
+{
+	return Dyn_Distance(p, StaticDistance(p));
+}
+
+static void Gradient(float grad[2], float p[2])
+{
+	float h = 0.01f;
+	float dx, dy;
+
+	float p0[2] = { p[0] - h, p[1] };
+	float p1[2] = { p[0] + h, p[1] };
+	dx = (Distance(p1) - Distance(p0)) / (2 * h);
+
+	float p2[2] = { p[0], p[1] - h };
+	float p3[2] = { p[0], p[1] + h };
+	dy = (Distance(p3) - Distance(p2)) / (2 * h);
+
+	grad[0] = dx;
+	grad[1] = dy;
+}
+
+// ==============================================
+// camera
+//
+// the camera follows the player and shows camera.height world units
+// from the bottom of the window to the top, the width following the
+// window's aspect. where the map is bigger than the view the view stays
+// on the map, where it isn't the map is centred. everything that draws
+// asks the view what's visible rather than assuming the whole world is
+// on screen
+
+#define CAMERA_FOLLOW		0.1f
+#define CAMERA_MIN_HEIGHT	2.0f
+#define CAMERA_ZOOM			1.25f
+
+typedef struct camera_s
+{
+	float origin[2];	// centre of the view
+	float height;
+	bool snap;			// jump straight to the target on the next update
+
+} camera_t;
+
+static camera_t camera = { { 4.0f, 4.0f }, 8.0f, true };
+
+// the part of the world on screen
+static float viewmins[2], viewmaxs[2];
+
+static void Camera_ViewSize(float size[2])
+{
+	size[0] = camera.height * renderwidth / max(renderheight, 1);
+	size[1] = camera.height;
+}
+
+// eases the camera toward target, called once a tick
+static void Camera_Follow(float target[2])
+{
+	float size[2];
+	Camera_ViewSize(size);
+
+	float mapsize[2] = { (float)mapw, (float)maph };
+	float rate = camera.snap ? 1.0f : CAMERA_FOLLOW;
+	camera.snap = false;
+
+	for (int i = 0; i < 2; i++)
+	{
+		float half = size[i] * 0.5f;
+		float goal = target[i];
+
+		if (size[i] >= mapsize[i])
+			goal = mapsize[i] * 0.5f;
+		else
+			goal = max(half, min(goal, mapsize[i] - half));
+
+		camera.origin[i] += (goal - camera.origin[i]) * rate;
+	}
+}
+
+static void Camera_Zoom(float scale)
+{
+	float maxheight = max(mapw, maph) * 2.0f;
+	camera.height = max(CAMERA_MIN_HEIGHT, min(camera.height * scale, maxheight));
+}
+
+// sets the view from the camera and loads the matching projection
+static void Camera_SetView()
+{
+	float size[2];
+	Camera_ViewSize(size);
+
+	for (int i = 0; i < 2; i++)
+	{
+		viewmins[i] = camera.origin[i] - size[i] * 0.5f;
+		viewmaxs[i] = camera.origin[i] + size[i] * 0.5f;
+	}
+
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	glOrtho(viewmins[0], viewmaxs[0], viewmins[1], viewmaxs[1], -1, 1);
+}
+
+static bool View_BoxVisible(const float mins[2], const float maxs[2])
+{
+	return mins[0] < viewmaxs[0] && maxs[0] > viewmins[0]
+		&& mins[1] < viewmaxs[1] && maxs[1] > viewmins[1];
+}
+
+// converts a window position to the world
+static void ScreenToWorld(float xy[2], int sx, int sy)
+{
+	// convert mouse position from screen to identity
+	xy[0] = (float)sx / (float)renderwidth;
+	xy[1] = 1.0f - ((float)sy / (float)renderheight);
+
+	// convert from identity to the view
+	xy[0] = viewmins[0] + xy[0] * (viewmaxs[0] - viewmins[0]);
+	xy[1] = viewmins[1] + xy[1] * (viewmaxs[1] - viewmins[1]);
+}
+
+static void DrawCursor()
+{
+	float xy[2], d, grad[2];
+
+	ScreenToWorld(xy, mousepos[0], mousepos[1]);
+
+	fprintf(stdout, "x, y: %2.2f, %2.2f\n", xy[0], xy[1]);
+
+	d = Distance(xy);
+	fprintf(stdout, "distance %f\n", d);
+
+	Gradient(grad, xy);
+	Vec2_Normalize(grad);
+	fprintf(stdout, "gradient %f, %f\n", grad[0], grad[1]);
+
+	glColor3f(1, 0, 0);
+	glBegin(GL_LINES);
+	glVertex2f(xy[0], xy[1]);
+	glVertex2f(xy[0] + (d * -grad[0]), xy[1] + (d * -grad[1]));
+	glEnd();
+}
+
+static double Sys_Milliseconds()
+{
+#ifdef WIN32
+	return (double)glutGet(GLUT_ELAPSED_TIME);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000.0) + (ts.tv_nsec / 1000000.0);
+#endif
+}
+
+// bakes the w * h block of the field texture starting at x0, y0 into
+// data. the texture covers mins to maxs in the world. the distance is
+// sampled once every step pixels and replicated across the step * step
+// block so coarse passes are cheap
+static void BuildTextureData(unsigned char *data, const float mins[2], const float maxs[2], int texw, int texh, int x0, int y0, int w, int h, int step)
+{
+	for (int y = 0; y < h; y += step)
+	{
+		for (int x = 0; x < w; x += step)
+		{
+			float xy[2];
+
+			// convert mouse position from screen to identity
+			xy[0] = (float)(x0 + x) / (float)texw;
+			//xy[1] = 1.0f - ((float)y / (float)renderheight);
+			xy[1] = (float)(y0 + y) / (float)texh;
+
+			// convert from identity to model pos
+			xy[0] = mins[0] + xy[0] * (maxs[0] - mins[0]);
+			xy[1] = mins[1] + xy[1] * (maxs[1] - mins[1]);
+
+			float d = StaticDistance(xy);
+			d = max(-1.0f, min(d, 1.0f));
+			d *= 32;
+
+			unsigned char texel[4];
+			texel[0] = max(0, d) + 50;
+			texel[1] = 0;
+			texel[2] = max(0, -d) + 50;
+			texel[3] = 255;
+
+			for (int by = y; by < y + step && by < h; by++)
+			{
+				for (int bx = x; bx < x + step && bx < w; bx++)
+				{
+					unsigned char *t = data + (by * w * 4) + (bx * 4);
+					*t++ = texel[0];
+					*t++ = texel[1];
+					*t++ = texel[2];
+					*t++ = texel[3];
+				}
+			}
+		}
+	}
+}
+
+// the field texture is rebuilt progressively. a new bake does a coarse
+// version of the whole texture straight away and then refines it one
+// tile at a time, spending at most FIELD_BAKE_BUDGET ms per frame.
+// starting another bake simply restarts the process so pending work is
+// dropped
+#define FIELD_COARSE_STEP	8
+#define FIELD_TILE_SIZE		64	// a multiple of FIELD_COARSE_STEP
+#define FIELD_BAKE_BUDGET	4.0
+#define FIELD_MAX_SIZE		4096
+
+typedef struct fieldbake_s
+{
+	int texw, texh;
+	float mins[2], maxs[2];		// the part of the world the texture covers
+	float density;				// texels per world unit
+	GLuint texture;
+	int tilesx, tilesy;
+	int nexttile;
+	double starttime;
+
+} fieldbake_t;
+
+static fieldbake_t fieldbake;
+
+static void Field_BeginBake(const float mins[2], const float maxs[2], float density)
+{
+	fieldbake_t *fb = &fieldbake;
+
+	int texw = min(max(1, (int)ceilf((maxs[0] - mins[0]) * density)), FIELD_MAX_SIZE);
+	int texh = min(max(1, (int)ceilf((maxs[1] - mins[1]) * density)), FIELD_MAX_SIZE);
+
+	fb->texw = texw;
+	fb->texh = texh;
+	fb->density = density;
+	for (int i = 0; i < 2; i++)
+	{
+		fb->mins[i] = mins[i];
+		fb->maxs[i] = maxs[i];
+	}
+
+	if (!fb->texture)
+		glGenTextures(1, &fb->texture);
+
+	printf("rebuilding texture data %i, %i\n", texw, texh);
+	glBindTexture(GL_TEXTURE_2D, fb->texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, texw, texh, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+	// the coarse pass covers the whole texture so there's never a hole.
+	// it goes up a strip of tile rows at a time so the scratch it needs is
+	// at most FIELD_MAX_SIZE * FIELD_TILE_SIZE texels whatever the window
+	for (int y0 = 0; y0 < texh; y0 += FIELD_TILE_SIZE)
+	{
+		int h = min(FIELD_TILE_SIZE, texh - y0);
+
+		arenamarker_t marker = Arena_GetMarker(Mem_ThreadArena());
+		unsigned char *data = (unsigned char*)Mem_FrameAlloc(texw * h * 4);
+		BuildTextureData(data, fb->mins, fb->maxs, texw, texh, 0, y0, texw, h, FIELD_COARSE_STEP);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y0, texw, h, GL_RGBA, GL_UNSIGNED_BYTE, data);
+		Arena_FreeToMarker(Mem_ThreadArena(), marker);
+	}
+
+	// restart the refinement, dropping anything left from the previous bake
+	fb->tilesx = (texw + FIELD_TILE_SIZE - 1) / FIELD_TILE_SIZE;
+	fb->tilesy = (texh + FIELD_TILE_SIZE - 1) / FIELD_TILE_SIZE;
+	fb->nexttile = 0;
+	fb->starttime = Sys_Milliseconds();
+}
+
+static void Field_RefineBake()
+{
+	fieldbake_t *fb = &fieldbake;
+	int numtiles = fb->tilesx * fb->tilesy;
+
+	if (fb->nexttile >= numtiles)
+		return;
+
+	double start = Sys_Milliseconds();
+
+	glBindTexture(GL_TEXTURE_2D, fb->texture);
+
+	// always make some progress, even if a single tile blows the budget
+	do
+	{
+		int x0 = (fb->nexttile % fb->tilesx) * FIELD_TILE_SIZE;
+		int y0 = (fb->nexttile / fb->tilesx) * FIELD_TILE_SIZE;
+		int w = min(FIELD_TILE_SIZE, fb->texw - x0);
+		int h = min(FIELD_TILE_SIZE, fb->texh - y0);
+
+		arenamarker_t marker = Arena_GetMarker(Mem_ThreadArena());
+		unsigned char *data = (unsigned char*)Mem_FrameAlloc(w * h * 4);
+		BuildTextureData(data, fb->mins, fb->maxs, fb->texw, fb->texh, x0, y0, w, h, 1);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, x0, y0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, data);
+		Arena_FreeToMarker(Mem_ThreadArena(), marker);
+
+		fb->nexttile++;
+	}
+	while (fb->nexttile < numtiles && Sys_Milliseconds() - start < FIELD_BAKE_BUDGET);
+
+	if (fb->nexttile == numtiles)
+		printf("texture data refined in %.1f ms\n", Sys_Milliseconds() - fb->starttime);
+}
+
+// ==============================================
+// dynamic resolution
+//
+// with -dynres the field is baked at a fraction of the window's pixel
+// density when frames run over budget and stretched over the view with
+// nearest filtering. the frame cost is the time spent in DisplayFunc averaged
+// over DYNRES_WINDOW frames. the scale drops as soon as the average is
+// over the target but only rises once it's well under, and every change
+// starts a fresh set of samples, so a frame near the budget doesn't keep
+// restarting the bake at a different size
+
+#define DYNRES_WINDOW		16
+#define DYNRES_STEP			0.125f
+#define DYNRES_NUM_LEVELS	8
+#define DYNRES_RAISE		0.7f
+
+typedef struct dynres_s
+{
+	bool enabled;
+	float target;
+	float minscale;
+	float scale;
+
+	double samples[DYNRES_WINDOW];
+	int numsamples;
+
+	// telemetry
+	double reporttime;
+	double frametime;
+	int reportframes;
+	int changes;
+	int levelframes[DYNRES_NUM_LEVELS + 1];
+
+} dynres_t;
+
+static dynres_t dynres = { false, 16.6f, 0.5f, 1.0f };
+
+static void DynRes_PrintStats()
+{
+	dynres_t *dr = &dynres;
+
+	printf("dynamic resolution, target %.1f ms, %i changes\n", dr->target, dr->changes);
+	for (int i = DYNRES_NUM_LEVELS; i > 0; i--)
+	{
+		if (dr->levelframes[i])
+			printf("  scale %.3f: %i frames\n", i * DYNRES_STEP, dr->levelframes[i]);
+	}
+}
+
+static void DynRes_Init()
+{
+	dynres_t *dr = &dynres;
+
+	if (!dr->enabled)
+		return;
+
+	dr->minscale = max(DYNRES_STEP, min(dr->minscale, 1.0f));
+	dr->minscale = ceilf(dr->minscale / DYNRES_STEP) * DYNRES_STEP;
+	dr->scale = 1.0f;
+	dr->reporttime = Sys_Milliseconds();
+
+	atexit(DynRes_PrintStats);
+}
+
+static void DynRes_Report(double ms)
+{
+	dynres_t *dr = &dynres;
+
+	dr->frametime += ms;
+	dr->reportframes++;
+	dr->levelframes[(int)(dr->scale / DYNRES_STEP + 0.5f)]++;
+
+	double now = Sys_Milliseconds();
+	if (now - dr->reporttime < 1000.0)
+		return;
+
+	printf("dynres: scale %.3f (%ix%i), %.2f ms/frame, target %.1f ms, %i changes\n",
+		dr->scale, fieldbake.texw, fieldbake.texh,
+		dr->frametime / dr->reportframes, dr->target, dr->changes);
+
+	dr->reporttime = now;
+	dr->frametime = 0.0;
+	dr->reportframes = 0;
+}
+
+// feeds the cost of the frame just drawn into the controller
+static void DynRes_Frame(double ms)
+{
+	dynres_t *dr = &dynres;
+
+	if (!dr->enabled)
+		return;
+
+	DynRes_Report(ms);
+
+	dr->samples[dr->numsamples++] = ms;
+	if (dr->numsamples < DYNRES_WINDOW)
+		return;
+
+	double average = 0.0;
+	for (int i = 0; i < DYNRES_WINDOW; i++)
+		average += dr->samples[i];
+	average /= DYNRES_WINDOW;
+	dr->numsamples = 0;
+
+	float scale = dr->scale;
+	if (average > dr->target)
 	{
-		float d2[2] = { d[0], d[1] };
-		return Vec2_Length(d2) - r;
+		// the bake is per pixel so the cost goes with the square of the
+		// scale. aim for the size that should fit, at least one step down
+		float fit = dr->scale * sqrtf(dr->target / average);
+		scale = min(dr->scale - DYNRES_STEP, floorf(fit / DYNRES_STEP) * DYNRES_STEP);
 	}
-	else
+	else if (average < dr->target * DYNRES_RAISE)
 	{
-		float d2[2] = { max(d[0] - r, 0.0f), max(d[1] - r, 0.0f) };
-		return min(max(d[0] - r, d[1] - r), 0.0f) + Vec2_Length(d2);
+		scale = dr->scale + DYNRES_STEP;
 	}
-#if 0
-	else if (d[1] >= 0.0f)
+
+	scale = max(dr->minscale, min(scale, 1.0f));
+	if (scale != dr->scale)
 	{
-		return d[1] - r;
+		dr->scale = scale;
+		dr->changes++;
 	}
-	else if (d[0] >= 0.0f)
+}
+
+// the field only covers the view plus FIELD_MARGIN of its size on each
+// side, snapped out to whole cells, at the window's pixel density. a
+// following camera only restarts the bake once the view leaves the baked
+// area; zooming, resizing or a new dynamic resolution scale restart it
+// straight away
+#define FIELD_MARGIN		0.25f
+
+static void DrawField()
+{
+	fieldbake_t *fb = &fieldbake;
+
+	float size[2] = { viewmaxs[0] - viewmins[0], viewmaxs[1] - viewmins[1] };
+	float density = renderheight / size[1] * dynres.scale;
+
+	bool covered = viewmins[0] >= fb->mins[0] && viewmins[1] >= fb->mins[1]
+		&& viewmaxs[0] <= fb->maxs[0] && viewmaxs[1] <= fb->maxs[1];
+
+	if (!fb->texw || !covered || density != fb->density)
 	{
-		return d[0] - r;
+		float mins[2], maxs[2];
+		for (int i = 0; i < 2; i++)
+		{
+			mins[i] = floorf(viewmins[i] - size[i] * FIELD_MARGIN);
+			maxs[i] = ceilf(viewmaxs[i] + size[i] * FIELD_MARGIN);
+		}
+
+		Field_BeginBake(mins, maxs, density);
 	}
 	else
 	{
-		return max(d[0] - r, d[1] - r);
+		Field_RefineBake();
 	}
-#endif
-}
 
-static char data [] =
-{
-	"11111111"
-	"10000001"
-	"10011001"
-	"10011001"
-	"10001001"
-	"10000001"
-	"10000001"
-	"11111111"
-};
+	glBindTexture(GL_TEXTURE_2D, fb->texture);
+	glEnable(GL_TEXTURE_2D);
+	glColor3f(1, 1, 1);
 
-static char GetCell(int x, int y)
-{
-	return data[y * 8 + x];
+	glBegin(GL_TRIANGLE_STRIP);
+	glTexCoord2f(0.0f, 0.0f);
+	glVertex2f(fb->mins[0], fb->mins[1]);
+
+	glTexCoord2f(1.0f, 0.0f);
+	glVertex2f(fb->maxs[0], fb->mins[1]);
+
+	glTexCoord2f(0.0f, 1.0f);
+	glVertex2f(fb->mins[0], fb->maxs[1]);
+
+	glTexCoord2f(1.0f, 1.0f);
+	glVertex2f(fb->maxs[0], fb->maxs[1]);
+	glEnd();
+
+	glDisable(GL_TEXTURE_2D);
 }
 
-static float Distance(float p[2])
+// ==============================================
+// grid
+//
+// the outlines of the solid cells are built once per GRID_CHUNK_SIZE
+// square chunk into a vertex buffer and only rebuilt when one of the
+// chunk's cells changes. DrawGrid skips chunks outside the view, so the
+// cost follows what's on screen rather than the size of the map
+
+#define GRID_CHUNK_SIZE		16
+
+typedef struct gridchunk_s
 {
-	float d;
-	for (int y = 0; y < 8; y++)
-	{
-		for (int x = 0; x < 8; x++)
-		{
-			char c = GetCell(x, y);
-	
-			if (c != '1')
-				continue;
+	GLuint vbo;
+	int numvertices;
+	bool dirty;
 
-			float center[2] = { x + 0.5f, y + 0.5f };
-			float half[2] = { 0.5f, 0.5f };
+} gridchunk_t;
 
-			// convert p to the local box coodinate system
-			float pp[2] = { p[0] - center[0], p[1] - center[1] };
-		
-			// expand the bounds by the player
-			//half[0] += 0.1f;
-			//half[1] += 0.1f;
+static gridchunk_t *gridchunks;
+static int gridchunksx, gridchunksy;
 
-			//float q = BoxDistance(half, pp);
-			float q = RoundedBoxDistance(half, 0.3f, pp);
+static void Grid_Init()
+{
+	gridchunksx = (mapw + GRID_CHUNK_SIZE - 1) / GRID_CHUNK_SIZE;
+	gridchunksy = (maph + GRID_CHUNK_SIZE - 1) / GRID_CHUNK_SIZE;
+	gridchunks = (gridchunk_t*)Mem_Alloc(gridchunksx * gridchunksy * sizeof(gridchunk_t));
 
-			if (x == 0 && y == 0)
-				d = q;
-			else
-				d = min(d, q);
-		}
+	for (int i = 0; i < gridchunksx * gridchunksy; i++)
+	{
+		gridchunks[i].vbo = 0;
+		gridchunks[i].numvertices = 0;
+		gridchunks[i].dirty = true;
 	}
-
-	return d;
 }
 
-static void Gradient(float grad[2], float p[2])
+// marks the chunk holding cell x, y for a rebuild
+static void Grid_Invalidate(int x, int y)
 {
-	float h = 0.01f;
-	float dx, dy;
-
-	float p0[2] = { p[0] - h, p[1] };
-	float p1[2] = { p[0] + h, p[1] };
-	dx = (Distance(p1) - Distance(p0)) / (2 * h);
-
-	float p2[2] = { p[0], p[1] - h };
-	float p3[2] = { p[0], p[1] + h };
-	dy = (Distance(p3) - Distance(p2)) / (2 * h);
+	if (x < 0 || y < 0 || x >= mapw || y >= maph)
+		return;
 
-	grad[0] = dx;
-	grad[1] = dy;
+	gridchunks[(y / GRID_CHUNK_SIZE) * gridchunksx + (x / GRID_CHUNK_SIZE)].dirty = true;
 }
 
-static void DrawCursor()
+static void Grid_BuildChunk(int cx, int cy)
 {
-	float xy[2], d, grad[2];
+	gridchunk_t *chunk = &gridchunks[cy * gridchunksx + cx];
 
-	// convert mouse position from screen to identity
-	xy[0] = (float)mousepos[0] / (float)renderwidth;
-	xy[1] = 1.0f - ((float)mousepos[1] / (float)renderheight);
+	int x0 = cx * GRID_CHUNK_SIZE;
+	int y0 = cy * GRID_CHUNK_SIZE;
+	int x1 = min(x0 + GRID_CHUNK_SIZE, mapw);
+	int y1 = min(y0 + GRID_CHUNK_SIZE, maph);
 
-	// convert from identity to model pos
-	xy[0] = xy[0] * 8;
-	xy[1] = xy[1] * 8;
+	// four edges, eight vertices, for every solid cell
+	int numsolid = Map_CountSolid(x0, y0, x1, y1);
+	arenamarker_t marker = Arena_GetMarker(Mem_ThreadArena());
+	float *vertices = (float*)Mem_FrameAlloc(numsolid * 8 * 2 * sizeof(float));
+	float *v = vertices;
 
-	fprintf(stdout, "x, y: %2.2f, %2.2f\n", xy[0], xy[1]);
+	for (int y = y0; y < y1; y++)
+	{
+		for (int x = Map_FirstSolid(y, x0, x1); x >= 0; x = Map_FirstSolid(y, x + 1, x1))
+		{
+			float fx = x, fy = y, s = 1;
+			float corners[4][2] = { { fx, fy }, { fx + s, fy }, { fx + s, fy + s }, { fx, fy + s } };
 
-	d = Distance(xy);
-	fprintf(stdout, "distance %f\n", d);
+			for (int i = 0; i < 4; i++)
+			{
+				*v++ = corners[i][0];
+				*v++ = corners[i][1];
+				*v++ = corners[(i + 1) & 3][0];
+				*v++ = corners[(i + 1) & 3][1];
+			}
+		}
+	}
 
-	Gradient(grad, xy);
-	Vec2_Normalize(grad);
-	fprintf(stdout, "gradient %f, %f\n", grad[0], grad[1]);
+	chunk->numvertices = (int)(v - vertices) / 2;
 
-	glColor3f(1, 0, 0);
-	glBegin(GL_LINES);
-	glVertex2f(xy[0], xy[1]);
-	glVertex2f(xy[0] + (d * -grad[0]), xy[1] + (d * -grad[1]));
-	glEnd();
+	if (!chunk->vbo)
+		glGenBuffers(1, &chunk->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, chunk->vbo);
+	glBufferData(GL_ARRAY_BUFFER, chunk->numvertices * 2 * sizeof(float), vertices, GL_STATIC_DRAW);
+	Arena_FreeToMarker(Mem_ThreadArena(), marker);
+
+	chunk->dirty = false;
 }
 
-static unsigned char *BuildTextureData(int texw, int texh)
+static void DrawGrid()
 {
-	unsigned char *data = (unsigned char*)malloc(texw * texh * 4);
-	for (int y = 0; y < texh; y++)
-	{
-		for (int x = 0; x < texw; x++)
-		{
-			float xy[2];
+	int cx0 = max(0, (int)floorf(viewmins[0] / GRID_CHUNK_SIZE));
+	int cy0 = max(0, (int)floorf(viewmins[1] / GRID_CHUNK_SIZE));
+	int cx1 = min(gridchunksx - 1, (int)floorf(viewmaxs[0] / GRID_CHUNK_SIZE));
+	int cy1 = min(gridchunksy - 1, (int)floorf(viewmaxs[1] / GRID_CHUNK_SIZE));
 
-			// convert mouse position from screen to identity
-			xy[0] = (float)x / (float)texw;
-			//xy[1] = 1.0f - ((float)y / (float)renderheight);
-			xy[1] = (float)y / (float)texh;
+	glColor3f(1, 1, 1);
+	glEnableClientState(GL_VERTEX_ARRAY);
 
-			// convert from identity to model pos
-			xy[0] = xy[0] * 8.0f;
-			xy[1] = xy[1] * 8.0f;
+	for (int cy = cy0; cy <= cy1; cy++)
+	{
+		for (int cx = cx0; cx <= cx1; cx++)
+		{
+			gridchunk_t *chunk = &gridchunks[cy * gridchunksx + cx];
+			if (chunk->dirty)
+				Grid_BuildChunk(cx, cy);
+			if (!chunk->numvertices)
+				continue;
 
-			float d = Distance(xy);
-			d = max(-1.0f, min(d, 1.0f));
-			d *= 32;
-			
-			unsigned char *t = data + (y * texw * 4) + (x * 4);
-			*t++ = max(0, d) + 50;
-			*t++ = 0;
-			*t++ = max(0, -d) + 50;
-			*t++ = 255;
+			glBindBuffer(GL_ARRAY_BUFFER, chunk->vbo);
+			glVertexPointer(2, GL_FLOAT, 0, NULL);
+			glDrawArrays(GL_LINES, 0, chunk->numvertices);
 		}
 	}
 
-	return data;
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glDisableClientState(GL_VERTEX_ARRAY);
 }
 
-static void DrawField()
+// the field texture was baked from cells that have changed since
+static void Field_InvalidateCells(int x0, int y0, int x1, int y1)
 {
-	static int texw, texh;
-	static GLuint texture;
+	fieldbake_t *fb = &fieldbake;
 
-	if (texw != renderwidth || texh != renderheight)
-	{
-		texw = renderwidth;
-		texh = renderheight;
+	if (!fb->texw)
+		return;
+	if (x1 < fb->mins[0] || y1 < fb->mins[1] || x0 > fb->maxs[0] || y0 > fb->maxs[1])
+		return;
 
-		if (texture)
-		{
-			glDeleteTextures(1, &texture);
-			texture = 0;
-		}
-		if (!texture)
-			glGenTextures(1, &texture);
+	// start the field bake again
+	fb->texw = 0;
+}
 
-		printf("rebuilding texture data %i, %i\n", texw, texh);
-		glBindTexture(GL_TEXTURE_2D, texture);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, texw, texh, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+// a chunk's cells came in or went away, rebuild whatever was made from them
+static void Stream_ChunkChanged(int chunk)
+{
+	int x0 = (chunk % mapchunksx) * STREAM_CHUNK_SIZE;
+	int y0 = (chunk / mapchunksx) * STREAM_CHUNK_SIZE;
+
+	for (int y = y0; y < y0 + STREAM_CHUNK_SIZE; y += GRID_CHUNK_SIZE)
+		for (int x = x0; x < x0 + STREAM_CHUNK_SIZE; x += GRID_CHUNK_SIZE)
+			Grid_Invalidate(x, y);
+	Field_InvalidateCells(x0, y0, x0 + STREAM_CHUNK_SIZE, y0 + STREAM_CHUNK_SIZE);
+	Pyramid_Invalidate(x0, y0, x0 + STREAM_CHUNK_SIZE, y0 + STREAM_CHUNK_SIZE);
+}
 
-		glBindTexture(GL_TEXTURE_2D, texture);
-		unsigned char *data = BuildTextureData(texw, texh);
-		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, texw, texh, GL_RGBA, GL_UNSIGNED_BYTE, data);
-		free(data);
-	}
+// hands finished chunks to the main thread, queues the chunks within the
+// prefetch radius of pos that aren't resident, nearest first, and times
+// how long the player is kept waiting on the chunks right around it.
+// returns false while those chunks aren't in
+static bool Stream_Update(const float pos[2])
+{
+	streamstats_t *ss = &streamstats;
+	double now = Sys_Milliseconds();
 
-	glBindTexture(GL_TEXTURE_2D, texture);
-	glEnable(GL_TEXTURE_2D);
-	glColor3f(1, 1, 1);
-	glMatrixMode(GL_PROJECTION);
-	//glPushMatrix();
-	glLoadIdentity();
-	glOrtho(0, 1, 0, 1, -1, 1);
+	streamtick++;
 
-	{
+	pthread_mutex_lock(&streamlock);
+	streamslot_t *finished = streamfinished;
+	streamfinished = NULL;
+	pthread_mutex_unlock(&streamlock);
 
-		glBegin(GL_TRIANGLE_STRIP);
-		glTexCoord2f(0.0f, 0.0f);
-		glVertex2f(0.0f, 0.0f);
+	for (streamslot_t *slot = finished; slot; slot = slot->next)
+	{
+		slot->loading = false;
+		mapchunks[slot->chunk] = slot->rows;
+		ss->loads++;
+		if (ss->numsamples < MAX_STREAM_SAMPLES)
+			ss->latency[ss->numsamples++] = now - slot->requesttime;
 
-		glTexCoord2f(1.0f, 0.0f);
-		glVertex2f(1.0f, 0.0f);
+		Stream_ChunkChanged(slot->chunk);
+	}
 
-		glTexCoord2f(0.0f, 1.0f);
-		glVertex2f(0.0f, 1.0f);
+	int pcx = (int)floorf(pos[0]) >> STREAM_CHUNK_SHIFT;
+	int pcy = (int)floorf(pos[1]) >> STREAM_CHUNK_SHIFT;
 
-		glTexCoord2f(1.0f, 1.0f);
-		glVertex2f(1.0f, 1.0f);
-		glEnd();
+	// ring by ring so the nearest chunks are queued first
+	streamslot_t *queued = NULL, *queuedtail = NULL;
+	for (int ring = 0; ring <= streamradius; ring++)
+	{
+		for (int cy = pcy - ring; cy <= pcy + ring; cy++)
+		{
+			for (int cx = pcx - ring; cx <= pcx + ring; cx++)
+			{
+				if (max(abs(cx - pcx), abs(cy - pcy)) != ring)
+					continue;
+				if (cx < 0 || cy < 0 || cx >= mapchunksx || cy >= mapchunksy)
+					continue;
+
+				int chunk = cy * mapchunksx + cx;
+				if (streamchunks[chunk] >= 0)
+				{
+					streamslots[streamchunks[chunk]].lastwanted = streamtick;
+					continue;
+				}
+
+				// a free slot, otherwise the one wanted longest ago. slots
+				// wanted this tick, still loading or edited are kept
+				streamslot_t *best = NULL;
+				for (int i = 0; i < MAX_STREAM_SLOTS; i++)
+				{
+					streamslot_t *slot = &streamslots[i];
+					if (slot->chunk < 0)
+					{
+						best = slot;
+						break;
+					}
+					if (slot->loading || slot->modified || slot->lastwanted == streamtick)
+						continue;
+					if (!best || slot->lastwanted < best->lastwanted)
+						best = slot;
+				}
+
+				if (!best)
+				{
+					ss->poolfull++;
+					continue;
+				}
+
+				if (best->chunk >= 0)
+				{
+					// the evicted chunk's cells read as solid again
+					streamchunks[best->chunk] = -1;
+					mapchunks[best->chunk] = NULL;
+					Stream_ChunkChanged(best->chunk);
+					ss->evictions++;
+				}
+
+				best->chunk = chunk;
+				best->loading = true;
+				best->modified = false;
+				best->lastwanted = streamtick;
+				best->requesttime = now;
+				best->next = NULL;
+				streamchunks[chunk] = (int)(best - streamslots);
+
+				if (queuedtail)
+					queuedtail->next = best;
+				else
+					queued = best;
+				queuedtail = best;
+			}
+		}
 	}
 
-	//glPopMatrix();
-	glDisable(GL_TEXTURE_2D);
-}
+	if (queued)
+	{
+		pthread_mutex_lock(&streamlock);
+		if (streampendingtail)
+			streampendingtail->next = queued;
+		else
+			streampending = queued;
+		streampendingtail = queuedtail;
+		pthread_cond_signal(&streamcond);
+		pthread_mutex_unlock(&streamlock);
+	}
 
-static void DrawGrid()
-{
-	for (int y = 0; y < 8; y++)
+	// the player collides against the cells around it, if any of those
+	// aren't in yet it's stuck against walls that may not be there
+	bool stalled = false;
+	int px = (int)floorf(pos[0]);
+	int py = (int)floorf(pos[1]);
+	for (int y = py - 1; y <= py + 1 && !stalled; y++)
 	{
-		for (int x = 0; x < 8; x++)
+		for (int x = px - 1; x <= px + 1 && !stalled; x++)
 		{
-			char c = GetCell(x, y);
-			if (c != '1')
+			if (x < 0 || y < 0 || x >= mapw || y >= maph)
 				continue;
 
-			float s = 1;
+			int slot = streamchunks[(y >> STREAM_CHUNK_SHIFT) * mapchunksx + (x >> STREAM_CHUNK_SHIFT)];
+			stalled = slot < 0 || streamslots[slot].loading;
+		}
+	}
 
-			glColor3f(1, 1, 1);
-			glBegin(GL_LINE_LOOP);
-			glVertex2f(x    , y    );
-			glVertex2f(x + s, y    );
-			glVertex2f(x + s, y + s);
-			glVertex2f(x    , y + s);
-			glEnd();
+	if (stalled)
+	{
+		if (!ss->stallstart)
+		{
+			ss->stallstart = now;
+			ss->stalls++;
 		}
+		ss->stallticks++;
+	}
+	else if (ss->stallstart)
+	{
+		double ms = now - ss->stallstart;
+		printf("stream: stalled %.1f ms waiting for chunks at %i, %i\n", ms, px, py);
+		ss->stallms += ms;
+		ss->stallstart = 0;
+	}
+
+	return !stalled;
+}
+
+// changes a cell, rebuilding whatever was made from it
+static void Map_SetCell(int x, int y, bool solid)
+{
+	if (x < 0 || y < 0 || x >= mapw || y >= maph)
+		return;
+	if (Map_Solid(x, y) == solid)
+		return;
+
+	if (streaming)
+	{
+		// only resident chunks can be edited, and they're kept from then on
+		// since the edit only lives in the slot
+		int slot = streamchunks[(y >> STREAM_CHUNK_SHIFT) * mapchunksx + (x >> STREAM_CHUNK_SHIFT)];
+		if (slot < 0 || streamslots[slot].loading)
+			return;
+
+		streamslots[slot].modified = true;
 	}
+
+	Map_SetSolid(x, y, solid);
+	Grid_Invalidate(x, y);
+	Field_InvalidateCells(x, y, x + 1, y + 1);
+	Pyramid_Invalidate(x, y, x + 1, y + 1);
 }
 
 static void DrawObject(float x, float y)
 {
 	float s = 0.1f;
 
+	float mins[2] = { x - s, y - s };
+	float maxs[2] = { x + s, y + s };
+	if (!View_BoxVisible(mins, maxs))
+		return;
+
 	glColor3f(1, 0, 1);
 
 	glBegin(GL_TRIANGLE_STRIP);
@@ -493,6 +2575,43 @@ static void DrawObject(float x, float y)
 	glEnd();
 }
 
+static void DrawDynamics()
+{
+	glColor3f(1, 1, 0);
+
+	for (int i = 0; i < numdynprims; i++)
+	{
+		dynprim_t *prim = &dynprims[i];
+		if (!View_BoxVisible(prim->mins, prim->maxs))
+			continue;
+
+		float c = cosf(prim->angle);
+		float s = sinf(prim->angle);
+
+		glBegin(GL_LINE_LOOP);
+		if (prim->type == dyn_circle)
+		{
+			for (int j = 0; j < 24; j++)
+			{
+				float a = j * 2.0f * PI / 24;
+				glVertex2f(prim->origin[0] + prim->radius * cosf(a), prim->origin[1] + prim->radius * sinf(a));
+			}
+		}
+		else
+		{
+			// the rounding is drawn square
+			float r = prim->type == dyn_roundedbox ? prim->radius : 0.0f;
+			float hx = prim->halfsize[0] + r;
+			float hy = prim->halfsize[1] + r;
+			float corners[4][2] = { { -hx, -hy }, { hx, -hy }, { hx, hy }, { -hx, hy } };
+
+			for (int j = 0; j < 4; j++)
+				glVertex2f(prim->origin[0] + c * corners[j][0] - s * corners[j][1], prim->origin[1] + s * corners[j][0] + c * corners[j][1]);
+		}
+		glEnd();
+	}
+}
+
 static void DrawPlayer()
 {
 	DrawObject(objx, objy);
@@ -500,17 +2619,14 @@ static void DrawPlayer()
 
 static void Draw()
 {
-	DrawField();
+	Camera_SetView();
 
-	// draw field will nuke the projection matrix
-	glMatrixMode(GL_MODELVIEW);
-	glLoadIdentity();
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	glOrtho(0, 8, 0, 8, -1, 1);
+	DrawField();
 
 	DrawGrid();
 
+	DrawDynamics();
+
 	DrawCursor();
 }
 
@@ -524,8 +2640,15 @@ static void TryMove()
 
 	for (int i = 0; i < 5; i++)
 	{
-		// check for a collision
+		// check for a collision, nothing to do in open space
 		float p[2] = { nextx, nexty };
+		if (DistanceAtLeast(p, 0.02f))
+		{
+			objx = nextx;
+			objy = nexty;
+			return;
+		}
+
 		float d = Distance(p);
 		if (d > 0.01f)
 		{
@@ -547,7 +2670,11 @@ static void TryMove()
 		//float n[2], t[2], pos[2] = { objx, objy };
 		float n[2], t[2], pos[2] = { 0.5 * (objx + nextx), 0.5f * (objy + nexty) };
 		Gradient(n, pos);
-		Vec2_Normalize(n);
+
+		// deep inside something solid the field is flat and there's
+		// nothing to slide along
+		if (!Vec2_Normalize(n))
+			return;
 		t[0] = -n[1];
 		t[1] = n[0];
 
@@ -621,14 +2748,16 @@ static void Player_Frame()
 	// position correction
 	{
 		float p[2] = { objx, objy };
-		float d = Distance(p);
+		float d = DistanceAtLeast(p, 0.0f) ? 0.0f : Distance(p);
 		if (d < 0.0f)
 		{
 			float n[2];
 			Gradient(n, p);
-			Vec2_Normalize(n);
-			objx += d * 1.01f * n[0];
-			objy += d * 1.01f * n[1];
+			if (Vec2_Normalize(n))
+			{
+				objx += d * 1.01f * n[0];
+				objy += d * 1.01f * n[1];
+			}
 		}
 	}
 }
@@ -636,6 +2765,8 @@ static void Player_Frame()
 // glut functions
 static void DisplayFunc()
 {
+	double start = Sys_Milliseconds();
+
 	glClearColor(0.3f, 0.3f, 0.3f, 0.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	//glEnable(GL_DEPTH_TEST);
@@ -644,7 +2775,11 @@ static void DisplayFunc()
 
 	DrawPlayer();
 
+	DynRes_Frame(Sys_Milliseconds() - start);
+
 	glutSwapBuffers();
+
+	Mem_EndFrame();
 }
 
 static void ReshapeFunc(int w, int h)
@@ -658,7 +2793,11 @@ static void ReshapeFunc(int w, int h)
 static void MouseFunc(int button, int state, int x, int y)
 {
 	if(button == GLUT_LEFT_BUTTON)
+	{
+		if (state == GLUT_DOWN && !input.lbuttondown)
+			lbuttonclicked = true;
 		input.lbuttondown = (state == GLUT_DOWN);
+	}
 	if(button == GLUT_RIGHT_BUTTON)
 		input.rbuttondown = (state == GLUT_DOWN);
 }
@@ -683,6 +2822,10 @@ static void KeyDownFunc(unsigned char key, int x, int y)
 		keyactions[ka_x] = true;
 	if (key == 'z')
 		keyactions[ka_y] = true;
+	if (key == '=' || key == '+')
+		Camera_Zoom(1.0f / CAMERA_ZOOM);
+	if (key == '-')
+		Camera_Zoom(CAMERA_ZOOM);
 }
 static void KeyUpFunc(unsigned char key, int x, int y)
 {
@@ -729,20 +2872,192 @@ static void TimerFunc(int value)
 	// standard mouse input
 	ProcessInput();
 
-	Player_Frame();
+	// clicking toggles the cell under the cursor
+	if (lbuttonclicked)
+	{
+		float xy[2];
+		ScreenToWorld(xy, mousepos[0], mousepos[1]);
+
+		int x = (int)floorf(xy[0]);
+		int y = (int)floorf(xy[1]);
+		Map_SetCell(x, y, !Map_Solid(x, y));
+		lbuttonclicked = false;
+	}
+
+	// the player is held until the cells it collides with are resident,
+	// to start with it's inside chunks that still read as solid
+	float target[2] = { objx, objy };
+	bool resident = !streaming || Stream_Update(target);
+
+	// the dynamics move first so the player collides with where they are
+	Dyn_Frame();
+
+	if (resident)
+		Player_Frame();
+
+	target[0] = objx;
+	target[1] = objy;
+	Camera_Follow(target);
+
+	Mem_EndFrame();
 
 	// kick a display refresh
 	glutPostRedisplay();
 	glutTimerFunc(16, TimerFunc, 0);
 }
 
+// ==============================================
+// layout benchmark
+//
+// walkers wander a random BENCH_MAP_SIZE square map and at every step do
+// what a body does against the map: sample the corners of its box, walk
+// the solid cells around it for push-out and count the wider
+// neighbourhood. the walkers are interleaved so the map doesn't stay in
+// cache between one walker's steps. build with and without MAP_MORTON to
+// compare the layouts, the checksum should match
+
+#define BENCH_MAP_SIZE		4096
+#define BENCH_WALKERS		1024
+#define BENCH_STEPS			4096
+
+static unsigned int benchseed = 1;
+
+static unsigned int Bench_Random()
+{
+	benchseed = benchseed * 1664525u + 1013904223u;
+	return benchseed >> 8;
+}
+
+static void Map_Benchmark()
+{
+	Map_Alloc(BENCH_MAP_SIZE, BENCH_MAP_SIZE);
+	for (int y = 0; y < maph; y++)
+		for (int x = 0; x < mapw; x++)
+			Map_SetSolid(x, y, (Bench_Random() & 3) == 0);
+
+	static int walkers[BENCH_WALKERS][4];		// x, y, dx, dy
+	for (int i = 0; i < BENCH_WALKERS; i++)
+	{
+		walkers[i][0] = Bench_Random() % mapw;
+		walkers[i][1] = Bench_Random() % maph;
+		walkers[i][2] = 1;
+		walkers[i][3] = 0;
+	}
+
+	long long checksum = 0;
+	double start = Sys_Milliseconds();
+
+	for (int step = 0; step < BENCH_STEPS; step++)
+	{
+		for (int i = 0; i < BENCH_WALKERS; i++)
+		{
+			int *w = walkers[i];
+
+			// mostly keep going, sometimes turn
+			if ((Bench_Random() & 7) == 0)
+			{
+				w[2] = (int)(Bench_Random() % 3) - 1;
+				w[3] = (int)(Bench_Random() % 3) - 1;
+			}
+			w[0] = (w[0] + w[2] + mapw) % mapw;
+			w[1] = (w[1] + w[3] + maph) % maph;
+
+			int x = w[0], y = w[1];
+
+			// the four corners of the box
+			checksum += Map_Solid(x - 1, y - 1) + Map_Solid(x + 1, y - 1) + Map_Solid(x - 1, y + 1) + Map_Solid(x + 1, y + 1);
+
+			// push-out against the 3 x 3 around it
+			for (int cy = y - 1; cy <= y + 1; cy++)
+				for (int cx = Map_FirstSolid(cy, x - 1, x + 2); cx >= 0; cx = Map_FirstSolid(cy, cx + 1, x + 2))
+					checksum += (cx - x) * 3 + (cy - y);
+
+			// the 5 x 5 broadphase
+			checksum += Map_CountSolid(x - 2, y - 2, x + 3, y + 3);
+		}
+	}
+
+	double ms = Sys_Milliseconds() - start;
+	int steps = BENCH_WALKERS * BENCH_STEPS;
+
+#ifdef MAP_MORTON
+	const char *layout = "morton";
+#else
+	const char *layout = "rows";
+#endif
+	printf("%s layout, %i x %i: %i steps in %.1f ms, %.1f ns a step, checksum %lld\n",
+		layout, mapw, maph, steps, ms, ms * 1000000.0 / steps, checksum);
+}
+
 static void PrintUsage()
-{}
+{
+	printf("usage: hldc1 [-dynres ms] [-minscale f] [-stream] [-prefetch n] [-movers n] [-bench] [mapfile]\n");
+	printf("  -dynres     lower the field resolution to keep frames under ms milliseconds\n");
+	printf("  -minscale   lowest dynamic resolution scale, default 0.5\n");
+	printf("  -stream     read the map in chunks around the player instead of all at once\n");
+	printf("  -prefetch   chunks to keep loaded on each side of the player, default 2\n");
+	printf("  -movers     scatter n moving boxes and circles over the map\n");
+	printf("  -bench      time random walk collision queries on a %i x %i map and exit\n", BENCH_MAP_SIZE, BENCH_MAP_SIZE);
+	printf("  mapfile     rows of 0 and 1 with the bottom row first, default is the builtin room\n");
+}
 
 int main(int argc, char *argv[])
 {
+	Mem_Init();
+
+	bool bench = false;
+	int nummovers = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-dynres") && i + 1 < argc)
+		{
+			dynres.enabled = true;
+			dynres.target = atof(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-minscale") && i + 1 < argc)
+			dynres.minscale = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-stream"))
+			streaming = true;
+		else if (!strcmp(argv[i], "-prefetch") && i + 1 < argc)
+			streamradius = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-movers") && i + 1 < argc)
+			nummovers = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-bench"))
+			bench = true;
+		else if (argv[i][0] != '-' && !filename)
+			filename = argv[i];
+		else
+		{
+			PrintUsage();
+			return 1;
+		}
+	}
+
+	// doesn't need a window
+	if (bench)
+	{
+		Map_Benchmark();
+		return 0;
+	}
+
 	glutInit(&argc, argv);
 
+	if (filename && streaming)
+		Stream_Open(filename);
+	else if (filename)
+		Map_Load(filename);
+	else
+	{
+		Map_Init();
+		streaming = false;
+	}
+	Grid_Init();
+	Pyramid_Init();
+	Dyn_SpawnMovers(nummovers);
+	Dyn_Frame();
+
+	DynRes_Init();
+
 	glutInitWindowPosition(0, 0);
 	glutInitWindowSize(400, 400);
 	glutInitDisplayMode(GLUT_RGBA | GLUT_DEPTH | GLUT_DOUBLE);
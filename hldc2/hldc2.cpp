@@ -1,8 +1,20 @@
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
+#include <pthread.h>
 
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#ifndef GL_GLEXT_PROTOTYPES
+#define GL_GLEXT_PROTOTYPES
+#endif
 #ifdef WIN32
 #include "freeglut/include/GL/freeglut.h"
 #else
@@ -50,35 +62,6 @@ static void DebugBreak()
 	printf("");
 }
 
-// ==============================================
-// memory allocation
-
-void *Mem_Alloc(int numbytes)
-{
-	#define MEM_ALLOC_SIZE	16 * 1024 * 1024
-
-	typedef struct memstack_s
-	{
-		unsigned char mem[MEM_ALLOC_SIZE];
-		int allocated;
-
-	} memstack_t;
-
-	static memstack_t memstack;
-	unsigned char *mem;
-	
-	if(memstack.allocated + numbytes > MEM_ALLOC_SIZE)
-	{
-		printf("Error: Mem: no free space available\n");
-		abort();
-	}
-
-	mem = memstack.mem + memstack.allocated;
-	memstack.allocated += numbytes;
-
-	return mem;
-}
-
 // ==============================================
 // errors and warnings
 
@@ -107,6 +90,146 @@ static void Warning(const char *warning, ...)
 	fprintf(stdout, "Warning: %s", buffer);
 }
 
+// ==============================================
+// memory allocation
+//
+// all allocation comes out of linear arenas. the permanent arena holds
+// anything that lives for the whole run, the frame arena is reset at the
+// end of every glut callback and each worker thread gets its own arena
+// so temporaries never need a lock or a call to malloc
+
+#define PERM_ARENA_SIZE		(16 * 1024 * 1024)
+#define FRAME_ARENA_SIZE	(32 * 1024 * 1024)
+#define THREAD_ARENA_SIZE	(4 * 1024 * 1024)
+#define MAX_THREAD_ARENAS	32
+
+typedef struct arena_s
+{
+	const char *name;
+	unsigned char *base;
+	size_t size;
+	size_t used;
+	size_t highwater;
+	int numresets;
+
+} arena_t;
+
+typedef size_t arenamarker_t;
+
+static unsigned char permmem[PERM_ARENA_SIZE];
+static unsigned char framemem[FRAME_ARENA_SIZE];
+static arena_t permarena;
+static arena_t framearena;
+
+static arena_t threadarenas[MAX_THREAD_ARENAS];
+static int numthreadarenas;
+static thread_local arena_t *threadarena;
+
+static void Arena_Init(arena_t *arena, const char *name, void *base, size_t size)
+{
+	arena->name = name;
+	arena->base = (unsigned char*)base;
+	arena->size = size;
+	arena->used = 0;
+	arena->highwater = 0;
+	arena->numresets = 0;
+}
+
+// align must be a power of two
+static void *Arena_Alloc(arena_t *arena, size_t numbytes, size_t align)
+{
+	size_t start = (arena->used + (align - 1)) & ~(align - 1);
+
+	if (start + numbytes > arena->size)
+	{
+		Error("Mem: arena \"%s\" out of space (%zu bytes requested, %zu of %zu used)\n",
+			arena->name, numbytes, arena->used, arena->size);
+	}
+
+	arena->used = start + numbytes;
+	if (arena->used > arena->highwater)
+		arena->highwater = arena->used;
+
+	return arena->base + start;
+}
+
+static arenamarker_t Arena_GetMarker(arena_t *arena)
+{
+	return arena->used;
+}
+
+static void Arena_FreeToMarker(arena_t *arena, arenamarker_t marker)
+{
+	arena->used = marker;
+}
+
+static void Arena_Reset(arena_t *arena)
+{
+	arena->used = 0;
+	arena->numresets++;
+}
+
+static void Arena_PrintStats(arena_t *arena)
+{
+	printf("%-8s %10zu used %10zu peak %10zu size %6i resets\n",
+		arena->name, arena->used, arena->highwater, arena->size, arena->numresets);
+}
+
+// returns the calling thread's scratch arena, the main thread uses the
+// frame arena and workers get a private block on first use
+static arena_t *Mem_ThreadArena()
+{
+	if (!threadarena)
+	{
+		int index = __sync_fetch_and_add(&numthreadarenas, 1);
+		if (index >= MAX_THREAD_ARENAS)
+			Error("Mem: too many thread arenas\n");
+
+		void *base = malloc(THREAD_ARENA_SIZE);
+		if (!base)
+			Error("Mem: failed to allocate thread arena\n");
+
+		Arena_Init(&threadarenas[index], "thread", base, THREAD_ARENA_SIZE);
+		threadarena = &threadarenas[index];
+	}
+
+	return threadarena;
+}
+
+static void Mem_PrintStats()
+{
+	Arena_PrintStats(&permarena);
+	Arena_PrintStats(&framearena);
+	for (int i = 0; i < numthreadarenas && i < MAX_THREAD_ARENAS; i++)
+		Arena_PrintStats(&threadarenas[i]);
+}
+
+static void Mem_Init()
+{
+	Arena_Init(&permarena, "perm", permmem, PERM_ARENA_SIZE);
+	Arena_Init(&framearena, "frame", framemem, FRAME_ARENA_SIZE);
+	threadarena = &framearena;
+
+	atexit(Mem_PrintStats);
+}
+
+// allocations that live for the whole run
+void *Mem_Alloc(int numbytes)
+{
+	return Arena_Alloc(&permarena, numbytes, 16);
+}
+
+// temporaries that die at the end of the current frame or job
+static void *Mem_FrameAlloc(size_t numbytes)
+{
+	return Arena_Alloc(Mem_ThreadArena(), numbytes, 16);
+}
+
+static void Mem_EndFrame()
+{
+	Arena_Reset(Mem_ThreadArena());
+}
+
 // ==============================================
 // vector utils
 
@@ -168,6 +291,8 @@ static float PlaneDistance(float abc[3], float xy[2])
 // Called every frame to process the current mouse input state
 // We only get updates when the mouse moves so the current mouse
 // position is stored and may be used for mulitple frames
+static bool lbuttonclicked;
+
 static void ProcessInput()
 {
 	// mousepos has current "frame" mouse pos
@@ -283,6 +408,15 @@ static void RoundedBoxDistance(trace_t *tr, float halfsize[2], float r, float p[
 		tr->n[1] = -tr->n[1];
 }
 
+// ==============================================
+// map
+//
+// the world is mapw x maph cells and '1' is solid. without a map file
+// it's the builtin room below. a map file has a line of '0' and '1' per
+// row and, like data[], the first line is row 0 at the bottom of the
+// world. short lines are padded with empty cells. anything off the edge
+// of the map is solid
+
 static char data [] =
 {
 	"11111111"
@@ -295,9 +429,297 @@ static char data [] =
 	"11111111"
 };
 
-static char GetCell(int x, int y)
+// occupancy is kept as bits. by default it's 64 cells to a word along
+// each row, bit n of a word holding the cell n to the right of the word's
+// first. built with MAP_MORTON (make LAYOUT=morton) a word holds an 8 x 8
+// block instead, bit n of byte r being cell n of the block's row r, and
+// the blocks of each MAP_TILE_BLOCKS square tile are stored in Morton
+// order so the cells around a point share a cache line or two instead of
+// taking a line per row. the region queries below mask off the cells
+// they weren't asked about and answer a word at a time, so empty space
+// costs a word test rather than a test per cell. bits past the edge of
+// the map are never read
+
+static uint64_t *mapbits;
+static int mapw;
+static int maph;
+
+#ifdef MAP_MORTON
+#define MAP_TILE_SHIFT		4
+#define MAP_TILE_BLOCKS		(1 << MAP_TILE_SHIFT)
+
+static int mapblocksx, mapblocksy;
+static int maptilesx;
+#else
+static int mapwords;		// words in a row
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static int Bits_Count(uint64_t bits) { return (int)__popcnt64(bits); }
+static int Bits_First(uint64_t bits) { unsigned long i; _BitScanForward64(&i, bits); return (int)i; }
+#else
+static int Bits_Count(uint64_t bits) { return __builtin_popcountll(bits); }
+static int Bits_First(uint64_t bits) { return __builtin_ctzll(bits); }
+#endif
+
+// the bits of a width cell span starting at first that fall in x0 to x1
+// (exclusive)
+static uint64_t Map_SpanMask(int first, int width, int x0, int x1)
+{
+	int lo = x0 - first;
+	int hi = x1 - first;
+	lo = max(lo, 0);
+	hi = min(hi, width);
+	if (hi <= lo)
+		return 0;
+
+	uint64_t mask = hi == 64 ? ~0ull : (1ull << hi) - 1;
+	return mask & (~0ull << lo);
+}
+
+#ifdef MAP_MORTON
+// spreads the low bits of v out to every other bit
+static int Map_Spread(int v)
+{
+	v = (v | (v << 2)) & 0x33;
+	v = (v | (v << 1)) & 0x55;
+	return v;
+}
+
+static uint64_t *Map_Block(int bx, int by)
+{
+	int tile = (by >> MAP_TILE_SHIFT) * maptilesx + (bx >> MAP_TILE_SHIFT);
+	int inside = Map_Spread(bx & (MAP_TILE_BLOCKS - 1)) | (Map_Spread(by & (MAP_TILE_BLOCKS - 1)) << 1);
+	return &mapbits[tile * MAP_TILE_BLOCKS * MAP_TILE_BLOCKS + inside];
+}
+#endif
+
+// an empty w x h map
+static void Map_Alloc(int w, int h)
+{
+#ifdef MAP_MORTON
+	mapblocksx = (w + 7) / 8;
+	mapblocksy = (h + 7) / 8;
+	maptilesx = (mapblocksx + MAP_TILE_BLOCKS - 1) / MAP_TILE_BLOCKS;
+	int maptilesy = (mapblocksy + MAP_TILE_BLOCKS - 1) / MAP_TILE_BLOCKS;
+	size_t numwords = (size_t)maptilesx * maptilesy * MAP_TILE_BLOCKS * MAP_TILE_BLOCKS;
+#else
+	mapwords = (w + 63) / 64;
+	size_t numwords = (size_t)mapwords * h;
+#endif
+
+	mapbits = (uint64_t*)calloc(numwords, sizeof(uint64_t));
+	if (!mapbits)
+		Error("Map_Alloc: out of memory for a %i x %i map\n", w, h);
+
+	mapw = w;
+	maph = h;
+}
+
+// anything off the edge of the map is solid
+static bool Map_Solid(int x, int y)
+{
+	if (x < 0 || y < 0 || x >= mapw || y >= maph)
+		return true;
+
+#ifdef MAP_MORTON
+	return (*Map_Block(x >> 3, y >> 3) >> (((y & 7) << 3) | (x & 7))) & 1;
+#else
+	return (mapbits[y * mapwords + (x >> 6)] >> (x & 63)) & 1;
+#endif
+}
+
+static void Map_SetSolid(int x, int y, bool solid)
+{
+#ifdef MAP_MORTON
+	uint64_t *word = Map_Block(x >> 3, y >> 3);
+	uint64_t bit = 1ull << (((y & 7) << 3) | (x & 7));
+#else
+	uint64_t *word = &mapbits[y * mapwords + (x >> 6)];
+	uint64_t bit = 1ull << (x & 63);
+#endif
+
+	if (solid)
+		*word |= bit;
+	else
+		*word &= ~bit;
+}
+
+// the first solid cell in row y from x0 up to x1 (exclusive), or -1. the
+// cells of a rectangle are walked with
+// for (x = Map_FirstSolid(y, x0, x1); x >= 0; x = Map_FirstSolid(y, x + 1, x1))
+static int Map_FirstSolid(int y, int x0, int x1)
+{
+	x0 = max(x0, 0);
+	x1 = min(x1, mapw);
+	if (y < 0 || y >= maph || x0 >= x1)
+		return -1;
+
+#ifdef MAP_MORTON
+	int shift = (y & 7) << 3;
+	for (int bx = x0 >> 3; bx <= (x1 - 1) >> 3; bx++)
+	{
+		uint64_t bits = (*Map_Block(bx, y >> 3) >> shift) & Map_SpanMask(bx * 8, 8, x0, x1);
+		if (bits)
+			return bx * 8 + Bits_First(bits);
+	}
+#else
+	const uint64_t *row = &mapbits[y * mapwords];
+	for (int word = x0 >> 6; word <= (x1 - 1) >> 6; word++)
+	{
+		uint64_t bits = row[word] & Map_SpanMask(word * 64, 64, x0, x1);
+		if (bits)
+			return word * 64 + Bits_First(bits);
+	}
+#endif
+
+	return -1;
+}
+
+// the number of solid cells in x0, y0 to x1, y1 (exclusive) on the map
+static int Map_CountSolid(int x0, int y0, int x1, int y1)
+{
+	x0 = max(x0, 0);
+	y0 = max(y0, 0);
+	x1 = min(x1, mapw);
+	y1 = min(y1, maph);
+	if (x0 >= x1 || y0 >= y1)
+		return 0;
+
+	int count = 0;
+
+#ifdef MAP_MORTON
+	// a byte per row of the block, the column mask repeated in each
+	for (int by = y0 >> 3; by <= (y1 - 1) >> 3; by++)
+	{
+		uint64_t rows = Map_SpanMask(by * 64, 64, y0 * 8, y1 * 8);
+		for (int bx = x0 >> 3; bx <= (x1 - 1) >> 3; bx++)
+		{
+			uint64_t mask = rows & (Map_SpanMask(bx * 8, 8, x0, x1) * 0x0101010101010101ull);
+			count += Bits_Count(*Map_Block(bx, by) & mask);
+		}
+	}
+#else
+	for (int y = y0; y < y1; y++)
+	{
+		const uint64_t *row = &mapbits[y * mapwords];
+		for (int word = x0 >> 6; word <= (x1 - 1) >> 6; word++)
+		{
+			uint64_t mask = Map_SpanMask(word * 64, 64, x0, x1);
+			count += Bits_Count(row[word] & mask);
+		}
+	}
+#endif
+
+	return count;
+}
+
+// true when anything in x0, y0 to x1, y1 (exclusive) on the map is solid
+static bool Map_AnySolid(int x0, int y0, int x1, int y1)
+{
+	x0 = max(x0, 0);
+	y0 = max(y0, 0);
+	x1 = min(x1, mapw);
+	y1 = min(y1, maph);
+	if (x0 >= x1 || y0 >= y1)
+		return false;
+
+#ifdef MAP_MORTON
+	// a byte per row of the block, the column mask repeated in each
+	for (int by = y0 >> 3; by <= (y1 - 1) >> 3; by++)
+	{
+		uint64_t rows = Map_SpanMask(by * 64, 64, y0 * 8, y1 * 8);
+		for (int bx = x0 >> 3; bx <= (x1 - 1) >> 3; bx++)
+		{
+			uint64_t mask = rows & (Map_SpanMask(bx * 8, 8, x0, x1) * 0x0101010101010101ull);
+			if (*Map_Block(bx, by) & mask)
+				return true;
+		}
+	}
+#else
+	for (int y = y0; y < y1; y++)
+	{
+		const uint64_t *row = &mapbits[y * mapwords];
+		for (int word = x0 >> 6; word <= (x1 - 1) >> 6; word++)
+		{
+			uint64_t mask = Map_SpanMask(word * 64, 64, x0, x1);
+			if (row[word] & mask)
+				return true;
+		}
+	}
+#endif
+
+	return false;
+}
+
+// the builtin room
+static void Map_Init()
+{
+	Map_Alloc(8, 8);
+
+	for (int y = 0; y < maph; y++)
+		for (int x = 0; x < mapw; x++)
+			Map_SetSolid(x, y, data[y * 8 + x] == '1');
+}
+
+static void Map_Load(const char *filename)
 {
-	return data[y * 8 + x];
+	FILE *fp = fopen(filename, "rb");
+	if (!fp)
+		Error("Map_Load: couldn't open \"%s\"\n", filename);
+
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	char *text = (char*)malloc(size);
+	if (!text || fread(text, 1, size, fp) != (size_t)size)
+		Error("Map_Load: couldn't read \"%s\"\n", filename);
+	fclose(fp);
+
+	// the widest line sets the width
+	int w = 0, h = 0, len = 0;
+	for (long i = 0; i < size; i++)
+	{
+		if (text[i] == '\n')
+		{
+			w = max(w, len);
+			h++;
+			len = 0;
+		}
+		else if (text[i] != '\r')
+			len++;
+	}
+	if (len)
+	{
+		w = max(w, len);
+		h++;
+	}
+
+	if (!w || !h)
+		Error("Map_Load: \"%s\" is empty\n", filename);
+
+	Map_Alloc(w, h);
+
+	for (long i = 0, x = 0, y = 0; i < size; i++)
+	{
+		if (text[i] == '\n')
+		{
+			x = 0;
+			y++;
+		}
+		else if (text[i] != '\r')
+		{
+			if (text[i] == '1')
+				Map_SetSolid(x, y, true);
+			x++;
+		}
+	}
+
+	free(text);
+
+	printf("loaded \"%s\", %i x %i\n", filename, mapw, maph);
 }
 
 #if 0
@@ -308,9 +730,7 @@ static float Distance(float p[2])
 	{
 		for (int x = 0; x < 8; x++)
 		{
-			char c = GetCell(x, y);
-	
-			if (c != '1')
+			if (!Map_Solid(x, y))
 				continue;
 
 			float center[2] = { x + 0.5f, y + 0.5f };
@@ -383,7 +803,7 @@ static void DrawCursor()
 
 static unsigned char *BuildTextureData(int texw, int texh)
 {
-	unsigned char *data = (unsigned char*)malloc(texw * texh * 4);
+	unsigned char *data = (unsigned char*)Mem_FrameAlloc(texw * texh * 4);
 	for (int y = 0; y < texh; y++)
 	{
 		for (int x = 0; x < texw; x++)
@@ -440,10 +860,12 @@ static void DrawField()
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, texw, texh, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
 
+		// the bake buffer is only needed until the upload completes
+		arenamarker_t marker = Arena_GetMarker(Mem_ThreadArena());
 		glBindTexture(GL_TEXTURE_2D, texture);
 		unsigned char *data = BuildTextureData(texw, texh);
 		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, texw, texh, GL_RGBA, GL_UNSIGNED_BYTE, data);
-		free(data);
+		Arena_FreeToMarker(Mem_ThreadArena(), marker);
 	}
 
 	glBindTexture(GL_TEXTURE_2D, texture);
@@ -477,126 +899,1127 @@ static void DrawField()
 
 #endif
 
-static void DrawGrid()
+// ==============================================
+// camera
+//
+// the camera follows the player and shows camera.height world units
+// from the bottom of the window to the top, the width following the
+// window's aspect. where the map is bigger than the view the view stays
+// on the map, where it isn't the map is centred. everything that draws
+// asks the view what's visible rather than assuming the whole world is
+// on screen
+
+#define CAMERA_FOLLOW		0.1f
+#define CAMERA_MIN_HEIGHT	2.0f
+#define CAMERA_ZOOM			1.25f
+
+typedef struct camera_s
 {
-	for (int y = 0; y < 8; y++)
-	{
-		for (int x = 0; x < 8; x++)
-		{
-			char c = GetCell(x, y);
-			if (c != '1')
-				continue;
+	float origin[2];	// centre of the view
+	float height;
+	bool snap;			// jump straight to the target on the next update
 
-			float s = 1;
+} camera_t;
 
-			glColor3f(1, 1, 1);
-			glBegin(GL_LINE_LOOP);
-			glVertex2f(x    , y    );
-			glVertex2f(x + s, y    );
-			glVertex2f(x + s, y + s);
-			glVertex2f(x    , y + s);
-			glEnd();
-		}
-	}
+static camera_t camera = { { 4.0f, 4.0f }, 8.0f, true };
+
+// the part of the world on screen
+static float viewmins[2], viewmaxs[2];
+
+static void Camera_ViewSize(float size[2])
+{
+	size[0] = camera.height * renderwidth / max(renderheight, 1);
+	size[1] = camera.height;
 }
 
-static void DrawObject(float x, float y)
+// eases the camera toward target, called once a tick
+static void Camera_Follow(float target[2])
 {
-	float s = 0.4f;
+	float size[2];
+	Camera_ViewSize(size);
 
-	glColor3f(1, 0, 1);
+	float mapsize[2] = { (float)mapw, (float)maph };
+	float rate = camera.snap ? 1.0f : CAMERA_FOLLOW;
+	camera.snap = false;
 
-	glBegin(GL_TRIANGLE_STRIP);
-	glVertex2f(x - s, y - s);
-	glVertex2f(x + s, y - s);
-	glVertex2f(x - s, y + s);
-	glVertex2f(x + s, y + s);
-	glEnd();
+	for (int i = 0; i < 2; i++)
+	{
+		float half = size[i] * 0.5f;
+		float goal = target[i];
+
+		if (size[i] >= mapsize[i])
+			goal = mapsize[i] * 0.5f;
+		else
+			goal = max(half, min(goal, mapsize[i] - half));
+
+		camera.origin[i] += (goal - camera.origin[i]) * rate;
+	}
 }
 
-static void DrawPlayer()
+static void Camera_Zoom(float scale)
 {
-	DrawObject(objx, objy);
+	float maxheight = max(mapw, maph) * 2.0f;
+	camera.height = max(CAMERA_MIN_HEIGHT, min(camera.height * scale, maxheight));
 }
 
-static void Draw()
+// sets the view from the camera and loads the matching projection
+static void Camera_SetView()
 {
-	//DrawField();
+	float size[2];
+	Camera_ViewSize(size);
+
+	for (int i = 0; i < 2; i++)
+	{
+		viewmins[i] = camera.origin[i] - size[i] * 0.5f;
+		viewmaxs[i] = camera.origin[i] + size[i] * 0.5f;
+	}
 
-	// draw field will nuke the projection matrix
 	glMatrixMode(GL_MODELVIEW);
 	glLoadIdentity();
 	glMatrixMode(GL_PROJECTION);
 	glLoadIdentity();
-	glOrtho(0, 8, 0, 8, -1, 1);
+	glOrtho(viewmins[0], viewmaxs[0], viewmins[1], viewmaxs[1], -1, 1);
+}
 
-	DrawGrid();
+static bool View_BoxVisible(const float mins[2], const float maxs[2])
+{
+	return mins[0] < viewmaxs[0] && maxs[0] > viewmins[0]
+		&& mins[1] < viewmaxs[1] && maxs[1] > viewmins[1];
+}
 
-	//DrawCursor();
+// converts a window position to the world
+static void ScreenToWorld(float xy[2], int sx, int sy)
+{
+	// convert mouse position from screen to identity
+	xy[0] = (float)sx / (float)renderwidth;
+	xy[1] = 1.0f - ((float)sy / (float)renderheight);
+
+	// convert from identity to the view
+	xy[0] = viewmins[0] + xy[0] * (viewmaxs[0] - viewmins[0]);
+	xy[1] = viewmins[1] + xy[1] * (viewmaxs[1] - viewmins[1]);
 }
 
-static void TryMove()
+// ==============================================
+// grid
+//
+// the outlines of the solid cells are built once per GRID_CHUNK_SIZE
+// square chunk into a vertex buffer and only rebuilt when one of the
+// chunk's cells changes. DrawGrid skips chunks outside the view, so the
+// cost follows what's on screen rather than the size of the map
+
+#define GRID_CHUNK_SIZE		16
+
+typedef struct gridchunk_s
 {
-	float nextx, nexty;
+	GLuint vbo;
+	int numvertices;
+	bool dirty;
 
-	// get the target location
-	nextx = objx + movex;
-	nexty = objy + movey;
+} gridchunk_t;
 
-#if 1
-	// iterate through every object and position correct it
-	for (int y = 0; y < 8; y++)
-	{
-		for (int x = 0; x < 8; x++)
-		{
-			char c = GetCell(x, y);
-	
-			if (c != '1')
-				continue;
+static gridchunk_t *gridchunks;
+static int gridchunksx, gridchunksy;
 
-			float center[2] = { x + 0.5f, y + 0.5f };
-			float half[2] = { 0.5f, 0.5f };
-			
-			// convert p to the local box coodinate system
-			float pp[2] = { nextx - center[0], nexty - center[1] };
-		
-			// expand the bounds by the player
-			//half[0] += 0.1f;
-			//half[1] += 0.1f;
+static void Grid_Init()
+{
+	gridchunksx = (mapw + GRID_CHUNK_SIZE - 1) / GRID_CHUNK_SIZE;
+	gridchunksy = (maph + GRID_CHUNK_SIZE - 1) / GRID_CHUNK_SIZE;
+	gridchunks = (gridchunk_t*)Mem_Alloc(gridchunksx * gridchunksy * sizeof(gridchunk_t));
 
-			trace_t tr;
-			//BoxDistance(&tr, half, pp);
-			RoundedBoxDistance(&tr, half, 0.4f, pp);
+	for (int i = 0; i < gridchunksx * gridchunksy; i++)
+	{
+		gridchunks[i].vbo = 0;
+		gridchunks[i].numvertices = 0;
+		gridchunks[i].dirty = true;
+	}
+}
 
+// marks the chunk holding cell x, y for a rebuild
+static void Grid_Invalidate(int x, int y)
+{
+	if (x < 0 || y < 0 || x >= mapw || y >= maph)
+		return;
 
-			// allow slop on the intersection
-			tr.d += 0.005f;
+	gridchunks[(y / GRID_CHUNK_SIZE) * gridchunksx + (x / GRID_CHUNK_SIZE)].dirty = true;
+}
 
-			// don't need to do anything if no collision
-			if (tr.d > 0.0f)
-				continue;
+static void Grid_BuildChunk(int cx, int cy)
+{
+	gridchunk_t *chunk = &gridchunks[cy * gridchunksx + cx];
 
-			//DebugBreak();
-			//printf("d=%f, n=%f, %f\n", tr.d, tr.n[0], tr.n[1]);
+	int x0 = cx * GRID_CHUNK_SIZE;
+	int y0 = cy * GRID_CHUNK_SIZE;
+	int x1 = min(x0 + GRID_CHUNK_SIZE, mapw);
+	int y1 = min(y0 + GRID_CHUNK_SIZE, maph);
 
-			// otherwise position correct
-			nextx += (-tr.d * tr.n[0]);
-			nexty += (-tr.d * tr.n[1]);
+	// four edges, eight vertices, for every solid cell
+	int numsolid = Map_CountSolid(x0, y0, x1, y1);
+	arenamarker_t marker = Arena_GetMarker(Mem_ThreadArena());
+	float *vertices = (float*)Mem_FrameAlloc(numsolid * 8 * 2 * sizeof(float));
+	float *v = vertices;
+
+	for (int y = y0; y < y1; y++)
+	{
+		for (int x = Map_FirstSolid(y, x0, x1); x >= 0; x = Map_FirstSolid(y, x + 1, x1))
+		{
+			float fx = x, fy = y, s = 1;
+			float corners[4][2] = { { fx, fy }, { fx + s, fy }, { fx + s, fy + s }, { fx, fy + s } };
+
+			for (int i = 0; i < 4; i++)
+			{
+				*v++ = corners[i][0];
+				*v++ = corners[i][1];
+				*v++ = corners[(i + 1) & 3][0];
+				*v++ = corners[(i + 1) & 3][1];
+			}
 		}
 	}
-#endif
 
-	// commit the position changes
-	//printf("cur=%f, %f next=%f, %f\n", objx, objy, nextx, nexty);
-	objx = nextx;
-	objy = nexty;
+	chunk->numvertices = (int)(v - vertices) / 2;
+
+	if (!chunk->vbo)
+		glGenBuffers(1, &chunk->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, chunk->vbo);
+	glBufferData(GL_ARRAY_BUFFER, chunk->numvertices * 2 * sizeof(float), vertices, GL_STATIC_DRAW);
+	Arena_FreeToMarker(Mem_ThreadArena(), marker);
+
+	chunk->dirty = false;
 }
 
-static void Player_Frame()
+static void DrawGrid()
 {
-	float s = 0.05f;
+	int cx0 = max(0, (int)floorf(viewmins[0] / GRID_CHUNK_SIZE));
+	int cy0 = max(0, (int)floorf(viewmins[1] / GRID_CHUNK_SIZE));
+	int cx1 = min(gridchunksx - 1, (int)floorf(viewmaxs[0] / GRID_CHUNK_SIZE));
+	int cy1 = min(gridchunksy - 1, (int)floorf(viewmaxs[1] / GRID_CHUNK_SIZE));
 
-	movex = 0;
+	glColor3f(1, 1, 1);
+	glEnableClientState(GL_VERTEX_ARRAY);
+
+	for (int cy = cy0; cy <= cy1; cy++)
+	{
+		for (int cx = cx0; cx <= cx1; cx++)
+		{
+			gridchunk_t *chunk = &gridchunks[cy * gridchunksx + cx];
+			if (chunk->dirty)
+				Grid_BuildChunk(cx, cy);
+			if (!chunk->numvertices)
+				continue;
+
+			glBindBuffer(GL_ARRAY_BUFFER, chunk->vbo);
+			glVertexPointer(2, GL_FLOAT, 0, NULL);
+			glDrawArrays(GL_LINES, 0, chunk->numvertices);
+		}
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+// changes a cell, rebuilding whatever was made from it
+static void Map_SetCell(int x, int y, bool solid)
+{
+	if (x < 0 || y < 0 || x >= mapw || y >= maph)
+		return;
+	if (Map_Solid(x, y) == solid)
+		return;
+
+	Map_SetSolid(x, y, solid);
+	Grid_Invalidate(x, y);
+}
+
+static void DrawObject(float x, float y)
+{
+	float s = 0.4f;
+
+	float mins[2] = { x - s, y - s };
+	float maxs[2] = { x + s, y + s };
+	if (!View_BoxVisible(mins, maxs))
+		return;
+
+	glColor3f(1, 0, 1);
+
+	glBegin(GL_TRIANGLE_STRIP);
+	glVertex2f(x - s, y - s);
+	glVertex2f(x + s, y - s);
+	glVertex2f(x - s, y + s);
+	glVertex2f(x + s, y + s);
+	glEnd();
+}
+
+static void DrawPlayer()
+{
+	DrawObject(objx, objy);
+}
+
+static void Draw()
+{
+	Camera_SetView();
+
+	//DrawField();
+
+	DrawGrid();
+
+	//DrawCursor();
+}
+
+// ==============================================
+// contact solver
+//
+// the player's contacts are gathered first: every solid cell in reach
+// whose distance is under CONTACT_SKIN, each as a normal and a
+// separation at the target. the push for all of them is then found
+// together with projected gauss-seidel on the contact impulses. that
+// converges on the smallest push that leaves every contact separated,
+// whatever order the cells were found in, so corners aren't pushed twice
+// and no slop is needed. the rounded corners aren't linear so the
+// contacts are gathered again where the push ends and the solve is
+// repeated until nothing is left touching, at most MAX_CONTACT_PASSES
+// times. -sequential goes back to correcting each cell as it's found
+
+// half a cell plus the player's rounding, and a cell of margin
+#define TRYMOVE_REACH			2.0f
+
+#define PLAYER_RADIUS			0.4f
+#define CONTACT_SKIN			0.01f
+#define CONTACT_TOLERANCE		0.0001f
+#define MAX_CONTACTS			64
+#define MAX_CONTACT_PASSES		4
+#define MAX_CONTACT_ITERATIONS	32
+
+typedef struct contact_s
+{
+	float n[2];
+	float d;			// separation where the contacts were gathered
+	float lambda;		// how far it's been pushed along n
+
+} contact_t;
+
+typedef struct solverstats_s
+{
+	long long moves;
+	long long passes;
+	long long iterations;
+	long long evaluations;	// cell distances evaluated
+	int maxiterations;
+	int unconverged;
+
+} solverstats_t;
+
+static bool sequentialsolve = false;
+static solverstats_t solverstats;
+
+static void Contact_PrintStats()
+{
+	solverstats_t *ss = &solverstats;
+	double moves = ss->moves ? (double)ss->moves : 1.0;
+
+	printf("solver: %s, %lld moves, %.2f distance evaluations a move\n",
+		sequentialsolve ? "sequential" : "gauss-seidel", ss->moves, ss->evaluations / moves);
+	if (!sequentialsolve)
+	{
+		printf("solver: %.3f passes and %.3f iterations a move, %i iterations at most, %i didn't converge\n",
+			ss->passes / moves, ss->iterations / moves, ss->maxiterations, ss->unconverged);
+	}
+}
+
+// the cells within reach of p
+static void Contact_Reach(const float p[2], float reach, int *x0, int *y0, int *x1, int *y1)
+{
+	*x0 = (int)floorf(p[0] - reach);
+	*y0 = (int)floorf(p[1] - reach);
+	*x1 = (int)floorf(p[0] + reach) + 1;
+	*y1 = (int)floorf(p[1] + reach) + 1;
+}
+
+// the contacts of something rounded by radius at p. counts the distances
+// it evaluates into evaluations, it's called from the body threads too
+static int Contact_Gather(const float p[2], float radius, contact_t *contacts, long long *evaluations)
+{
+	// nothing moves until the solve so no margin is needed
+	int x0, y0, x1, y1;
+	Contact_Reach(p, 0.5f + radius + CONTACT_SKIN, &x0, &y0, &x1, &y1);
+	if (!Map_AnySolid(x0, y0, x1, y1))
+		return 0;
+
+	int numcontacts = 0;
+	for (int y = y0; y < y1; y++)
+	{
+		for (int x = Map_FirstSolid(y, x0, x1); x >= 0; x = Map_FirstSolid(y, x + 1, x1))
+		{
+			float half[2] = { 0.5f, 0.5f };
+			float pp[2] = { p[0] - (x + 0.5f), p[1] - (y + 0.5f) };
+
+			trace_t tr;
+			RoundedBoxDistance(&tr, half, radius, pp);
+			(*evaluations)++;
+
+			// a point exactly on a diagonal inside the box has no normal
+			if (tr.d >= CONTACT_SKIN || Vec2_Dot(tr.n, tr.n) < 0.5f)
+				continue;
+
+			contact_t *c = &contacts[numcontacts++];
+			c->n[0] = tr.n[0];
+			c->n[1] = tr.n[1];
+			c->d = tr.d;
+			c->lambda = 0.0f;
+
+			// nothing further is evaluated once it's full
+			if (numcontacts == MAX_CONTACTS)
+				return numcontacts;
+		}
+	}
+
+	return numcontacts;
+}
+
+// finds the push that separates every contact, returns the iterations it
+// took or -1 if it didn't converge
+static int Contact_Solve(contact_t *contacts, int numcontacts, float push[2])
+{
+	push[0] = push[1] = 0.0f;
+
+	for (int iteration = 1; iteration <= MAX_CONTACT_ITERATIONS; iteration++)
+	{
+		float change = 0.0f;
+
+		for (int i = 0; i < numcontacts; i++)
+		{
+			contact_t *c = &contacts[i];
+
+			// the separation after the push so far, pushing out only
+			float d = c->d + Vec2_Dot(c->n, push);
+			float lambda = max(c->lambda - d, 0.0f);
+			float dl = lambda - c->lambda;
+			c->lambda = lambda;
+
+			push[0] += dl * c->n[0];
+			push[1] += dl * c->n[1];
+			change = max(change, fabsf(dl));
+		}
+
+		if (change < CONTACT_TOLERANCE)
+			return iteration;
+	}
+
+	return -1;
+}
+
+// the old order dependent push out, each cell moves the target as it's found
+static void Contact_PushOutSequential(float next[2])
+{
+	int x0, y0, x1, y1;
+	Contact_Reach(next, TRYMOVE_REACH, &x0, &y0, &x1, &y1);
+	if (!Map_AnySolid(x0, y0, x1, y1))
+		return;
+
+	// iterate through every solid cell in reach and position correct it
+	for (int y = y0; y < y1; y++)
+	{
+		for (int x = Map_FirstSolid(y, x0, x1); x >= 0; x = Map_FirstSolid(y, x + 1, x1))
+		{
+			float center[2] = { x + 0.5f, y + 0.5f };
+			float half[2] = { 0.5f, 0.5f };
+			
+			// convert p to the local box coodinate system
+			float pp[2] = { next[0] - center[0], next[1] - center[1] };
+
+			trace_t tr;
+			//BoxDistance(&tr, half, pp);
+			RoundedBoxDistance(&tr, half, PLAYER_RADIUS, pp);
+			solverstats.evaluations++;
+
+			// allow slop on the intersection
+			tr.d += 0.005f;
+
+			// don't need to do anything if no collision
+			if (tr.d > 0.0f)
+				continue;
+
+			// otherwise position correct
+			next[0] += (-tr.d * tr.n[0]);
+			next[1] += (-tr.d * tr.n[1]);
+		}
+	}
+}
+
+static void TryMove()
+{
+	// get the target location
+	float next[2] = { objx + movex, objy + movey };
+
+	solverstats.moves++;
+
+	if (sequentialsolve)
+		Contact_PushOutSequential(next);
+	else
+	{
+		for (int pass = 0; pass < MAX_CONTACT_PASSES; pass++)
+		{
+			contact_t contacts[MAX_CONTACTS];
+			int numcontacts = Contact_Gather(next, PLAYER_RADIUS, contacts, &solverstats.evaluations);
+
+			// done when nothing's overlapping
+			bool touching = false;
+			for (int i = 0; i < numcontacts; i++)
+				touching |= contacts[i].d < -CONTACT_TOLERANCE;
+			if (!touching)
+				break;
+
+			float push[2];
+			int iterations = Contact_Solve(contacts, numcontacts, push);
+			if (iterations < 0)
+			{
+				solverstats.unconverged++;
+				iterations = MAX_CONTACT_ITERATIONS;
+			}
+			solverstats.passes++;
+			solverstats.iterations += iterations;
+			solverstats.maxiterations = max(solverstats.maxiterations, iterations);
+
+			next[0] += push[0];
+			next[1] += push[1];
+		}
+	}
+
+	// commit the position changes
+	objx = next[0];
+	objy = next[1];
+}
+
+// ==============================================
+// bodies
+//
+// -bodies scatters small round bodies that wander the map, pushing each
+// other and the cells apart. each tick they move, the pairs close enough
+// to touch become contacts and the contacts are solved as position
+// constraints over BODY_ITERATIONS sweeps. by default the contacts are
+// coloured so that no two of a colour share a body, and each colour is
+// a gauss-seidel sweep split over the solver threads. -jacobi instead
+// works out every contact's correction from the same positions and then
+// averages them per body, which needs no colouring but converges slower.
+// each contact or body is updated by exactly one thread from inputs no
+// other thread writes in that step, so the result doesn't depend on the
+// thread count or on which thread got which batch
+
+#define MAX_BODY_THREADS	16
+#define MAX_BODY_COLOURS	64		// contacts that don't fit are solved on the main thread
+#define BODY_RADIUS			0.2f
+#define BODY_SKIN			0.05f
+#define BODY_SPEED			0.03f
+#define BODY_ITERATIONS		8
+#define BODY_BATCH			64		// contacts or bodies a thread takes at a time
+#define BODY_BENCH_COUNT	20000
+#define BODY_BENCH_TICKS	100
+
+typedef struct body_s
+{
+	float pos[2];
+	float prev[2];		// where the tick started
+	float vel[2];
+
+} body_t;
+
+typedef struct bodycontact_s
+{
+	int a, b;
+	float delta[2];		// jacobi, how far a moves, b moves the other way
+
+} bodycontact_t;
+
+typedef struct bodystats_s
+{
+	long long ticks;
+	long long contacts;
+	long long colours;
+	long long leftovers;	// contacts that ran out of colours
+	int maxcolours;
+	double ms;
+
+} bodystats_t;
+
+typedef void (*bodyjobfunc_t)(int first, int last);
+
+typedef struct bodyjob_s
+{
+	bodyjobfunc_t func;
+	int count;
+	int numthreads;
+	int next;
+	int finished;
+
+} bodyjob_t;
+
+static body_t *bodies;
+static int numbodies, maxbodies;
+static bodycontact_t *bodycontacts;
+static bodycontact_t *bodysorted;
+static int numbodycontacts, maxbodycontacts;
+static int bodycolourstart[MAX_BODY_COLOURS + 2];	// the last colour is the leftovers
+static int numbodycolours;
+static uint64_t *bodycolourmask;
+static int *bodyadjstart, *bodyadj;		// each body's contacts, for jacobi
+static int *bodygrid, *bodynext;		// a list of bodies per map cell
+static int bodytick;
+static unsigned int bodyseed = 1;
+static bool jacobisolve = false;
+static bodystats_t bodystats;
+
+static int numbodythreads = -1;		// -1 is one per cpu
+static int activebodythreads;
+static pthread_t bodythreads[MAX_BODY_THREADS];
+static pthread_mutex_t bodylock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bodywake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t bodydone = PTHREAD_COND_INITIALIZER;
+static int bodygeneration;
+static int bodyacked;		// workers done with the current generation
+static bodyjob_t bodyjob;
+
+// the colour being swept
+static int bodybatchfirst;
+
+static double Sys_Milliseconds()
+{
+#ifdef WIN32
+	return (double)glutGet(GLUT_ELAPSED_TIME);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000.0) + (ts.tv_nsec / 1000000.0);
+#endif
+}
+
+static unsigned int Body_Random()
+{
+	bodyseed = bodyseed * 1664525u + 1013904223u;
+	return bodyseed >> 8;
+}
+
+static void Body_PrintStats()
+{
+	bodystats_t *bs = &bodystats;
+	double ticks = bs->ticks ? (double)bs->ticks : 1.0;
+
+	printf("bodies: %i bodies, %s on %i threads, %lld ticks, %.2f ms a tick\n",
+		numbodies, jacobisolve ? "jacobi" : "coloured gauss-seidel", activebodythreads, bs->ticks, bs->ms / ticks);
+	printf("bodies: %.1f contacts a tick, %.1f colours a tick, %i colours at most, %lld contacts left over\n",
+		bs->contacts / ticks, bs->colours / ticks, bs->maxcolours, bs->leftovers);
+}
+
+// takes batches until the job's done
+static void Body_RunJob(bodyjob_t *job)
+{
+	int done = 0;
+
+	for (;;)
+	{
+		int first = __sync_fetch_and_add(&job->next, BODY_BATCH);
+		if (first >= job->count)
+			break;
+
+		int last = min(first + BODY_BATCH, job->count);
+		job->func(first, last);
+		done += last - first;
+	}
+
+	pthread_mutex_lock(&bodylock);
+	job->finished += done;
+	if (job->finished == job->count)
+		pthread_cond_signal(&bodydone);
+	pthread_mutex_unlock(&bodylock);
+}
+
+// every worker acknowledges every generation, even the ones sitting it
+// out, and the main thread waits for all of them before it returns. so
+// no worker can still be reading the job when the next one is set up
+static void *Body_Worker(void *arg)
+{
+	int index = (int)(size_t)arg;
+	int generation = 0;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&bodylock);
+		while (bodygeneration == generation)
+			pthread_cond_wait(&bodywake, &bodylock);
+		generation = bodygeneration;
+		pthread_mutex_unlock(&bodylock);
+
+		// threads past the active count sit this one out
+		if (index < bodyjob.numthreads)
+			Body_RunJob(&bodyjob);
+
+		pthread_mutex_lock(&bodylock);
+		bodyacked++;
+		pthread_cond_signal(&bodydone);
+		pthread_mutex_unlock(&bodylock);
+	}
+
+	return NULL;
+}
+
+static void Body_InitThreads()
+{
+	if (numbodythreads < 0)
+	{
+#ifdef WIN32
+		numbodythreads = 1;
+#else
+		numbodythreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	}
+	numbodythreads = max(1, min(numbodythreads, MAX_BODY_THREADS));
+	activebodythreads = numbodythreads;
+
+	// the main thread is one of them
+	for (int i = 1; i < numbodythreads; i++)
+	{
+		if (pthread_create(&bodythreads[i], NULL, Body_Worker, (void*)(size_t)i))
+			Error("Body_InitThreads: failed to start thread %i\n", i);
+	}
+}
+
+// runs func over 0 to count on the active threads
+static void Body_Parallel(bodyjobfunc_t func, int count)
+{
+	bodyjob_t *job = &bodyjob;
+
+	if (activebodythreads < 2 || count <= BODY_BATCH)
+	{
+		if (count > 0)
+			func(0, count);
+		return;
+	}
+
+	pthread_mutex_lock(&bodylock);
+	job->func = func;
+	job->count = count;
+	job->numthreads = activebodythreads;
+	job->next = 0;
+	job->finished = 0;
+	bodyacked = 0;
+	bodygeneration++;
+	pthread_cond_broadcast(&bodywake);
+	pthread_mutex_unlock(&bodylock);
+
+	Body_RunJob(job);
+
+	pthread_mutex_lock(&bodylock);
+	while (job->finished < count || bodyacked < numbodythreads - 1)
+		pthread_cond_wait(&bodydone, &bodylock);
+	pthread_mutex_unlock(&bodylock);
+}
+
+static void Body_Init(int count)
+{
+	maxbodies = count;
+	maxbodycontacts = count * 8;
+
+	bodies = (body_t*)Mem_Alloc(maxbodies * sizeof(body_t));
+	bodycontacts = (bodycontact_t*)Mem_Alloc(maxbodycontacts * sizeof(bodycontact_t));
+	bodysorted = (bodycontact_t*)Mem_Alloc(maxbodycontacts * sizeof(bodycontact_t));
+	bodycolourmask = (uint64_t*)Mem_Alloc(maxbodies * sizeof(uint64_t));
+	bodyadjstart = (int*)Mem_Alloc((maxbodies + 1) * sizeof(int));
+	bodyadj = (int*)Mem_Alloc(maxbodycontacts * 2 * sizeof(int));
+	bodynext = (int*)Mem_Alloc(maxbodies * sizeof(int));
+
+	// as big as the map so it goes with it
+	bodygrid = (int*)malloc((size_t)mapw * maph * sizeof(int));
+	if (!bodygrid)
+		Error("Body_Init: out of memory for a %i x %i grid\n", mapw, maph);
+
+	Body_InitThreads();
+}
+
+// scatters count bodies over the empty cells
+static void Body_Spawn(int count)
+{
+	bodyseed = 1;
+	bodytick = 0;
+	numbodies = 0;
+
+	for (int tries = 0; numbodies < min(count, maxbodies) && tries < count * 100; tries++)
+	{
+		int x = Body_Random() % mapw;
+		int y = Body_Random() % maph;
+		if (Map_Solid(x, y))
+			continue;
+
+		body_t *b = &bodies[numbodies++];
+		b->pos[0] = x + 0.25f + 0.5f * (Body_Random() % 1000) / 1000.0f;
+		b->pos[1] = y + 0.25f + 0.5f * (Body_Random() % 1000) / 1000.0f;
+		b->vel[0] = BODY_SPEED * ((int)(Body_Random() % 2001) - 1000) / 1000.0f;
+		b->vel[1] = BODY_SPEED * ((int)(Body_Random() % 2001) - 1000) / 1000.0f;
+	}
+}
+
+// the pairs that are touching or about to, found through the cells
+// they're in. bodies are smaller than a cell so only the cells around
+// need looking at
+static void Body_FindContacts()
+{
+	for (int i = 0; i < mapw * maph; i++)
+		bodygrid[i] = -1;
+
+	// backwards so each cell's list runs in body order
+	for (int i = numbodies - 1; i >= 0; i--)
+	{
+		int x = (int)floorf(bodies[i].pos[0]);
+		int y = (int)floorf(bodies[i].pos[1]);
+		bodynext[i] = bodygrid[y * mapw + x];
+		bodygrid[y * mapw + x] = i;
+	}
+
+	numbodycontacts = 0;
+
+	for (int i = 0; i < numbodies; i++)
+	{
+		body_t *a = &bodies[i];
+		int x = (int)floorf(a->pos[0]);
+		int y = (int)floorf(a->pos[1]);
+
+		for (int cy = max(y - 1, 0); cy <= min(y + 1, maph - 1); cy++)
+		{
+			for (int cx = max(x - 1, 0); cx <= min(x + 1, mapw - 1); cx++)
+			{
+				for (int j = bodygrid[cy * mapw + cx]; j >= 0; j = bodynext[j])
+				{
+					if (j <= i)
+						continue;
+
+					float v[2] = { bodies[j].pos[0] - a->pos[0], bodies[j].pos[1] - a->pos[1] };
+					if (Vec2_Length(v) - 2 * BODY_RADIUS >= BODY_SKIN)
+						continue;
+					if (numbodycontacts == maxbodycontacts)
+						continue;
+
+					bodycontact_t *c = &bodycontacts[numbodycontacts++];
+					c->a = i;
+					c->b = j;
+				}
+			}
+		}
+	}
+}
+
+// greedy colouring, each contact gets the first colour neither body has
+// used yet. the contacts are then sorted by colour
+static void Body_ColourContacts()
+{
+	bodystats_t *bs = &bodystats;
+	int counts[MAX_BODY_COLOURS + 1];
+	unsigned char *colours = (unsigned char*)Mem_FrameAlloc(max(numbodycontacts, 1));
+
+	memset(bodycolourmask, 0, numbodies * sizeof(uint64_t));
+	memset(counts, 0, sizeof(counts));
+	numbodycolours = 0;
+
+	for (int i = 0; i < numbodycontacts; i++)
+	{
+		bodycontact_t *c = &bodycontacts[i];
+		uint64_t unused = ~(bodycolourmask[c->a] | bodycolourmask[c->b]);
+
+		int colour = MAX_BODY_COLOURS;
+		if (unused)
+		{
+			colour = Bits_First(unused);
+			bodycolourmask[c->a] |= 1ull << colour;
+			bodycolourmask[c->b] |= 1ull << colour;
+			numbodycolours = max(numbodycolours, colour + 1);
+		}
+		else
+			bs->leftovers++;
+
+		colours[i] = colour;
+		counts[colour]++;
+	}
+
+	int total = 0;
+	for (int i = 0; i <= MAX_BODY_COLOURS; i++)
+	{
+		bodycolourstart[i] = total;
+		total += counts[i];
+	}
+	bodycolourstart[MAX_BODY_COLOURS + 1] = total;
+
+	// stable, so each colour keeps the contacts in the order they were found
+	int fill[MAX_BODY_COLOURS + 1];
+	memcpy(fill, bodycolourstart, sizeof(fill));
+	for (int i = 0; i < numbodycontacts; i++)
+		bodysorted[fill[colours[i]]++] = bodycontacts[i];
+
+	bodycontact_t *swap = bodycontacts;
+	bodycontacts = bodysorted;
+	bodysorted = swap;
+
+	bs->colours += numbodycolours;
+	bs->maxcolours = max(bs->maxcolours, numbodycolours);
+}
+
+// each body's contacts in contact order, so jacobi can sum them per body
+static void Body_BuildAdjacency()
+{
+	memset(bodyadjstart, 0, (numbodies + 1) * sizeof(int));
+	for (int i = 0; i < numbodycontacts; i++)
+	{
+		bodyadjstart[bodycontacts[i].a + 1]++;
+		bodyadjstart[bodycontacts[i].b + 1]++;
+	}
+	for (int i = 0; i < numbodies; i++)
+		bodyadjstart[i + 1] += bodyadjstart[i];
+
+	int *fill = (int*)Mem_FrameAlloc(max(numbodies, 1) * sizeof(int));
+	memcpy(fill, bodyadjstart, numbodies * sizeof(int));
+	for (int i = 0; i < numbodycontacts; i++)
+	{
+		bodyadj[fill[bodycontacts[i].a]++] = i;
+		bodyadj[fill[bodycontacts[i].b]++] = i;
+	}
+}
+
+// how far a has to move to separate the pair, b moves the same the other way
+static void Body_ContactCorrection(const bodycontact_t *c, float delta[2])
+{
+	const body_t *a = &bodies[c->a];
+	const body_t *b = &bodies[c->b];
+
+	// the trace from a to b, the distance and the normal at the contact
+	trace_t tr;
+	float v[2] = { b->pos[0] - a->pos[0], b->pos[1] - a->pos[1] };
+	float len = Vec2_Length(v);
+	tr.d = len - 2 * BODY_RADIUS;
+	tr.n[0] = len > 0.0f ? v[0] / len : 1.0f;
+	tr.n[1] = len > 0.0f ? v[1] / len : 0.0f;
+
+	delta[0] = delta[1] = 0.0f;
+	if (tr.d >= 0.0f)
+		return;
+
+	delta[0] = 0.5f * tr.d * tr.n[0];
+	delta[1] = 0.5f * tr.d * tr.n[1];
+}
+
+// a gauss-seidel sweep over one colour, no two of which share a body
+static void Body_SolveBatch(int first, int last)
+{
+	for (int i = bodybatchfirst + first; i < bodybatchfirst + last; i++)
+	{
+		bodycontact_t *c = &bodycontacts[i];
+		float delta[2];
+
+		Body_ContactCorrection(c, delta);
+		bodies[c->a].pos[0] += delta[0];
+		bodies[c->a].pos[1] += delta[1];
+		bodies[c->b].pos[0] -= delta[0];
+		bodies[c->b].pos[1] -= delta[1];
+	}
+}
+
+static void Body_JacobiCorrections(int first, int last)
+{
+	for (int i = first; i < last; i++)
+		Body_ContactCorrection(&bodycontacts[i], bodycontacts[i].delta);
+}
+
+static void Body_JacobiApply(int first, int last)
+{
+	for (int i = first; i < last; i++)
+	{
+		int n = bodyadjstart[i + 1] - bodyadjstart[i];
+		if (!n)
+			continue;
+
+		float sum[2] = { 0.0f, 0.0f };
+		for (int k = bodyadjstart[i]; k < bodyadjstart[i + 1]; k++)
+		{
+			bodycontact_t *c = &bodycontacts[bodyadj[k]];
+			float sign = c->a == i ? 1.0f : -1.0f;
+			sum[0] += sign * c->delta[0];
+			sum[1] += sign * c->delta[1];
+		}
+
+		bodies[i].pos[0] += sum[0] / n;
+		bodies[i].pos[1] += sum[1] / n;
+	}
+}
+
+// pushes each body out of the cells with the player's contact solve
+static void Body_SolveCells(int first, int last)
+{
+	long long evaluations = 0;
+
+	for (int i = first; i < last; i++)
+	{
+		body_t *b = &bodies[i];
+		contact_t contacts[MAX_CONTACTS];
+
+		int numcontacts = Contact_Gather(b->pos, BODY_RADIUS, contacts, &evaluations);
+		if (!numcontacts)
+			continue;
+
+		float push[2];
+		Contact_Solve(contacts, numcontacts, push);
+		b->pos[0] += push[0];
+		b->pos[1] += push[1];
+	}
+}
+
+static void Body_Frame()
+{
+	bodystats_t *bs = &bodystats;
+	double start = Sys_Milliseconds();
+
+	bodytick++;
+
+	for (int i = 0; i < numbodies; i++)
+	{
+		body_t *b = &bodies[i];
+
+		// turn now and then, by body and tick so it's the same every run
+		unsigned int turn = (unsigned int)i * 2654435761u ^ (unsigned int)bodytick * 40503u;
+		if ((turn >> 7) % 64 == 0)
+		{
+			float vx = b->vel[0];
+			b->vel[0] = -b->vel[1];
+			b->vel[1] = vx;
+		}
+
+		b->prev[0] = b->pos[0];
+		b->prev[1] = b->pos[1];
+		b->pos[0] = max(0.0f, min(b->pos[0] + b->vel[0], mapw - 0.001f));
+		b->pos[1] = max(0.0f, min(b->pos[1] + b->vel[1], maph - 0.001f));
+	}
+
+	Body_FindContacts();
+	if (jacobisolve)
+		Body_BuildAdjacency();
+	else
+		Body_ColourContacts();
+
+	for (int iteration = 0; iteration < BODY_ITERATIONS; iteration++)
+	{
+		if (jacobisolve)
+		{
+			Body_Parallel(Body_JacobiCorrections, numbodycontacts);
+			Body_Parallel(Body_JacobiApply, numbodies);
+		}
+		else
+		{
+			for (int colour = 0; colour < numbodycolours; colour++)
+			{
+				bodybatchfirst = bodycolourstart[colour];
+				Body_Parallel(Body_SolveBatch, bodycolourstart[colour + 1] - bodycolourstart[colour]);
+			}
+
+			// the leftovers share bodies, one at a time
+			bodybatchfirst = bodycolourstart[MAX_BODY_COLOURS];
+			Body_SolveBatch(0, bodycolourstart[MAX_BODY_COLOURS + 1] - bodycolourstart[MAX_BODY_COLOURS]);
+		}
+
+		Body_Parallel(Body_SolveCells, numbodies);
+	}
+
+	// the velocity is whatever the solve left, kept to walking pace
+	for (int i = 0; i < numbodies; i++)
+	{
+		body_t *b = &bodies[i];
+
+		b->pos[0] = max(0.0f, min(b->pos[0], mapw - 0.001f));
+		b->pos[1] = max(0.0f, min(b->pos[1], maph - 0.001f));
+
+		float v[2] = { b->pos[0] - b->prev[0], b->pos[1] - b->prev[1] };
+		float speed = Vec2_Length(v);
+		if (speed > 0.001f)
+		{
+			b->vel[0] = v[0] * (BODY_SPEED / speed);
+			b->vel[1] = v[1] * (BODY_SPEED / speed);
+		}
+	}
+
+	bs->ticks++;
+	bs->contacts += numbodycontacts;
+	bs->ms += Sys_Milliseconds() - start;
+}
+
+static void DrawBodies()
+{
+	float s = BODY_RADIUS;
+
+	glColor3f(0, 1, 1);
+	glBegin(GL_QUADS);
+	for (int i = 0; i < numbodies; i++)
+	{
+		float x = bodies[i].pos[0];
+		float y = bodies[i].pos[1];
+		float mins[2] = { x - s, y - s };
+		float maxs[2] = { x + s, y + s };
+		if (!View_BoxVisible(mins, maxs))
+			continue;
+
+		glVertex2f(x - s, y - s);
+		glVertex2f(x + s, y - s);
+		glVertex2f(x + s, y + s);
+		glVertex2f(x - s, y + s);
+	}
+	glEnd();
+}
+
+// runs the same bodies on 1 to the most threads and prints the time a
+// tick and a checksum of where they ended up, which should all match
+static void Body_Benchmark(int count)
+{
+	// a walled room with some blocks in it
+	Map_Alloc(256, 256);
+	for (int y = 0; y < maph; y++)
+	{
+		for (int x = 0; x < mapw; x++)
+		{
+			bool wall = x == 0 || y == 0 || x == mapw - 1 || y == maph - 1;
+			Map_SetSolid(x, y, wall || Body_Random() % 20 == 0);
+		}
+	}
+
+	Body_Init(count);
+
+	int maxthreads = numbodythreads;
+	double single = 0.0;
+
+	for (int threads = 1; threads <= maxthreads; threads++)
+	{
+		activebodythreads = threads;
+		Body_Spawn(count);
+		memset(&bodystats, 0, sizeof(bodystats));
+
+		for (int t = 0; t < BODY_BENCH_TICKS; t++)
+		{
+			Body_Frame();
+			Mem_EndFrame();
+		}
+
+		unsigned int checksum = 0;
+		for (int i = 0; i < numbodies; i++)
+		{
+			unsigned int bits[2];
+			memcpy(bits, bodies[i].pos, sizeof(bits));
+			checksum = checksum * 31 + bits[0];
+			checksum = checksum * 31 + bits[1];
+		}
+
+		double ms = bodystats.ms / bodystats.ticks;
+		if (threads == 1)
+			single = ms;
+
+		printf("%s, %i bodies, %i threads: %.2f ms a tick, %.2fx, %.1f contacts, %.1f colours, checksum %08x\n",
+			jacobisolve ? "jacobi" : "coloured", numbodies, threads, ms, single / ms,
+			(double)bodystats.contacts / bodystats.ticks, (double)bodystats.colours / bodystats.ticks, checksum);
+	}
+}
+
+static void Player_Frame()
+{
+	float s = 0.05f;
+
+	movex = 0;
 	if (keyactions[ka_left])
 		movex -= s;
 	if (keyactions[ka_right])
@@ -622,7 +2045,11 @@ static void DisplayFunc()
 
 	DrawPlayer();
 
+	DrawBodies();
+
 	glutSwapBuffers();
+
+	Mem_EndFrame();
 }
 
 static void ReshapeFunc(int w, int h)
@@ -636,7 +2063,11 @@ static void ReshapeFunc(int w, int h)
 static void MouseFunc(int button, int state, int x, int y)
 {
 	if(button == GLUT_LEFT_BUTTON)
+	{
+		if (state == GLUT_DOWN && !input.lbuttondown)
+			lbuttonclicked = true;
 		input.lbuttondown = (state == GLUT_DOWN);
+	}
 	if(button == GLUT_RIGHT_BUTTON)
 		input.rbuttondown = (state == GLUT_DOWN);
 }
@@ -661,6 +2092,10 @@ static void KeyDownFunc(unsigned char key, int x, int y)
 		keyactions[ka_x] = true;
 	if (key == 'z')
 		keyactions[ka_y] = true;
+	if (key == '=' || key == '+')
+		Camera_Zoom(1.0f / CAMERA_ZOOM);
+	if (key == '-')
+		Camera_Zoom(CAMERA_ZOOM);
 }
 static void KeyUpFunc(unsigned char key, int x, int y)
 {
@@ -707,20 +2142,95 @@ static void TimerFunc(int value)
 	// standard mouse input
 	ProcessInput();
 
+	// clicking toggles the cell under the cursor
+	if (lbuttonclicked)
+	{
+		float xy[2];
+		ScreenToWorld(xy, mousepos[0], mousepos[1]);
+
+		int x = (int)floorf(xy[0]);
+		int y = (int)floorf(xy[1]);
+		Map_SetCell(x, y, !Map_Solid(x, y));
+		lbuttonclicked = false;
+	}
+
 	Player_Frame();
 
+	if (numbodies)
+		Body_Frame();
+
+	float target[2] = { objx, objy };
+	Camera_Follow(target);
+
+	Mem_EndFrame();
+
 	// kick a display refresh
 	glutPostRedisplay();
 	glutTimerFunc(16, TimerFunc, 0);
 }
 
 static void PrintUsage()
-{}
+{
+	printf("usage: hldc2 [-sequential] [-bodies n] [-jacobi] [-threads n] [-bodybench] [mapfile]\n");
+	printf("  -sequential push out of each cell in turn instead of solving the contacts together\n");
+	printf("  -bodies     scatter n bodies that push each other around\n");
+	printf("  -jacobi     solve the body contacts all at once instead of colour by colour\n");
+	printf("  -threads    body solver threads, default one per cpu\n");
+	printf("  -bodybench  time %i bodies on 1 to -threads threads and exit\n", BODY_BENCH_COUNT);
+	printf("  mapfile     rows of 0 and 1 with the bottom row first, default is the builtin room\n");
+}
 
 int main(int argc, char *argv[])
 {
+	Mem_Init();
+
+	int numspawn = 0;
+	bool bench = false;
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-sequential"))
+			sequentialsolve = true;
+		else if (!strcmp(argv[i], "-bodies") && i + 1 < argc)
+			numspawn = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-jacobi"))
+			jacobisolve = true;
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+			numbodythreads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-bodybench"))
+			bench = true;
+		else if (argv[i][0] != '-' && !filename)
+			filename = argv[i];
+		else
+		{
+			PrintUsage();
+			return 1;
+		}
+	}
+
+	// doesn't need a window
+	if (bench)
+	{
+		Body_Benchmark(BODY_BENCH_COUNT);
+		return 0;
+	}
+
 	glutInit(&argc, argv);
 
+	if (filename)
+		Map_Load(filename);
+	else
+		Map_Init();
+	Grid_Init();
+
+	atexit(Contact_PrintStats);
+
+	if (numspawn > 0)
+	{
+		Body_Init(numspawn);
+		Body_Spawn(numspawn);
+		atexit(Body_PrintStats);
+	}
+
 	glutInitWindowPosition(0, 0);
 	glutInitWindowSize(400, 400);
 	glutInitDisplayMode(GLUT_RGBA | GLUT_DEPTH | GLUT_DOUBLE);
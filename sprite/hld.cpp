@@ -1,6 +1,37 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <limits.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define GL_GLEXT_PROTOTYPES
 #include <GL/freeglut.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SOFT_AVX2
+#include <immintrin.h>
+#endif
+
+#undef min
+#define min(a, b) (a < b ? a : b)
+
+#undef max
+#define max(a, b) (a > b ? a : b)
+
 // attributes for sprite rendering:
 // color
 // transparency
@@ -16,405 +47,4535 @@ static int renderw = screenw / 2;
 static int renderh = screenh / 2;
 static int framenum = 0;
 
-// texture identifiers
-enum
+// texture identifiers, the texture manager maps them to gl names
+enum
+{
+	BUILTIN_SOLID,
+	BUILTIN_HLINE,
+	BUILTIN_VLINE,
+	BUILTIN_DLINE,
+	BUILTIN_CHECK,
+	BUILTIN_POINT,
+	SPR0,
+	NUM_SPR
+};
+
+// sprite data
+//
+// every frame of every sprite is packed into atlas pages at load time,
+// so picking a frame is just a change of texture coordinates
+
+// a run of texels in a row that aren't fully transparent
+typedef struct framespan_s
+{
+	short x, length;
+
+} framespan_t;
+
+typedef struct spriteframe_s
+{
+	int width, height;
+	int originx, originy;
+	unsigned char *pixels;
+
+	// indexed frames hold one palette index per pixel instead of rgba
+	bool indexed;
+
+	// built the first time the software compositor draws the frame. the
+	// spans of row y are spans[spanrows[y]] up to spans[spanrows[y + 1]].
+	// opaque is set when every texel in the spans has full alpha
+	int *spanrows;
+	framespan_t *spans;
+	bool opaque;
+
+	// frames decoded on demand from a wad lump, pixels is NULL while
+	// the frame isn't in the frame cache. lump is -1 for frames that
+	// are always resident
+	int lump;
+	struct spriteframe_s *cacheprev, *cachenext;
+
+	// queued with the streaming workers
+	bool requested;
+
+	// frames showing the same image share the storage and atlas slot
+	// of source. mirror draws the image flipped horizontally
+	struct spriteframe_s *source;
+	bool mirror;
+
+	// placement in the atlas
+	int page;
+	int x, y;
+	float s0, t0, s1, t1;
+	bool uploaded;
+
+} spriteframe_t;
+
+typedef struct spritedef_s
+{
+	const char *name;
+	int numframes;
+	spriteframe_t *frames;
+
+	// first palette row and how many variants the sprite can be drawn
+	// with, zero for rgba sprites
+	int palette;
+	int numpalettes;
+
+} spritedef_t;
+
+#define MAX_SPRITES		256
+
+static spritedef_t spritedefs[MAX_SPRITES];
+static int numspritedefs;
+
+// ==============================================
+// errors and warnings
+
+static void Error(const char *error, ...)
+{
+	va_list valist;
+	char buffer[2048];
+
+	va_start(valist, error);
+	vsprintf(buffer, error, valist);
+	va_end(valist);
+
+	printf("Error: %s", buffer);
+	exit(1);
+}
+
+static void Warning(const char *warning, ...)
+{
+	va_list valist;
+	char buffer[2048];
+
+	va_start(valist, warning);
+	vsprintf(buffer, warning, valist);
+	va_end(valist);
+
+	fprintf(stdout, "Warning: %s", buffer);
+}
+
+// ==============================================
+// timing
+
+static double Sys_Milliseconds()
+{
+#ifdef WIN32
+	return (double)glutGet(GLUT_ELAPSED_TIME);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000.0) + (ts.tv_nsec / 1000000.0);
+#endif
+}
+
+// ==============================================
+// memory allocation
+//
+// all allocation comes out of linear arenas. the permanent arena holds
+// anything that lives for the whole run, the frame arena is reset at the
+// end of every glut callback and each worker thread gets its own arena
+// so temporaries never need a lock or a call to malloc
+
+#define PERM_ARENA_SIZE		(16 * 1024 * 1024)
+#define FRAME_ARENA_SIZE	(32 * 1024 * 1024)
+#define THREAD_ARENA_SIZE	(4 * 1024 * 1024)
+#define MAX_THREAD_ARENAS	32
+
+typedef struct arena_s
+{
+	const char *name;
+	unsigned char *base;
+	size_t size;
+	size_t used;
+	size_t highwater;
+	int numresets;
+
+} arena_t;
+
+typedef size_t arenamarker_t;
+
+static unsigned char permmem[PERM_ARENA_SIZE];
+static unsigned char framemem[FRAME_ARENA_SIZE];
+static arena_t permarena;
+static arena_t framearena;
+
+static arena_t threadarenas[MAX_THREAD_ARENAS];
+static int numthreadarenas;
+static thread_local arena_t *threadarena;
+
+static void Arena_Init(arena_t *arena, const char *name, void *base, size_t size)
+{
+	arena->name = name;
+	arena->base = (unsigned char*)base;
+	arena->size = size;
+	arena->used = 0;
+	arena->highwater = 0;
+	arena->numresets = 0;
+}
+
+// align must be a power of two
+static void *Arena_Alloc(arena_t *arena, size_t numbytes, size_t align)
+{
+	size_t start = (arena->used + (align - 1)) & ~(align - 1);
+
+	if (start + numbytes > arena->size)
+	{
+		Error("Mem: arena \"%s\" out of space (%zu bytes requested, %zu of %zu used)\n",
+			arena->name, numbytes, arena->used, arena->size);
+	}
+
+	arena->used = start + numbytes;
+	if (arena->used > arena->highwater)
+		arena->highwater = arena->used;
+
+	return arena->base + start;
+}
+
+static arenamarker_t Arena_GetMarker(arena_t *arena)
+{
+	return arena->used;
+}
+
+static void Arena_FreeToMarker(arena_t *arena, arenamarker_t marker)
+{
+	arena->used = marker;
+}
+
+static void Arena_Reset(arena_t *arena)
+{
+	arena->used = 0;
+	arena->numresets++;
+}
+
+static void Arena_PrintStats(arena_t *arena)
+{
+	printf("%-8s %10zu used %10zu peak %10zu size %6i resets\n",
+		arena->name, arena->used, arena->highwater, arena->size, arena->numresets);
+}
+
+// returns the calling thread's scratch arena, the main thread uses the
+// frame arena and workers get a private block on first use
+static arena_t *Mem_ThreadArena()
+{
+	if (!threadarena)
+	{
+		int index = __sync_fetch_and_add(&numthreadarenas, 1);
+		if (index >= MAX_THREAD_ARENAS)
+			Error("Mem: too many thread arenas\n");
+
+		void *base = malloc(THREAD_ARENA_SIZE);
+		if (!base)
+			Error("Mem: failed to allocate thread arena\n");
+
+		Arena_Init(&threadarenas[index], "thread", base, THREAD_ARENA_SIZE);
+		threadarena = &threadarenas[index];
+	}
+
+	return threadarena;
+}
+
+static void Mem_PrintStats()
+{
+	Arena_PrintStats(&permarena);
+	Arena_PrintStats(&framearena);
+	for (int i = 0; i < numthreadarenas && i < MAX_THREAD_ARENAS; i++)
+		Arena_PrintStats(&threadarenas[i]);
+}
+
+static void Mem_Init()
+{
+	Arena_Init(&permarena, "perm", permmem, PERM_ARENA_SIZE);
+	Arena_Init(&framearena, "frame", framemem, FRAME_ARENA_SIZE);
+	threadarena = &framearena;
+
+	atexit(Mem_PrintStats);
+}
+
+// allocations that live for the whole run
+void *Mem_Alloc(int numbytes)
+{
+	return Arena_Alloc(&permarena, numbytes, 16);
+}
+
+// temporaries that die at the end of the current frame or job
+static void *Mem_FrameAlloc(size_t numbytes)
+{
+	return Arena_Alloc(Mem_ThreadArena(), numbytes, 16);
+}
+
+static void Mem_EndFrame()
+{
+	Arena_Reset(Mem_ThreadArena());
+}
+
+// ==============================================
+// file loading
+
+// reads the whole file into the permanent arena, returns -1 on failure
+int ReadFile(const char* filename, void **data)
+{
+	*data = NULL;
+
+	FILE *fp = fopen(filename, "rb");
+	if(!fp)
+	{
+		printf("Failed to open file \"%s\"\n", filename);
+		return -1;
+	}
+
+	int curpos = ftell(fp);
+	fseek(fp, 0, SEEK_END);
+	int size = ftell(fp);
+	fseek(fp, curpos, SEEK_SET);
+
+	*data = Mem_Alloc(size);
+	if (size > 0 && fread(*data, size, 1, fp) != 1)
+	{
+		printf("Failed to read file \"%s\"\n", filename);
+		fclose(fp);
+		return -1;
+	}
+
+	fclose(fp);
+
+	return size;
+}
+
+// maps the file read only, falling back to ReadFile where there's no
+// mmap. returns -1 on failure
+static int MapFile(const char *filename, const void **data)
+{
+#ifdef WIN32
+	return ReadFile(filename, (void**)data);
+#else
+	*data = NULL;
+
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size == 0 || st.st_size > INT_MAX)
+	{
+		close(fd);
+		return -1;
+	}
+
+	void *mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+		return -1;
+
+	*data = mem;
+	return (int)st.st_size;
+#endif
+}
+
+// releases a MapFile mapping. the ReadFile fallback lives in the
+// permanent arena and is kept
+static void UnmapFile(const void *data, int size)
+{
+#ifndef WIN32
+	if (data)
+		munmap((void*)data, size);
+#endif
+}
+
+// ==============================================
+// palettes
+//
+// indexed frames store one byte per pixel and are expanded through a
+// palette when they're drawn. all palettes live in one table and a
+// sprite owns a run of rows in it, so damage flashes and team colours
+// are just a different row rather than another copy of the frames.
+// index 255 is reserved for transparent pixels, texels that used it are
+// remapped to the closest other colour when they're decoded. every
+// other entry is fully opaque
+
+#define MAX_PALETTES		64
+#define PALETTE_TRANSPARENT	255
+
+static unsigned char palettes[MAX_PALETTES][256][4];
+static int numpalettes;
+
+// returns the row of the new palette
+static int Palette_Add(const unsigned char colors[256][3])
+{
+	if (numpalettes == MAX_PALETTES)
+		Error("Palette_Add: too many palettes\n");
+
+	unsigned char (*p)[4] = palettes[numpalettes];
+	for (int i = 0; i < 256; i++)
+	{
+		p[i][0] = colors[i][0];
+		p[i][1] = colors[i][1];
+		p[i][2] = colors[i][2];
+		p[i][3] = 0xff;
+	}
+	memset(p[PALETTE_TRANSPARENT], 0, 4);
+
+	return numpalettes++;
+}
+
+// adds a copy of row src with every colour moved frac of the way to rgb
+static int Palette_AddTinted(int src, int r, int g, int b, float frac)
+{
+	unsigned char colors[256][3];
+	int tint[3] = { r, g, b };
+
+	for (int i = 0; i < 256; i++)
+	{
+		for (int j = 0; j < 3; j++)
+			colors[i][j] = (unsigned char)(palettes[src][i][j] + (tint[j] - palettes[src][i][j]) * frac + 0.5f);
+	}
+
+	return Palette_Add(colors);
+}
+
+// the opaque entry of row closest to rgb
+static int Palette_Nearest(int row, int r, int g, int b)
+{
+	int best = 0;
+	int bestdist = 0x7fffffff;
+
+	for (int i = 0; i < 256; i++)
+	{
+		if (i == PALETTE_TRANSPARENT)
+			continue;
+
+		int dr = palettes[row][i][0] - r;
+		int dg = palettes[row][i][1] - g;
+		int db = palettes[row][i][2] - b;
+		int dist = dr * dr + dg * dg + db * db;
+		if (dist < bestdist)
+		{
+			best = i;
+			bestdist = dist;
+		}
+	}
+
+	return best;
+}
+
+// converts rgba pixels to indexes into an exact palette. fails if the
+// image has partial alpha or more colours than a palette can hold
+static bool Palette_Quantise(const unsigned char *rgba, int numpixels, unsigned char *indexes, unsigned char colors[256][3])
+{
+	int numcolors = 0;
+
+	memset(colors, 0, 256 * 3);
+	for (int i = 0; i < numpixels; i++, rgba += 4)
+	{
+		if (rgba[3] == 0)
+		{
+			indexes[i] = PALETTE_TRANSPARENT;
+			continue;
+		}
+		if (rgba[3] != 0xff)
+			return false;
+
+		int c;
+		for (c = 0; c < numcolors; c++)
+		{
+			if (!memcmp(colors[c], rgba, 3))
+				break;
+		}
+
+		if (c == numcolors)
+		{
+			if (numcolors == PALETTE_TRANSPARENT)
+				return false;
+			memcpy(colors[numcolors++], rgba, 3);
+		}
+
+		indexes[i] = c;
+	}
+
+	return true;
+}
+
+// ==============================================
+// frame cache
+//
+// frames that come from a wad are decoded the first time they're used
+// and kept in a cache bounded by framecachebudget bytes. the least
+// recently used frame is dropped when the cache is over budget, it's
+// simply decoded again if it's needed later
+
+typedef struct framecache_s
+{
+	size_t used;
+	int numframes;
+	int hits, misses, evictions;
+
+	// most recently used at the head
+	spriteframe_t *head, *tail;
+
+} framecache_t;
+
+static size_t framecachebudget = 8 * 1024 * 1024;
+static framecache_t framecache;
+
+static unsigned char *Wad_DecodeLump(int lump, int width, int height);
+
+static spriteframe_t *FrameStorage(spriteframe_t *frame)
+{
+	return frame->source ? frame->source : frame;
+}
+
+static int FrameBytes(const spriteframe_t *frame)
+{
+	return frame->width * frame->height * (frame->indexed ? 1 : 4);
+}
+
+static void FrameCache_Unlink(spriteframe_t *frame)
+{
+	framecache_t *fc = &framecache;
+
+	if (frame->cacheprev)
+		frame->cacheprev->cachenext = frame->cachenext;
+	else
+		fc->head = frame->cachenext;
+
+	if (frame->cachenext)
+		frame->cachenext->cacheprev = frame->cacheprev;
+	else
+		fc->tail = frame->cacheprev;
+
+	frame->cacheprev = frame->cachenext = NULL;
+}
+
+static void FrameCache_LinkHead(spriteframe_t *frame)
+{
+	framecache_t *fc = &framecache;
+
+	frame->cacheprev = NULL;
+	frame->cachenext = fc->head;
+	if (fc->head)
+		fc->head->cacheprev = frame;
+	fc->head = frame;
+	if (!fc->tail)
+		fc->tail = frame;
+}
+
+// frees least recently used frames until there's room for numbytes,
+// never evicting keep
+static void FrameCache_MakeRoom(size_t numbytes, spriteframe_t *keep)
+{
+	framecache_t *fc = &framecache;
+
+	while (fc->tail && fc->used + numbytes > framecachebudget)
+	{
+		spriteframe_t *victim = fc->tail;
+		if (victim == keep)
+			break;
+
+		FrameCache_Unlink(victim);
+		fc->used -= FrameBytes(victim);
+		fc->numframes--;
+		fc->evictions++;
+
+		free(victim->pixels);
+		free(victim->spanrows);
+		victim->pixels = NULL;
+		victim->spanrows = NULL;
+		victim->spans = NULL;
+	}
+}
+
+// makes decoded pixels resident, making room for them first
+static void FrameCache_Insert(spriteframe_t *frame, unsigned char *pixels)
+{
+	framecache_t *fc = &framecache;
+	size_t numbytes = FrameBytes(frame);
+
+	FrameCache_MakeRoom(numbytes, NULL);
+
+	frame->pixels = pixels;
+	FrameCache_LinkHead(frame);
+	fc->used += numbytes;
+	fc->numframes++;
+	fc->misses++;
+}
+
+// set while the compositor's workers are drawing. they only read frames
+// made resident beforehand and nothing may be decoded, evicted or moved
+// in the lru under them
+static bool framecachefrozen = false;
+
+// returns the pixels of the frame, decoding it if it isn't resident
+static unsigned char *FramePixels(spriteframe_t *frame)
+{
+	framecache_t *fc = &framecache;
+
+	frame = FrameStorage(frame);
+	if (frame->lump < 0 || framecachefrozen)
+		return frame->pixels;
+
+	if (frame->pixels)
+	{
+		fc->hits++;
+		if (fc->head != frame)
+		{
+			FrameCache_Unlink(frame);
+			FrameCache_LinkHead(frame);
+		}
+		return frame->pixels;
+	}
+
+	FrameCache_Insert(frame, Wad_DecodeLump(frame->lump, frame->width, frame->height));
+
+	return frame->pixels;
+}
+
+// returns the frame's opaque spans, converting it the first time. wad
+// frames lose their spans along with their pixels when they're evicted
+static framespan_t *FrameSpans(spriteframe_t *frame)
+{
+	unsigned char *pixels = FramePixels(frame);
+
+	frame = FrameStorage(frame);
+	if (frame->spans)
+		return frame->spans;
+
+	int w = frame->width;
+	int h = frame->height;
+	int bpp = frame->indexed ? 1 : 4;
+
+	// count the spans, then fill them in
+	int numspans = 0;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		if (pass == 1)
+		{
+			frame->spanrows = (int*)malloc((h + 1) * sizeof(int) + numspans * sizeof(framespan_t));
+			if (!frame->spanrows)
+				Error("FrameSpans: out of memory\n");
+			frame->spans = (framespan_t*)(frame->spanrows + h + 1);
+			frame->opaque = true;
+			numspans = 0;
+		}
+
+		for (int y = 0; y < h; y++)
+		{
+			const unsigned char *row = pixels + y * w * bpp;
+
+			if (pass == 1)
+				frame->spanrows[y] = numspans;
+
+			for (int x = 0; x < w; )
+			{
+				if (frame->indexed ? row[x] == PALETTE_TRANSPARENT : row[x * 4 + 3] == 0)
+				{
+					x++;
+					continue;
+				}
+
+				int start = x;
+				for (; x < w; x++)
+				{
+					if (frame->indexed ? row[x] == PALETTE_TRANSPARENT : row[x * 4 + 3] == 0)
+						break;
+					if (!frame->indexed && row[x * 4 + 3] != 0xff)
+						frame->opaque = false;
+				}
+
+				if (pass == 1)
+				{
+					frame->spans[numspans].x = start;
+					frame->spans[numspans].length = x - start;
+				}
+				numspans++;
+			}
+		}
+
+		if (pass == 1)
+			frame->spanrows[h] = numspans;
+	}
+
+	return frame->spans;
+}
+
+static void FrameCache_PrintStats()
+{
+	framecache_t *fc = &framecache;
+
+	printf("frame cache: %i frames, %zu of %zu bytes, %i hits %i misses %i evictions\n",
+		fc->numframes, fc->used, framecachebudget, fc->hits, fc->misses, fc->evictions);
+}
+
+// ==============================================
+// wad files
+//
+// the lump directory is indexed once when the wad is mapped. sprites are
+// the lumps between S_START and S_END, named like TROOA2A8: a four letter
+// sprite name, then frame letter and rotation, then optionally a second
+// frame and rotation drawn as a mirror of the same lump. mirrored
+// rotations share the storage of the frame they mirror, and nothing is
+// decoded until a frame is first drawn
+
+#define WAD_MAX_FRAMES		29	// 'A' to '\\'
+#define WAD_ROTATIONS		8
+
+typedef struct wadinfo_s
+{
+	char identification[4];
+	int numlumps;
+	int infotableofs;
+
+} wadinfo_t;
+
+typedef struct filelump_s
+{
+	int filepos;
+	int size;
+	char name[8];
+
+} filelump_t;
+
+typedef struct patchheader_s
+{
+	short width;
+	short height;
+	short leftoffset;
+	short topoffset;
+
+} patchheader_t;
+
+static const unsigned char *wadbase;
+static int wadsize;
+static const filelump_t *wadlumps;
+static int wadnumlumps;
+
+// the PLAYPAL rows, and the index texels using PALETTE_TRANSPARENT
+// are drawn with instead
+static int wadpalette;
+static int wadnumpalettes;
+static unsigned char wadremap;
+
+static bool Wad_LumpNameIs(const filelump_t *lump, const char *name)
+{
+	return !strncmp(lump->name, name, 8);
+}
+
+static int Wad_FindLump(const char *name)
+{
+	for (int i = wadnumlumps - 1; i >= 0; i--)
+	{
+		if (Wad_LumpNameIs(&wadlumps[i], name))
+			return i;
+	}
+
+	return -1;
+}
+
+static bool Wad_LumpValid(int lump, int minsize)
+{
+	const filelump_t *l = &wadlumps[lump];
+	return l->filepos >= 0 && l->size >= minsize && (long long)l->filepos + l->size <= wadsize;
+}
+
+// expands the patch column posts into bottom up palette indexes. this
+// only reads the wad so the streaming workers can call it
+static unsigned char *Wad_DecodeLump(int lumpnum, int w, int h)
+{
+	const filelump_t *lump = &wadlumps[lumpnum];
+	const unsigned char *data = wadbase + lump->filepos;
+
+	unsigned char *pixels = (unsigned char*)malloc(w * h);
+	if (!pixels)
+		Error("Wad_DecodeLump: out of memory\n");
+	memset(pixels, PALETTE_TRANSPARENT, w * h);
+
+	const int *columnofs = (const int*)(data + sizeof(patchheader_t));
+	for (int x = 0; x < w; x++)
+	{
+		int offset = columnofs[x];
+		int top = -1;
+
+		while (offset >= 0 && offset < lump->size && data[offset] != 0xff)
+		{
+			int topdelta = data[offset];
+			if (offset + 3 > lump->size)
+				break;
+
+			int length = data[offset + 1];
+			const unsigned char *src = data + offset + 3;
+			if (offset + 3 + length > lump->size)
+				break;
+
+			// tall patches use a delta relative to the previous post
+			top = topdelta <= top ? top + topdelta : topdelta;
+
+			for (int i = 0; i < length; i++)
+			{
+				int y = top + i;
+				if (y >= h)
+					break;
+
+				pixels[(h - 1 - y) * w + x] = src[i] == PALETTE_TRANSPARENT ? wadremap : src[i];
+			}
+
+			offset += length + 4;
+		}
+	}
+	return pixels;
+}
+
+static spritedef_t *Wad_FindSprite(const char *name, int firstdef)
+{
+	for (int i = firstdef; i < numspritedefs; i++)
+	{
+		if (!strncmp(spritedefs[i].name, name, 4) && !spritedefs[i].name[4])
+			return &spritedefs[i];
+	}
+
+	return NULL;
+}
+
+static void Wad_SetFrame(spriteframe_t *frames, const patchheader_t *patch, int lump, int frame, int rotation, bool mirror)
+{
+	// rotation 0 is used for all eight directions
+	int first = rotation ? rotation - 1 : 0;
+	int last = rotation ? rotation - 1 : WAD_ROTATIONS - 1;
+
+	for (int r = first; r <= last; r++)
+	{
+		spriteframe_t *f = &frames[frame * WAD_ROTATIONS + r];
+		f->width = patch->width;
+		f->height = patch->height;
+		f->originx = mirror ? patch->width - patch->leftoffset : patch->leftoffset;
+		f->originy = patch->height - patch->topoffset;
+		f->lump = lump;
+		f->mirror = mirror;
+		f->indexed = true;
+	}
+}
+
+// returns false if the file isn't a readable wad
+static bool Wad_Load(const char *filename)
+{
+	const unsigned char *base;
+	int size = MapFile(filename, (const void**)&base);
+	if (size < (int)sizeof(wadinfo_t))
+	{
+		UnmapFile(base, size);
+		Warning("failed to open wad \"%s\"\n", filename);
+		return false;
+	}
+
+	const wadinfo_t *header = (const wadinfo_t*)base;
+	if (strncmp(header->identification, "IWAD", 4) && strncmp(header->identification, "PWAD", 4))
+	{
+		UnmapFile(base, size);
+		Warning("\"%s\" is not a wad\n", filename);
+		return false;
+	}
+
+	if (header->numlumps < 0 || header->infotableofs < 0
+		|| header->infotableofs + header->numlumps * (long long)sizeof(filelump_t) > size)
+	{
+		UnmapFile(base, size);
+		Warning("\"%s\" has a bad lump directory\n", filename);
+		return false;
+	}
+
+	wadbase = base;
+
+	wadsize = size;
+	wadlumps = (const filelump_t*)(wadbase + header->infotableofs);
+	wadnumlumps = header->numlumps;
+
+	// every palette in PLAYPAL, the ones after the first are the damage
+	// and pickup flashes. greyscale if there's no palette.
+	// index 255 is a real colour in a wad so it's remapped
+	int playpal = Wad_FindLump("PLAYPAL");
+	if (playpal >= 0 && Wad_LumpValid(playpal, 768))
+	{
+		const unsigned char *data = wadbase + wadlumps[playpal].filepos;
+		int count = max(1, min(wadlumps[playpal].size / 768, MAX_PALETTES - numpalettes));
+
+		wadpalette = numpalettes;
+		for (int i = 0; i < count; i++)
+			Palette_Add((const unsigned char (*)[3])(data + i * 768));
+		wadnumpalettes = count;
+
+		const unsigned char *c = data + PALETTE_TRANSPARENT * 3;
+		wadremap = Palette_Nearest(wadpalette, c[0], c[1], c[2]);
+	}
+	else
+	{
+		unsigned char grey[256][3];
+		for (int i = 0; i < 256; i++)
+			grey[i][0] = grey[i][1] = grey[i][2] = i;
+
+		wadpalette = Palette_Add(grey);
+		wadnumpalettes = 1;
+		wadremap = Palette_Nearest(wadpalette, 0xff, 0xff, 0xff);
+	}
+
+	int firstdef = numspritedefs;
+	int numsprites = 0;
+	int numlumps = 0;
+	bool insprites = false;
+	for (int i = 0; i < wadnumlumps; i++)
+	{
+		const filelump_t *lump = &wadlumps[i];
+
+		if (Wad_LumpNameIs(lump, "S_START") || Wad_LumpNameIs(lump, "SS_START"))
+		{
+			insprites = true;
+			continue;
+		}
+		if (Wad_LumpNameIs(lump, "S_END") || Wad_LumpNameIs(lump, "SS_END"))
+		{
+			insprites = false;
+			continue;
+		}
+		if (!insprites || !Wad_LumpValid(i, sizeof(patchheader_t)))
+			continue;
+
+		char name[9];
+		memset(name, 0, sizeof(name));
+		strncpy(name, lump->name, 8);
+		if (strlen(name) != 6 && strlen(name) != 8)
+			continue;
+
+		const patchheader_t *patch = (const patchheader_t*)(wadbase + lump->filepos);
+		if (patch->width <= 0 || patch->height <= 0
+			|| lump->size < (int)sizeof(patchheader_t) + patch->width * 4)
+		{
+			Warning("bad sprite lump %s\n", name);
+			continue;
+		}
+
+		// a sprite is only made for a lump with a frame it can hold, so
+		// none end up without frames
+		int numpairs = strlen(name) == 8 ? 2 : 1;
+		bool valid[2] = { false, false };
+		for (int pair = 0; pair < numpairs; pair++)
+		{
+			int frame = name[4 + pair * 2] - 'A';
+			int rotation = name[5 + pair * 2] - '0';
+			valid[pair] = frame >= 0 && frame < WAD_MAX_FRAMES && rotation >= 0 && rotation <= WAD_ROTATIONS;
+		}
+		if (!valid[0] && !valid[1])
+		{
+			Warning("unsupported sprite lump %s\n", name);
+			continue;
+		}
+
+		char spritename[5];
+		memcpy(spritename, name, 4);
+		spritename[4] = 0;
+
+		spritedef_t *def = Wad_FindSprite(spritename, firstdef);
+		if (!def)
+		{
+			if (numspritedefs == MAX_SPRITES)
+				Error("Wad_Load: too many sprites\n");
+
+			// every frame letter and rotation, filled in as lumps turn up
+			def = &spritedefs[numspritedefs++];
+			char *defname = (char*)Mem_Alloc(5);
+			memcpy(defname, spritename, 5);
+			def->name = defname;
+			def->numframes = 0;
+			def->frames = (spriteframe_t*)Mem_Alloc(WAD_MAX_FRAMES * WAD_ROTATIONS * sizeof(spriteframe_t));
+			memset(def->frames, 0, WAD_MAX_FRAMES * WAD_ROTATIONS * sizeof(spriteframe_t));
+			for (int j = 0; j < WAD_MAX_FRAMES * WAD_ROTATIONS; j++)
+				def->frames[j].lump = -1;
+			def->palette = wadpalette;
+			def->numpalettes = wadnumpalettes;
+			numsprites++;
+		}
+
+		for (int pair = 0; pair < numpairs; pair++)
+		{
+			if (!valid[pair])
+				continue;
+
+			int frame = name[4 + pair * 2] - 'A';
+			int rotation = name[5 + pair * 2] - '0';
+
+			Wad_SetFrame(def->frames, patch, i, frame, rotation, pair == 1);
+			def->numframes = max(def->numframes, (frame + 1) * WAD_ROTATIONS);
+		}
+
+		numlumps++;
+	}
+
+	// point every frame that shares a lump at the first one, and fill
+	// any rotations the wad didn't provide with one that it did
+	for (int i = firstdef; i < numspritedefs; i++)
+	{
+		spritedef_t *def = &spritedefs[i];
+
+		for (int j = 0; j < def->numframes; j++)
+		{
+			spriteframe_t *f = &def->frames[j];
+			if (f->lump >= 0)
+				continue;
+
+			// another rotation of the same frame, or failing that any frame
+			int fallback = -1;
+			for (int k = 0; k < def->numframes && fallback < 0; k++)
+			{
+				if (def->frames[k].lump >= 0 && k / WAD_ROTATIONS == j / WAD_ROTATIONS)
+					fallback = k;
+			}
+			for (int k = 0; k < def->numframes && fallback < 0; k++)
+			{
+				if (def->frames[k].lump >= 0)
+					fallback = k;
+			}
+
+			*f = def->frames[fallback];
+		}
+
+		for (int j = 0; j < def->numframes; j++)
+		{
+			spriteframe_t *f = &def->frames[j];
+			if (f->lump < 0 || f->source)
+				continue;
+
+			for (int k = 0; k < j; k++)
+			{
+				spriteframe_t *other = &def->frames[k];
+				if (other->lump == f->lump && !other->source)
+				{
+					f->source = other;
+					break;
+				}
+			}
+		}
+	}
+
+	printf("indexed %i sprite lumps in %i sprites from \"%s\"\n", numlumps, numsprites, filename);
+
+	return true;
+}
+
+// ==============================================
+// gl state
+//
+// the sprite paths set texture, blend and program state through here.
+// the last value set is shadowed and a call is only made when it
+// changes, so drawing many sprites with the same state costs nothing
+// past the first. the shadow starts at the gl defaults, which holds as
+// long as nothing changes this state behind its back
+
+#define GLSTATE_UNITS	3
+
+typedef struct glstate_s
+{
+	int activeunit;
+	GLuint textures[GLSTATE_UNITS];
+	bool texture2d[GLSTATE_UNITS];
+	bool blend;
+	GLenum blendsrc, blenddst;
+	bool colormask[4];
+	GLuint program;
+
+	// calls made and skipped since the stats were last cleared
+	int issued;
+	int elided;
+
+} glstate_t;
+
+static glstate_t glstate =
+{
+	0,
+	{ 0, 0, 0 },
+	{ false, false, false },
+	false,
+	GL_ONE, GL_ZERO,
+	{ true, true, true, true },
+	0,
+	0,
+	0
+};
+
+static bool GLState_Changed(bool changed)
+{
+	if (changed)
+		glstate.issued++;
+	else
+		glstate.elided++;
+	return changed;
+}
+
+static void GLState_ActiveTexture(int unit)
+{
+	if (GLState_Changed(glstate.activeunit != unit))
+	{
+		glActiveTexture(GL_TEXTURE0 + unit);
+		glstate.activeunit = unit;
+	}
+}
+
+// binds on the active unit
+static void GLState_BindTexture(GLuint texture)
+{
+	if (GLState_Changed(glstate.textures[glstate.activeunit] != texture))
+	{
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glstate.textures[glstate.activeunit] = texture;
+	}
+}
+
+// only switches unit if the binding has to change
+static void GLState_BindTextureUnit(int unit, GLuint texture)
+{
+	if (glstate.textures[unit] == texture)
+	{
+		GLState_Changed(false);
+		return;
+	}
+
+	GLState_ActiveTexture(unit);
+	GLState_BindTexture(texture);
+}
+
+static void GLState_EnableTexture(int unit, bool enable)
+{
+	if (glstate.texture2d[unit] == enable)
+	{
+		GLState_Changed(false);
+		return;
+	}
+
+	GLState_ActiveTexture(unit);
+	GLState_Changed(true);
+	if (enable)
+		glEnable(GL_TEXTURE_2D);
+	else
+		glDisable(GL_TEXTURE_2D);
+	glstate.texture2d[unit] = enable;
+}
+
+static void GLState_Blend(bool enable)
+{
+	if (GLState_Changed(glstate.blend != enable))
+	{
+		if (enable)
+			glEnable(GL_BLEND);
+		else
+			glDisable(GL_BLEND);
+		glstate.blend = enable;
+	}
+}
+
+static void GLState_BlendFunc(GLenum src, GLenum dst)
+{
+	if (GLState_Changed(glstate.blendsrc != src || glstate.blenddst != dst))
+	{
+		glBlendFunc(src, dst);
+		glstate.blendsrc = src;
+		glstate.blenddst = dst;
+	}
+}
+
+static void GLState_ColorMask(bool r, bool g, bool b, bool a)
+{
+	bool *m = glstate.colormask;
+	if (GLState_Changed(m[0] != r || m[1] != g || m[2] != b || m[3] != a))
+	{
+		glColorMask(r, g, b, a);
+		m[0] = r;
+		m[1] = g;
+		m[2] = b;
+		m[3] = a;
+	}
+}
+
+static void GLState_UseProgram(GLuint program)
+{
+	if (GLState_Changed(glstate.program != program))
+	{
+		glUseProgram(program);
+		glstate.program = program;
+	}
+}
+
+// deleting a bound texture reverts the binding to zero
+static void GLState_DeleteTexture(GLuint texture)
+{
+	glDeleteTextures(1, &texture);
+
+	for (int i = 0; i < GLSTATE_UNITS; i++)
+	{
+		if (glstate.textures[i] == texture)
+			glstate.textures[i] = 0;
+	}
+}
+
+// ==============================================
+// texture manager
+//
+// textures are referred to by the identifiers in the enum at the top
+// and get gl names from glGenTextures when they're created. the size of
+// every texture is tracked. atlas pages can be rebuilt from the frames,
+// so when creating a texture would go over texturebudget the least
+// recently used pages are deleted, apart from pages already used this
+// frame. an evicted page is recreated empty the next time it's used and
+// its frames are uploaded again as they're drawn
+
+#define MAX_TEXTURES	64
+
+typedef struct texture_s
+{
+	GLuint texnum;		// zero while not resident
+	int width, height;
+	size_t bytes;
+	bool evictable;
+	int lastframe;
+
+	// least recently used order of the resident evictable textures
+	struct texture_s *prev, *next;
+
+} texture_t;
+
+typedef struct texturestats_s
+{
+	int numresident;
+	size_t resident, peak;
+	int hits, misses, evictions;
+
+	// most recently used at the head
+	texture_t *head, *tail;
+
+} texturestats_t;
+
+static texture_t textures[MAX_TEXTURES];
+static texturestats_t texturestats;
+static size_t texturebudget = 32 * 1024 * 1024;
+static int textureframe;
+
+static void Atlas_PageEvicted(int page);
+static void Atlas_Restore(int page);
+
+static void Tex_Unlink(texture_t *tex)
+{
+	texturestats_t *ts = &texturestats;
+
+	if (tex->prev)
+		tex->prev->next = tex->next;
+	else if (ts->head == tex)
+		ts->head = tex->next;
+
+	if (tex->next)
+		tex->next->prev = tex->prev;
+	else if (ts->tail == tex)
+		ts->tail = tex->prev;
+
+	tex->prev = tex->next = NULL;
+}
+
+static void Tex_LinkHead(texture_t *tex)
+{
+	texturestats_t *ts = &texturestats;
+
+	tex->prev = NULL;
+	tex->next = ts->head;
+	if (ts->head)
+		ts->head->prev = tex;
+	ts->head = tex;
+	if (!ts->tail)
+		ts->tail = tex;
+}
+
+static void Tex_Evict(texture_t *tex)
+{
+	texturestats_t *ts = &texturestats;
+
+	Tex_Unlink(tex);
+	GLState_DeleteTexture(tex->texnum);
+	tex->texnum = 0;
+	ts->resident -= tex->bytes;
+	ts->numresident--;
+	ts->evictions++;
+
+	Atlas_PageEvicted((int)(tex - textures) - SPR0);
+}
+
+// evicts until numbytes more fits in the budget, or until everything
+// left was used this frame
+static void Tex_MakeRoom(size_t numbytes)
+{
+	texturestats_t *ts = &texturestats;
+
+	while (ts->tail && ts->resident + numbytes > texturebudget)
+	{
+		if (ts->tail->lastframe == textureframe)
+			break;
+		Tex_Evict(ts->tail);
+	}
+}
+
+// creates or respecifies the texture and leaves it bound on the active unit
+static void Tex_Create(int handle, int width, int height, GLenum internalformat, GLenum format, const void *pixels, GLenum wrap, bool evictable)
+{
+	texturestats_t *ts = &texturestats;
+
+	if (handle < 0 || handle >= MAX_TEXTURES)
+		Error("Tex_Create: bad texture %i\n", handle);
+
+	texture_t *tex = &textures[handle];
+	size_t bytes = (size_t)width * height * (internalformat == GL_LUMINANCE8 ? 1 : 4);
+
+	if (tex->texnum)
+	{
+		Tex_Unlink(tex);
+		ts->resident -= tex->bytes;
+		ts->numresident--;
+	}
+
+	Tex_MakeRoom(bytes);
+
+	if (!tex->texnum)
+		glGenTextures(1, &tex->texnum);
+
+	tex->width = width;
+	tex->height = height;
+	tex->bytes = bytes;
+	tex->evictable = evictable;
+	tex->lastframe = textureframe;
+	if (evictable)
+		Tex_LinkHead(tex);
+
+	ts->resident += bytes;
+	ts->peak = max(ts->peak, ts->resident);
+	ts->numresident++;
+
+	GLState_BindTexture(tex->texnum);
+	glTexImage2D(GL_TEXTURE_2D, 0, internalformat, width, height, 0, format, GL_UNSIGNED_BYTE, pixels);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap);
+}
+
+// marks the texture used this frame, recreating it if it was evicted
+static void Tex_Touch(int handle)
+{
+	texturestats_t *ts = &texturestats;
+	texture_t *tex = &textures[handle];
+
+	if (!tex->texnum)
+	{
+		ts->misses++;
+		Atlas_Restore(handle - SPR0);
+		return;
+	}
+
+	ts->hits++;
+	tex->lastframe = textureframe;
+	if (tex->evictable && ts->head != tex)
+	{
+		Tex_Unlink(tex);
+		Tex_LinkHead(tex);
+	}
+}
+
+// binds on the active unit
+static void Tex_Bind(int handle)
+{
+	Tex_Touch(handle);
+	GLState_BindTexture(textures[handle].texnum);
+}
+
+static void Tex_BindUnit(int unit, int handle)
+{
+	Tex_Touch(handle);
+	GLState_BindTextureUnit(unit, textures[handle].texnum);
+}
+
+static void Tex_BeginFrame()
+{
+	textureframe++;
+}
+
+static void Tex_PrintStats()
+{
+	texturestats_t *ts = &texturestats;
+
+	printf("textures: %i resident, %zu of %zu bytes, %zu peak, %i hits %i misses %i evictions\n",
+		ts->numresident, ts->resident, texturebudget, ts->peak, ts->hits, ts->misses, ts->evictions);
+}
+
+// builtin alpha masks, shared by the gl textures and the software
+// compositor. the rgb is always white, only the alpha carries the mask
+typedef struct image_s
+{
+	int width, height;
+	unsigned char *data;
+
+	// when set data holds indexes into this rgba palette
+	const unsigned char *palette;
+
+} image_t;
+
+static unsigned char solidmask[4] =
+{
+	0xff, 0xff, 0xff, 0xff
+};
+
+static unsigned char hlinemask[8] =
+{
+	0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0x0
+};
+
+// this is the same as hline, just the dimensions have changed
+static unsigned char vlinemask[8] =
+{
+	0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0x0
+};
+
+static unsigned char dlinemask[64] =
+{
+	0xff, 0xff, 0xff, 0x0,
+	0xff, 0xff, 0xff, 0x0,
+	0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0x0,
+	0xff, 0xff, 0xff, 0x0,
+	0xff, 0xff, 0xff, 0x0,
+	0xff, 0xff, 0xff, 0x0,
+	0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0x0,
+	0xff, 0xff, 0xff, 0x0,
+	0xff, 0xff, 0xff, 0x0,
+	0xff, 0xff, 0xff, 0x0,
+	0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0x0,
+	0xff, 0xff, 0xff, 0x0
+};
+
+static unsigned char checkmask[16] =
+{
+	0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0x0,
+	0xff, 0xff, 0xff, 0x0,
+	0xff, 0xff, 0xff, 0xff
+};
+
+static unsigned char pointmask[16] =
+{
+	0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0x0,
+	0xff, 0xff, 0xff, 0x0,
+	0xff, 0xff, 0xff, 0x0
+};
+
+// indexed by the builtin texture identifiers
+static image_t builtinmasks[SPR0] =
+{
+	{ 1, 1, solidmask },
+	{ 1, 2, hlinemask },
+	{ 2, 1, vlinemask },
+	{ 4, 4, dlinemask },
+	{ 2, 2, checkmask },
+	{ 2, 2, pointmask }
+};
+
+// fixme:
+// modern opengl says that internal format and external format must match
+// also, use a sized internal format
+// this needs to happen anyway to use a luminance mask
+static void InitTexture()
+{
+	// allow small rows on a byte alignment
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	// alpha masks
+	for (int i = BUILTIN_SOLID; i < SPR0; i++)
+	{
+		image_t *mask = &builtinmasks[i];
+		Tex_Create(i, mask->width, mask->height, GL_RGBA, GL_RGBA, mask->data, GL_REPEAT, false);
+	}
+}
+
+// ==============================================
+// sprite atlas
+//
+// frames are sorted tallest first and packed left to right into shelves.
+// a page is ATLAS_SIZE wide and is trimmed to the smallest power of two
+// height that holds its shelves. page n uses texture name SPR0 + n.
+// indexed and rgba frames go on separate pages, indexed pages are a
+// single luminance channel looked up through the palette texture
+
+#define ATLAS_SIZE		512
+#define ATLAS_PADDING	1
+#define MAX_ATLAS_PAGES	16
+#define PALETTE_TEXTURE	(SPR0 + MAX_ATLAS_PAGES)
+
+typedef struct atlaspage_s
+{
+	int width, height;
+	int shelfx, shelfy, shelfh;
+	bool indexed;
+
+} atlaspage_t;
+
+static atlaspage_t atlaspages[MAX_ATLAS_PAGES];
+static int numatlaspages;
+
+static bool Atlas_Place(atlaspage_t *page, int w, int h, int *x, int *y)
+{
+	w += ATLAS_PADDING;
+	h += ATLAS_PADDING;
+
+	if (w > page->width)
+		return false;
+
+	// start a new shelf when this row is full
+	if (page->shelfx + w > page->width)
+	{
+		page->shelfy += page->shelfh;
+		page->shelfx = 0;
+		page->shelfh = 0;
+	}
+
+	if (page->shelfy + h > ATLAS_SIZE)
+		return false;
+
+	*x = page->shelfx;
+	*y = page->shelfy;
+	page->shelfx += w;
+	page->shelfh = max(page->shelfh, h);
+
+	return true;
+}
+
+// indexed frames first, then tallest first
+static int Atlas_CompareHeight(const void *a, const void *b)
+{
+	const spriteframe_t *fa = *(const spriteframe_t**)a;
+	const spriteframe_t *fb = *(const spriteframe_t**)b;
+	if (fa->indexed != fb->indexed)
+		return fb->indexed - fa->indexed;
+	return fb->height - fa->height;
+}
+
+static void Atlas_CreatePage(int p, const unsigned char *pixels)
+{
+	atlaspage_t *page = &atlaspages[p];
+	GLenum format = page->indexed ? GL_LUMINANCE : GL_RGBA;
+	GLenum internalformat = page->indexed ? GL_LUMINANCE8 : GL_RGBA;
+
+	Tex_Create(SPR0 + p, page->width, page->height, internalformat, format, pixels, GL_CLAMP_TO_EDGE, true);
+}
+
+// an empty page, the padding between indexed frames must be transparent
+static unsigned char *Atlas_EmptyPage(int p)
+{
+	atlaspage_t *page = &atlaspages[p];
+	int numbytes = page->width * page->height * (page->indexed ? 1 : 4);
+
+	unsigned char *pixels = (unsigned char*)Mem_FrameAlloc(numbytes);
+	memset(pixels, page->indexed ? PALETTE_TRANSPARENT : 0, numbytes);
+
+	return pixels;
+}
+
+// the texture manager dropped the page, its frames need uploading again
+static void Atlas_PageEvicted(int page)
+{
+	for (int i = 0; i < numspritedefs; i++)
+	{
+		for (int j = 0; j < spritedefs[i].numframes; j++)
+		{
+			spriteframe_t *f = &spritedefs[i].frames[j];
+			if (!f->source && f->page == page)
+				f->uploaded = false;
+		}
+	}
+}
+
+// brings an evicted page back empty, the frames are uploaded as they're
+// drawn
+static void Atlas_Restore(int page)
+{
+	if (page < 0 || page >= numatlaspages)
+		Error("Atlas_Restore: texture %i was never created\n", SPR0 + page);
+
+	arenamarker_t marker = Arena_GetMarker(Mem_ThreadArena());
+	Atlas_CreatePage(page, Atlas_EmptyPage(page));
+	Arena_FreeToMarker(Mem_ThreadArena(), marker);
+}
+
+static void Atlas_Build(bool initgl)
+{
+	arenamarker_t marker = Arena_GetMarker(Mem_ThreadArena());
+
+	int numframes = 0;
+	for (int i = 0; i < numspritedefs; i++)
+		numframes += spritedefs[i].numframes;
+
+	spriteframe_t **frames = (spriteframe_t**)Mem_FrameAlloc(numframes * sizeof(spriteframe_t*));
+	numframes = 0;
+	for (int i = 0; i < numspritedefs; i++)
+	{
+		for (int j = 0; j < spritedefs[i].numframes; j++)
+		{
+			if (!spritedefs[i].frames[j].source)
+				frames[numframes++] = &spritedefs[i].frames[j];
+		}
+	}
+
+	qsort(frames, numframes, sizeof(spriteframe_t*), Atlas_CompareHeight);
+
+	// place every frame, opening a new page when the current one fills
+	numatlaspages = 0;
+	for (int i = 0; i < numframes; i++)
+	{
+		spriteframe_t *f = frames[i];
+
+		if (f->width + ATLAS_PADDING > ATLAS_SIZE || f->height + ATLAS_PADDING > ATLAS_SIZE)
+			Error("Atlas_Build: %ix%i frame is larger than the atlas\n", f->width, f->height);
+
+		if (!numatlaspages || atlaspages[numatlaspages - 1].indexed != f->indexed
+			|| !Atlas_Place(&atlaspages[numatlaspages - 1], f->width, f->height, &f->x, &f->y))
+		{
+			if (numatlaspages == MAX_ATLAS_PAGES)
+				Error("Atlas_Build: out of atlas pages\n");
+
+			atlaspage_t *page = &atlaspages[numatlaspages++];
+			memset(page, 0, sizeof(*page));
+			page->width = ATLAS_SIZE;
+			page->indexed = f->indexed;
+			Atlas_Place(page, f->width, f->height, &f->x, &f->y);
+		}
+
+		f->page = numatlaspages - 1;
+	}
+
+	for (int p = 0; p < numatlaspages; p++)
+	{
+		atlaspage_t *page = &atlaspages[p];
+
+		page->height = 1;
+		while (page->height < page->shelfy + page->shelfh)
+			page->height <<= 1;
+	}
+
+	for (int i = 0; i < numframes; i++)
+	{
+		spriteframe_t *f = frames[i];
+		atlaspage_t *page = &atlaspages[f->page];
+
+		f->s0 = (float)f->x / page->width;
+		f->t0 = (float)f->y / page->height;
+		f->s1 = (float)(f->x + f->width) / page->width;
+		f->t1 = (float)(f->y + f->height) / page->height;
+	}
+
+	printf("packed %i frames into %i atlas pages\n", numframes, numatlaspages);
+
+	// the page images only exist long enough to be uploaded. frames that
+	// aren't decoded yet get filled in by Atlas_Upload when first drawn
+	for (int p = 0; initgl && p < numatlaspages; p++)
+	{
+		atlaspage_t *page = &atlaspages[p];
+		arenamarker_t pagemarker = Arena_GetMarker(Mem_ThreadArena());
+		int bpp = page->indexed ? 1 : 4;
+		unsigned char *pixels = Atlas_EmptyPage(p);
+
+		for (int i = 0; i < numframes; i++)
+		{
+			spriteframe_t *f = frames[i];
+			if (f->page != p || !f->pixels)
+				continue;
+
+			f->uploaded = true;
+			for (int y = 0; y < f->height; y++)
+				memcpy(pixels + ((f->y + y) * page->width + f->x) * bpp, f->pixels + (y * f->width * bpp), f->width * bpp);
+		}
+
+		Atlas_CreatePage(p, pixels);
+
+		Arena_FreeToMarker(Mem_ThreadArena(), pagemarker);
+	}
+
+	Arena_FreeToMarker(Mem_ThreadArena(), marker);
+}
+
+// copies a lazily decoded frame into its atlas slot the first time it's
+// drawn with gl, or the first time after its page was evicted. this
+// binds the frame's page on the active texture unit if it uploads
+static void Atlas_Upload(spriteframe_t *frame)
+{
+	frame = FrameStorage(frame);
+	Tex_Touch(SPR0 + frame->page);
+	if (frame->uploaded)
+		return;
+
+	unsigned char *pixels = FramePixels(frame);
+	GLenum format = frame->indexed ? GL_LUMINANCE : GL_RGBA;
+	Tex_Bind(SPR0 + frame->page);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, frame->x, frame->y, frame->width, frame->height, format, GL_UNSIGNED_BYTE, pixels);
+	frame->uploaded = true;
+}
+
+// ==============================================
+// palette lookup
+//
+// every palette row is one line of PALETTE_TEXTURE. sprites on indexed
+// pages are drawn with a small shader that reads the index from unit 1
+// and looks it up in the row given by the third texture coordinate.
+// unit 0 is the mask as in the fixed function path
+
+static GLuint paletteprogram;
+
+static const char *palettevertexsource =
+	"void main()\n"
+	"{\n"
+	"	gl_Position = ftransform();\n"
+	"	gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+	"	gl_TexCoord[1] = gl_MultiTexCoord1;\n"
+	"	gl_FrontColor = gl_Color;\n"
+	"}\n";
+
+static const char *palettefragmentsource =
+	"uniform sampler2D masktex;\n"
+	"uniform sampler2D indextex;\n"
+	"uniform sampler2D palettetex;\n"
+	"void main()\n"
+	"{\n"
+	"	float index = texture2D(indextex, gl_TexCoord[1].st).r * 255.0;\n"
+	"	vec4 color = texture2D(palettetex, vec2((index + 0.5) / 256.0, gl_TexCoord[1].p));\n"
+	"	gl_FragColor = color * gl_Color * texture2D(masktex, gl_TexCoord[0].st);\n"
+	"}\n";
+
+// the texture coordinate selecting a palette row
+static float PaletteCoord(int row)
+{
+	return (row + 0.5f) / MAX_PALETTES;
+}
+
+static GLuint Palette_CompileShader(GLenum type, const char *source)
+{
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+
+	GLint status;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if (!status)
+	{
+		char log[1024];
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		Error("Palette_CompileShader: %s\n", log);
+	}
+
+	return shader;
+}
+
+// uploads the palette table and builds the lookup shader
+static void Palette_InitGL()
+{
+	Tex_Create(PALETTE_TEXTURE, 256, MAX_PALETTES, GL_RGBA, GL_RGBA, palettes, GL_CLAMP_TO_EDGE, false);
+
+	paletteprogram = glCreateProgram();
+	glAttachShader(paletteprogram, Palette_CompileShader(GL_VERTEX_SHADER, palettevertexsource));
+	glAttachShader(paletteprogram, Palette_CompileShader(GL_FRAGMENT_SHADER, palettefragmentsource));
+	glLinkProgram(paletteprogram);
+
+	GLint status;
+	glGetProgramiv(paletteprogram, GL_LINK_STATUS, &status);
+	if (!status)
+	{
+		char log[1024];
+		glGetProgramInfoLog(paletteprogram, sizeof(log), NULL, log);
+		Error("Palette_InitGL: %s\n", log);
+	}
+
+	GLState_UseProgram(paletteprogram);
+	glUniform1i(glGetUniformLocation(paletteprogram, "masktex"), 0);
+	glUniform1i(glGetUniformLocation(paletteprogram, "indextex"), 1);
+	glUniform1i(glGetUniformLocation(paletteprogram, "palettetex"), 2);
+	GLState_UseProgram(0);
+}
+
+// switches between the fixed function path for rgba pages and the
+// lookup shader for indexed ones
+static void Palette_Bind(bool indexed)
+{
+	if (indexed)
+		Tex_BindUnit(2, PALETTE_TEXTURE);
+	GLState_UseProgram(indexed ? paletteprogram : 0);
+}
+
+// ==============================================
+// streaming
+//
+// with -stream the wad frames are decoded by worker threads instead of
+// on first use. a frame that isn't ready is requested and drawn as a
+// placeholder. finished frames are made resident at the start of the
+// next frame, then copied into one of two pixel buffers and uploaded
+// from there, so the render thread never touches the wad or waits on
+// the driver reading client memory. the buffers alternate each frame so
+// the one being filled isn't still being read by the previous upload
+
+#define MAX_STREAM_WORKERS	8
+#define MAX_STREAM_REQUESTS	1024
+#define MAX_STREAM_SAMPLES	4096
+#define STREAM_PBO_SIZE		(1024 * 1024)
+#define PLACEHOLDER_TEXTURE	(PALETTE_TEXTURE + 1)
+
+typedef struct streamrequest_s
+{
+	spriteframe_t *frame;
+	unsigned char *pixels;
+
+	// request, worker pickup and decode finished
+	double requesttime;
+	double starttime;
+	double decodetime;
+
+	struct streamrequest_s *next;
+
+} streamrequest_t;
+
+typedef struct streamupload_s
+{
+	spriteframe_t *frame;
+	double requesttime;
+
+	// where it was copied in the pixel buffer, -1 if it was skipped
+	int offset;
+
+} streamupload_t;
+
+typedef struct streamstats_s
+{
+	int requests;
+	int resident;
+	int uploaded;
+	int placeholders;
+	int uploadbytes;
+
+	// per request milliseconds, waiting for a worker and decoding, then
+	// from the request until the frame is resident and until it's on
+	// the gpu
+	int numsamples, numuploadsamples;
+	float queuems[MAX_STREAM_SAMPLES];
+	float decodems[MAX_STREAM_SAMPLES];
+	float residentms[MAX_STREAM_SAMPLES];
+	float uploadms[MAX_STREAM_SAMPLES];
+
+} streamstats_t;
+
+static int numstreamworkers = 0;
+static pthread_t streamworkers[MAX_STREAM_WORKERS];
+static pthread_mutex_t streamlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t streamcond = PTHREAD_COND_INITIALIZER;
+
+// the free list is only used by the render thread, the pending and
+// finished lists are shared with the workers under streamlock
+static streamrequest_t streamrequests[MAX_STREAM_REQUESTS];
+static streamrequest_t *streamfree;
+static streamrequest_t *streampending, *streampendingtail;
+static streamrequest_t *streamfinished;
+
+static streamupload_t streamuploads[MAX_STREAM_REQUESTS];
+static int numstreamuploads;
+static GLuint streampbos[2];
+static int streampbo;
+
+static streamstats_t streamstats;
+
+static unsigned char placeholderpixels[16] =
+{
+	0x80, 0x80, 0x80, 0x80,
+	0x40, 0x40, 0x40, 0x80,
+	0x40, 0x40, 0x40, 0x80,
+	0x80, 0x80, 0x80, 0x80
+};
+
+// drawn with the sprite's quad until the frame is ready
+static image_t placeholderimage = { 2, 2, placeholderpixels, NULL };
+
+static void *Stream_Worker(void *arg)
+{
+	for (;;)
+	{
+		pthread_mutex_lock(&streamlock);
+		while (!streampending)
+			pthread_cond_wait(&streamcond, &streamlock);
+
+		streamrequest_t *req = streampending;
+		streampending = req->next;
+		pthread_mutex_unlock(&streamlock);
+
+		spriteframe_t *frame = req->frame;
+		req->starttime = Sys_Milliseconds();
+		req->pixels = Wad_DecodeLump(frame->lump, frame->width, frame->height);
+		req->decodetime = Sys_Milliseconds();
+
+		pthread_mutex_lock(&streamlock);
+		req->next = streamfinished;
+		streamfinished = req;
+		pthread_mutex_unlock(&streamlock);
+	}
+
+	return NULL;
+}
+
+static void Stream_PrintStats();
+
+static void Stream_Init(bool initgl)
+{
+	if (!numstreamworkers)
+		return;
+
+	for (int i = MAX_STREAM_REQUESTS - 1; i >= 0; i--)
+	{
+		streamrequests[i].next = streamfree;
+		streamfree = &streamrequests[i];
+	}
+
+	for (int i = 0; i < numstreamworkers; i++)
+	{
+		if (pthread_create(&streamworkers[i], NULL, Stream_Worker, NULL))
+			Error("Stream_Init: failed to start worker %i\n", i);
+	}
+
+	if (initgl)
+	{
+		glGenBuffers(2, streampbos);
+
+		Tex_Create(PLACEHOLDER_TEXTURE, placeholderimage.width, placeholderimage.height, GL_RGBA, GL_RGBA, placeholderimage.data, GL_REPEAT, false);
+	}
+
+	atexit(Stream_PrintStats);
+}
+
+// frames stay requested until they're uploaded or dropped
+static void Stream_QueueUpload(spriteframe_t *frame, double requesttime)
+{
+	if (numstreamuploads == MAX_STREAM_REQUESTS)
+		return;
+
+	streamuploads[numstreamuploads].frame = frame;
+	streamuploads[numstreamuploads].requesttime = requesttime;
+	numstreamuploads++;
+	frame->requested = true;
+}
+
+static void Stream_Request(spriteframe_t *frame)
+{
+	if (!streamfree)
+		return;
+
+	streamrequest_t *req = streamfree;
+	streamfree = req->next;
+
+	req->frame = frame;
+	req->pixels = NULL;
+	req->requesttime = Sys_Milliseconds();
+	req->next = NULL;
+	frame->requested = true;
+	streamstats.requests++;
+
+	pthread_mutex_lock(&streamlock);
+	if (streampending)
+		streampendingtail->next = req;
+	else
+		streampending = req;
+	streampendingtail = req;
+	pthread_cond_signal(&streamcond);
+	pthread_mutex_unlock(&streamlock);
+}
+
+// true if the frame can be drawn now, with its pixels resident for the
+// software compositor or in the atlas for gl. with streaming on, a frame
+// that isn't is requested and false is returned so a placeholder is
+// drawn. without streaming frames are always decoded when they're drawn
+static bool FrameReady(spriteframe_t *frame, bool uploaded)
+{
+	frame = FrameStorage(frame);
+	if (!numstreamworkers || frame->lump < 0)
+		return true;
+
+	if (uploaded ? frame->uploaded : frame->pixels != NULL)
+		return true;
+
+	// still resident after its atlas page was evicted, it only needs to
+	// go up again
+	if (!frame->requested)
+	{
+		if (frame->pixels)
+			Stream_QueueUpload(frame, Sys_Milliseconds());
+		else
+			Stream_Request(frame);
+	}
+
+	return false;
+}
+
+// copies as many waiting frames as fit into this frame's pixel buffer
+// and uploads them from it
+static void Stream_Upload()
+{
+	if (!numstreamuploads)
+		return;
+
+	// an evicted page is recreated from client memory, which can't happen
+	// with the pixel buffer bound, so every page is made resident first.
+	// touched pages aren't evicted again this frame
+	for (int i = 0; i < numstreamuploads; i++)
+	{
+		spriteframe_t *frame = streamuploads[i].frame;
+		if (frame->pixels && !frame->uploaded)
+			Tex_Touch(SPR0 + frame->page);
+	}
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, streampbos[streampbo]);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, STREAM_PBO_SIZE, NULL, GL_STREAM_DRAW);
+	unsigned char *buffer = (unsigned char*)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+
+	int offset = 0;
+	int done = 0;
+	for (; buffer && done < numstreamuploads; done++)
+	{
+		streamupload_t *upload = &streamuploads[done];
+		spriteframe_t *frame = upload->frame;
+
+		// evicted before it got here, it'll be requested again
+		upload->offset = -1;
+		if (!frame->pixels || frame->uploaded)
+		{
+			frame->requested = false;
+			continue;
+		}
+
+		int numbytes = FrameBytes(frame);
+		if (offset + numbytes > STREAM_PBO_SIZE)
+			break;
+
+		memcpy(buffer + offset, frame->pixels, numbytes);
+		upload->offset = offset;
+		offset += numbytes;
+	}
+
+	if (buffer)
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+	// the pixel pointer is an offset into the bound buffer
+	double now = Sys_Milliseconds();
+	for (int i = 0; buffer && i < done; i++)
+	{
+		streamupload_t *upload = &streamuploads[i];
+		spriteframe_t *frame = upload->frame;
+		if (upload->offset < 0)
+			continue;
+
+		GLenum format = frame->indexed ? GL_LUMINANCE : GL_RGBA;
+		Tex_Bind(SPR0 + frame->page);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, frame->x, frame->y, frame->width, frame->height, format, GL_UNSIGNED_BYTE, (const void*)(size_t)upload->offset);
+		frame->uploaded = true;
+		frame->requested = false;
+
+		streamstats.uploaded++;
+		streamstats.uploadbytes += FrameBytes(frame);
+		if (streamstats.numuploadsamples < MAX_STREAM_SAMPLES)
+			streamstats.uploadms[streamstats.numuploadsamples++] = now - upload->requesttime;
+	}
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	streampbo ^= 1;
+
+	// whatever didn't fit goes next frame
+	numstreamuploads -= done;
+	memmove(streamuploads, streamuploads + done, numstreamuploads * sizeof(streamupload_t));
+}
+
+// makes the frames the workers have finished resident, and queues them
+// for upload when drawing with gl. called at the start of each frame
+static void Stream_Update(bool upload)
+{
+	if (!numstreamworkers)
+		return;
+
+	pthread_mutex_lock(&streamlock);
+	streamrequest_t *finished = streamfinished;
+	streamfinished = NULL;
+	pthread_mutex_unlock(&streamlock);
+
+	double now = Sys_Milliseconds();
+	while (finished)
+	{
+		streamrequest_t *req = finished;
+		finished = req->next;
+
+		spriteframe_t *frame = req->frame;
+		FrameCache_Insert(frame, req->pixels);
+		frame->requested = false;
+		streamstats.resident++;
+
+		if (streamstats.numsamples < MAX_STREAM_SAMPLES)
+		{
+			int n = streamstats.numsamples++;
+			streamstats.queuems[n] = req->starttime - req->requesttime;
+			streamstats.decodems[n] = req->decodetime - req->starttime;
+			streamstats.residentms[n] = now - req->requesttime;
+		}
+
+		if (upload)
+			Stream_QueueUpload(frame, req->requesttime);
+
+		req->next = streamfree;
+		streamfree = req;
+	}
+
+	if (upload)
+		Stream_Upload();
+}
+
+static int Stream_CompareFloat(const void *a, const void *b)
+{
+	float fa = *(const float*)a;
+	float fb = *(const float*)b;
+	return (fa > fb) - (fa < fb);
+}
+
+static void Stream_PrintLatency(const char *name, float *samples, int count)
+{
+	if (!count)
+		return;
+
+	qsort(samples, count, sizeof(float), Stream_CompareFloat);
+	printf("  %-9s p50 %7.3f ms  p95 %7.3f ms  max %7.3f ms\n",
+		name, samples[count / 2], samples[(count * 95) / 100], samples[count - 1]);
+}
+
+static void Stream_PrintStats()
+{
+	streamstats_t *ss = &streamstats;
+
+	printf("stream: %i workers, %i requests, %i resident, %i uploaded (%i bytes), %i placeholder draws\n",
+		numstreamworkers, ss->requests, ss->resident, ss->uploaded, ss->uploadbytes, ss->placeholders);
+	Stream_PrintLatency("queued", ss->queuems, ss->numsamples);
+	Stream_PrintLatency("decode", ss->decodems, ss->numsamples);
+	Stream_PrintLatency("resident", ss->residentms, ss->numsamples);
+	Stream_PrintLatency("uploaded", ss->uploadms, ss->numuploadsamples);
+}
+
+// raw rgba sprite files have no header, so their layout is listed here
+typedef struct rawsprite_s
+{
+	const char *filename;
+	int width, height;
+	int originx, originy;
+	int numframes;
+
+} rawsprite_t;
+
+static rawsprite_t rawsprites[] =
+{
+	{ "troo", 40, 55, 0, 0, 1 }
+};
+
+// sprites with few enough colours are converted to indexed frames with a
+// palette of their own plus a red damage flash, the rgba is thrown away
+static void LoadRawSprite(const rawsprite_t *raw)
+{
+	if (numspritedefs == MAX_SPRITES)
+		Error("LoadRawSprite: too many sprites\n");
+
+	arenamarker_t marker = Arena_GetMarker(Mem_ThreadArena());
+	arenamarker_t permmarker = Arena_GetMarker(&permarena);
+	unsigned char *data;
+	int size = ReadFile(raw->filename, (void**)&data);
+	int numpixels = raw->width * raw->height;
+	if (size < numpixels * 4 * raw->numframes)
+		Error("LoadRawSprite: \"%s\" is missing or too short\n", raw->filename);
+
+	spritedef_t *def = &spritedefs[numspritedefs++];
+	def->name = raw->filename;
+	def->numframes = raw->numframes;
+	def->palette = 0;
+	def->numpalettes = 0;
+
+	int bpp = 4;
+	unsigned char colors[256][3];
+	unsigned char *indexes = (unsigned char*)Mem_FrameAlloc(numpixels * raw->numframes);
+	if (numpalettes + 2 <= MAX_PALETTES && Palette_Quantise(data, numpixels * raw->numframes, indexes, colors))
+	{
+		Arena_FreeToMarker(&permarena, permmarker);
+		data = (unsigned char*)Mem_Alloc(numpixels * raw->numframes);
+		memcpy(data, indexes, numpixels * raw->numframes);
+
+		def->palette = Palette_Add(colors);
+		Palette_AddTinted(def->palette, 0xff, 0, 0, 0.5f);
+		def->numpalettes = 2;
+		bpp = 1;
+	}
+
+	def->frames = (spriteframe_t*)Mem_Alloc(raw->numframes * sizeof(spriteframe_t));
+
+	for (int i = 0; i < raw->numframes; i++)
+	{
+		spriteframe_t *f = &def->frames[i];
+		memset(f, 0, sizeof(*f));
+		f->width = raw->width;
+		f->height = raw->height;
+		f->originx = raw->originx;
+		f->originy = raw->originy;
+		f->pixels = data + (i * numpixels * bpp);
+		f->indexed = bpp == 1;
+		f->lump = -1;
+	}
+
+	Arena_FreeToMarker(Mem_ThreadArena(), marker);
+}
+
+//
+// interface to drawsprite
+//
+typedef struct sprite_s
+{
+	int posx, posy;
+	int sprite;
+	int frame;
+	int layer;
+	GLuint alphatex;
+	bool flipx, flipy;
+	float rgba[4];
+
+	// palette variant, 0 is the sprite's own colours
+	int palette;
+
+} sprite_t;
+
+static spriteframe_t *SpriteFrame(const sprite_t *spr)
+{
+	spritedef_t *def = &spritedefs[spr->sprite];
+	return &def->frames[spr->frame % def->numframes];
+}
+
+// the palette row an indexed sprite is drawn through
+static int SpritePalette(const sprite_t *spr)
+{
+	spritedef_t *def = &spritedefs[spr->sprite];
+	if (!def->numpalettes)
+		return 0;
+	return def->palette + max(0, min(spr->palette, def->numpalettes - 1));
+}
+
+static float AlphaScaleFactor(GLuint alphatex)
+{
+	if (alphatex == BUILTIN_SOLID)
+		return 1.0f;
+	else if (alphatex == BUILTIN_DLINE)
+		return 0.25f;
+	else
+		return 0.5f;
+}
+
+static void SwapFloat(float *x, float *y)
+{
+	float temp = *x;
+	*x = *y;
+	*y = temp;
+}
+
+// internal draw sprite data, four vertices of xy, uv, mask st, rgba.
+// uv covers the frame from 0 to 1, FrameTexCoord maps it into the atlas
+static void AssembleVertexData(const sprite_t *spr, float vertices[4][10])
+{
+	spriteframe_t *frame = SpriteFrame(spr);
+	int sizex = frame->width;
+	int sizey = frame->height;
+	int basex = spr->posx - frame->originx;
+	int basey = spr->posy - frame->originy;
+	const float *rgba = spr->rgba;
+	bool flipx = spr->flipx ^ frame->mirror;
+
+	float alphascale = AlphaScaleFactor(spr->alphatex);
+
+	// assemble the vertex data xy, uv
+	vertices[0][0] = basex;
+	vertices[0][1] = basey;
+	vertices[0][2] = 0.0f;
+	vertices[0][3] = 0.0f;
+	vertices[0][4] = 0.0f;
+	vertices[0][5] = 0.0f;
+	vertices[0][6] = rgba[0];
+	vertices[0][7] = rgba[1];
+	vertices[0][8] = rgba[2];
+	vertices[0][9] = rgba[3];
+
+	vertices[1][0] = basex + sizex;
+	vertices[1][1] = basey;
+	vertices[1][2] = 1.0f;
+	vertices[1][3] = 0.0f;
+	vertices[1][4] = sizex * alphascale;
+	vertices[1][5] = 0.0f;
+	vertices[1][6] = rgba[0];
+	vertices[1][7] = rgba[1];
+	vertices[1][8] = rgba[2];
+	vertices[1][9] = rgba[3];
+
+	vertices[2][0] = basex;
+	vertices[2][1] = basey + sizey;
+	vertices[2][2] = 0.0f;
+	vertices[2][3] = 1.0f;
+	vertices[2][4] = 0.0f;
+	vertices[2][5] = sizey * alphascale;
+	vertices[2][6] = rgba[0];
+	vertices[2][7] = rgba[1];
+	vertices[2][8] = rgba[2];
+	vertices[2][9] = rgba[3];
+
+	vertices[3][0] = basex + sizex;
+	vertices[3][1] = basey + sizey;
+	vertices[3][2] = 1.0f;
+	vertices[3][3] = 1.0f;
+	vertices[3][4] = sizex * alphascale;
+	vertices[3][5] = sizey * alphascale;
+	vertices[3][6] = rgba[0];
+	vertices[3][7] = rgba[1];
+	vertices[3][8] = rgba[2];
+	vertices[3][9] = rgba[3];
+
+	if (flipx)
+	{
+		SwapFloat(&vertices[0][2], &vertices[1][2]);
+		SwapFloat(&vertices[2][2], &vertices[3][2]);
+	}
+
+	if (spr->flipy)
+	{
+		SwapFloat(&vertices[0][3], &vertices[2][3]);
+		SwapFloat(&vertices[1][3], &vertices[3][3]);
+	}
+}
+
+
+static void FrameTexCoord(spriteframe_t *frame, const float uv[2], float st[2])
+{
+	frame = FrameStorage(frame);
+
+	st[0] = frame->s0 + uv[0] * (frame->s1 - frame->s0);
+	st[1] = frame->t0 + uv[1] * (frame->t1 - frame->t0);
+}
+
+static void DrawAlphaLayer(const sprite_t *spr, float vertices[4][10])
+{
+	GLState_ColorMask(0, 0, 0, 1);
+	GLState_Blend(true);
+	GLState_BlendFunc(GL_ONE, GL_ZERO);
+
+	GLState_EnableTexture(0, true);
+	Tex_BindUnit(0, spr->alphatex);
+	glColor3f(1, 1, 1);
+
+	glBegin(GL_TRIANGLE_STRIP);
+
+	glBegin(GL_TRIANGLE_STRIP);
+	for (int i = 0; i < 4; i++)
+	{
+		glTexCoord2f(vertices[i][4], vertices[i][5]);
+		glColor4f(1, 1, 1, 1);
+		glVertex2f(vertices[i][0], vertices[i][1]);
+	}
+
+	glEnd();
+
+	GLState_Blend(false);
+	GLState_ColorMask(1, 1, 1, 1);
+}
+
+
+static void DrawColorLayer(const sprite_t *spr, float vertices[4][10])
+{
+	GLState_Blend(true);
+	GLState_BlendFunc(GL_DST_ALPHA, GL_ONE_MINUS_DST_ALPHA);
+
+	spriteframe_t *frame = SpriteFrame(spr);
+
+	GLState_EnableTexture(0, true);
+	GLState_ActiveTexture(0);
+	Atlas_Upload(frame);
+	Tex_Bind(SPR0 + FrameStorage(frame)->page);
+	glColor3f(1, 1, 1);
+
+	glBegin(GL_TRIANGLE_STRIP);
+	for (int i = 0; i < 4; i++)
+	{
+		float st[2];
+		FrameTexCoord(frame, &vertices[i][2], st);
+		glTexCoord2f(st[0], st[1]);
+		glColor4f(vertices[i][6], vertices[i][7], vertices[i][8], vertices[i][9]);
+		glVertex2f(vertices[i][0], vertices[i][1]);
+	}
+
+	glEnd();
+
+	GLState_Blend(false);
+}
+
+// the state is left set for the next sprite rather than torn down, so a
+// run of sprites sharing textures only pays for the first
+static void DrawMultiTex(const sprite_t *spr, float vertices[4][10])
+{
+	spriteframe_t *frame = SpriteFrame(spr);
+
+	GLState_Blend(true);
+	GLState_BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	GLState_EnableTexture(0, true);
+	Tex_BindUnit(0, spr->alphatex);
+
+	bool ready = FrameReady(frame, true);
+	Palette_Bind(ready && FrameStorage(frame)->indexed);
+	float palettecoord = PaletteCoord(SpritePalette(spr));
+
+	GLState_EnableTexture(1, true);
+	GLState_ActiveTexture(1);
+	if (ready)
+	{
+		Atlas_Upload(frame);
+		Tex_Bind(SPR0 + FrameStorage(frame)->page);
+	}
+	else
+	{
+		Tex_Bind(PLACEHOLDER_TEXTURE);
+		streamstats.placeholders++;
+	}
+
+	glBegin(GL_TRIANGLE_STRIP);
+	for (int i = 0; i < 4; i++)
+	{
+		float st[2] = { vertices[i][2], vertices[i][3] };
+		if (ready)
+			FrameTexCoord(frame, &vertices[i][2], st);
+		glMultiTexCoord2f(GL_TEXTURE0, vertices[i][4], vertices[i][5]);
+		glMultiTexCoord3f(GL_TEXTURE1, st[0], st[1], palettecoord);
+		glColor4f(vertices[i][6], vertices[i][7], vertices[i][8], vertices[i][9]);
+		glVertex2f(vertices[i][0], vertices[i][1]);
+	}
+
+	glEnd();
+}
+
+// ==============================================
+// software compositor
+//
+// reproduces DrawMultiTex on the cpu so sprites can be rendered without
+// a gl context. the framebuffer is rgba bytes at the logical resolution
+// with row 0 at the bottom, matching the gl ortho setup.
+// the fragment is sprite texel * vertex color * mask, blended with
+// SRC_ALPHA, ONE_MINUS_SRC_ALPHA on all four channels like the gl path
+
+typedef struct framebuffer_s
+{
+	int width, height;
+	unsigned char *pixels;
+
+} framebuffer_t;
+
+static framebuffer_t softfb;
+static bool softrender = false;
+static bool softspans = true;
+static bool softavx2 = false;
+
+static void Soft_InitThreads();
+
+static void Soft_Init(int width, int height)
+{
+	softfb.width = width;
+	softfb.height = height;
+	softfb.pixels = (unsigned char*)Mem_Alloc(width * height * 4);
+
+	Soft_InitThreads();
+
+#ifdef SOFT_AVX2
+	softavx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+static unsigned char Soft_FloatToByte(float f)
+{
+	f = f < 0.0f ? 0.0f : (f > 1.0f ? 1.0f : f);
+	return (unsigned char)(f * 255.0f + 0.5f);
+}
+
+static unsigned char softclear[4];
+static bool softvalid = false;
+
+// sets the colour the compositor clears to. changing it invalidates
+// whatever the framebuffer held from the last frame
+static void Soft_ClearColor(float r, float g, float b, float a)
+{
+	unsigned char c[4] = { Soft_FloatToByte(r), Soft_FloatToByte(g), Soft_FloatToByte(b), Soft_FloatToByte(a) };
+
+	if (memcmp(c, softclear, 4))
+	{
+		memcpy(softclear, c, 4);
+		softvalid = false;
+	}
+}
+
+static void Soft_ClearRect(framebuffer_t *fb, int x0, int y0, int x1, int y1)
+{
+	for (int y = y0; y < y1; y++)
+	{
+		unsigned char *p = fb->pixels + (y * fb->width + x0) * 4;
+		for (int x = x0; x < x1; x++, p += 4)
+			memcpy(p, softclear, 4);
+	}
+}
+
+// x / 255 rounded to nearest, exact for x <= 255 * 255
+static inline int Soft_Div255(int x)
+{
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+static void Soft_BlendPixel(unsigned char *d, const unsigned char *t, const int c[4])
+{
+	int s[4], a;
+
+	s[0] = Soft_Div255(t[0] * c[0]);
+	s[1] = Soft_Div255(t[1] * c[1]);
+	s[2] = Soft_Div255(t[2] * c[2]);
+	s[3] = Soft_Div255(t[3] * c[3]);
+	a = s[3];
+
+	d[0] = Soft_Div255(s[0] * a + d[0] * (255 - a));
+	d[1] = Soft_Div255(s[1] * a + d[1] * (255 - a));
+	d[2] = Soft_Div255(s[2] * a + d[2] * (255 - a));
+	d[3] = Soft_Div255(s[3] * a + d[3] * (255 - a));
+}
+
+#ifdef __SSE2__
+static inline __m128i Soft_Div255_SSE2(__m128i x)
+{
+	x = _mm_add_epi16(x, _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+// two pixels worth of 16 bit channels
+static inline __m128i Soft_Blend2_SSE2(__m128i t, __m128i d, __m128i c)
+{
+	__m128i s = Soft_Div255_SSE2(_mm_mullo_epi16(t, c));
+
+	// broadcast each pixel's alpha across its channels
+	__m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+	__m128i ia = _mm_sub_epi16(_mm_set1_epi16(255), a);
+
+	return Soft_Div255_SSE2(_mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, ia)));
+}
+#endif
+
+// blends count texels modulated by a constant color into dst
+static void Soft_BlendSpan(unsigned char *dst, const unsigned char *src, int count, const int c[4])
+{
+	int i = 0;
+
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128();
+	__m128i color = _mm_set_epi16(c[3], c[2], c[1], c[0], c[3], c[2], c[1], c[0]);
+
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i t = _mm_loadu_si128((const __m128i*)(src + i * 4));
+		__m128i d = _mm_loadu_si128((const __m128i*)(dst + i * 4));
+
+		__m128i lo = Soft_Blend2_SSE2(_mm_unpacklo_epi8(t, zero), _mm_unpacklo_epi8(d, zero), color);
+		__m128i hi = Soft_Blend2_SSE2(_mm_unpackhi_epi8(t, zero), _mm_unpackhi_epi8(d, zero), color);
+
+		_mm_storeu_si128((__m128i*)(dst + i * 4), _mm_packus_epi16(lo, hi));
+	}
+#endif
+
+	for (; i < count; i++)
+		Soft_BlendPixel(dst + i * 4, src + i * 4, c);
+}
+
+// blends count texels with the color stepping linearly across the span
+static void Soft_BlendSpanGradient(unsigned char *dst, const unsigned char *src, int count, const float c0[4], const float dc[4])
+{
+	for (int i = 0; i < count; i++)
+	{
+		int c[4];
+		for (int j = 0; j < 4; j++)
+			c[j] = Soft_FloatToByte(c0[j] + dc[j] * i);
+
+		Soft_BlendPixel(dst + i * 4, src + i * 4, c);
+	}
+}
+
+#ifdef SOFT_AVX2
+// eight palette entries a time with a gather. built for avx2 regardless
+// of the compiler flags and only called when the cpu has it
+__attribute__((target("avx2")))
+static int Soft_ExpandPalette_AVX2(unsigned char *dst, const unsigned char *indexes, int count, const unsigned char *palette)
+{
+	int i = 0;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(indexes + i)));
+		__m256i color = _mm256_i32gather_epi32((const int*)palette, index, 4);
+		_mm256_storeu_si256((__m256i*)(dst + i * 4), color);
+	}
+
+	return i;
+}
+#endif
+
+// looks count indexes up in an rgba palette
+static void Soft_ExpandPalette(unsigned char *dst, const unsigned char *indexes, int count, const unsigned char *palette)
+{
+	int i = 0;
+
+#ifdef SOFT_AVX2
+	if (softavx2)
+		i = Soft_ExpandPalette_AVX2(dst, indexes, count, palette);
+#endif
+
+	for (; i < count; i++)
+		memcpy(dst + i * 4, palette + indexes[i] * 4, 4);
+}
+
+static void Soft_LerpVertex(float out[10], const float a[10], const float b[10], float f)
+{
+	for (int i = 0; i < 10; i++)
+		out[i] = a[i] + (b[i] - a[i]) * f;
+}
+
+// composites the quad in vertices (as laid out by AssembleVertexData)
+// using texture as the sprite image, clipped to the rectangle
+// x0, y0 - x1, y1 (exclusive) of the framebuffer
+static void Soft_DrawQuad(framebuffer_t *fb, float verts[4][10], const image_t *texture, const image_t *mask, int clipx0, int clipy0, int clipx1, int clipy1)
+{
+	float qx0 = verts[0][0];
+	float qy0 = verts[0][1];
+	float qx1 = verts[3][0];
+	float qy1 = verts[3][1];
+
+	// pixels whose centers fall inside the quad, like gl
+	int x0 = (int)ceilf(qx0 - 0.5f);
+	int y0 = (int)ceilf(qy0 - 0.5f);
+	int x1 = (int)ceilf(qx1 - 0.5f);
+	int y1 = (int)ceilf(qy1 - 0.5f);
+
+	x0 = max(x0, max(clipx0, 0));
+	y0 = max(y0, max(clipy0, 0));
+	x1 = min(x1, min(clipx1, fb->width));
+	y1 = min(y1, min(clipy1, fb->height));
+
+	if (x0 >= x1 || y0 >= y1)
+		return;
+
+	int count = x1 - x0;
+	unsigned char *texels = (unsigned char*)Mem_FrameAlloc(count * 4);
+	unsigned char *indexes = (unsigned char*)Mem_FrameAlloc(count);
+	float invw = 1.0f / (qx1 - qx0);
+	float invh = 1.0f / (qy1 - qy0);
+	bool constcolor = true;
+
+	for (int i = 1; i < 4; i++)
+	{
+		for (int j = 6; j < 10; j++)
+			constcolor = constcolor && (verts[i][j] == verts[0][j]);
+	}
+
+	int c[4];
+	for (int j = 0; j < 4; j++)
+		c[j] = Soft_FloatToByte(verts[0][6 + j]);
+
+	for (int y = y0; y < y1; y++)
+	{
+		float fy = ((y + 0.5f) - qy0) * invh;
+
+		// attributes at the left and right pixel centers of the span
+		float bottom[10], top[10], left[10], right[10];
+		float fl = ((x0 + 0.5f) - qx0) * invw;
+		float fr = ((x1 - 0.5f) - qx0) * invw;
+		Soft_LerpVertex(bottom, verts[0], verts[1], fl);
+		Soft_LerpVertex(top, verts[2], verts[3], fl);
+		Soft_LerpVertex(left, bottom, top, fy);
+		Soft_LerpVertex(bottom, verts[0], verts[1], fr);
+		Soft_LerpVertex(top, verts[2], verts[3], fr);
+		Soft_LerpVertex(right, bottom, top, fy);
+
+		float step = count > 1 ? 1.0f / (count - 1) : 0.0f;
+		float du = (right[2] - left[2]) * step;
+		float dv = (right[3] - left[3]) * step;
+		float ds = (right[4] - left[4]) * step;
+		float dt = (right[5] - left[5]) * step;
+
+		// fetch the texels for the span, folding the mask into the alpha.
+		// nearest filtering, clamp on the sprite and repeat on the mask.
+		// texel coordinates are stepped in 16.16 fixed point. indexed
+		// images gather indexes, with masked texels made transparent,
+		// and expand the whole span through the palette afterwards
+		int tu = (int)floorf(left[2] * texture->width * 65536.0f);
+		int tv = (int)floorf(left[3] * texture->height * 65536.0f);
+		int ms = (int)floorf(left[4] * mask->width * 65536.0f);
+		int mt = (int)floorf(left[5] * mask->height * 65536.0f);
+		int tdu = (int)(du * texture->width * 65536.0f);
+		int tdv = (int)(dv * texture->height * 65536.0f);
+		int mds = (int)(ds * mask->width * 65536.0f);
+		int mdt = (int)(dt * mask->height * 65536.0f);
+
+		unsigned char *t = texels;
+		for (int i = 0; i < count; i++, t += 4)
+		{
+			int tx = max(0, min(tu >> 16, texture->width - 1));
+			int ty = max(0, min(tv >> 16, texture->height - 1));
+
+			int mx = (ms >> 16) % mask->width;
+			int my = (mt >> 16) % mask->height;
+			mx = mx < 0 ? mx + mask->width : mx;
+			my = my < 0 ? my + mask->height : my;
+
+			int texel = ty * texture->width + tx;
+			bool masked = !mask->data[(my * mask->width + mx) * 4 + 3];
+			if (texture->palette)
+			{
+				indexes[i] = masked ? PALETTE_TRANSPARENT : texture->data[texel];
+			}
+			else
+			{
+				memcpy(t, texture->data + texel * 4, 4);
+				if (masked)
+					t[3] = 0;
+			}
+
+			tu += tdu;
+			tv += tdv;
+			ms += mds;
+			mt += mdt;
+		}
+
+		if (texture->palette)
+			Soft_ExpandPalette(texels, indexes, count, texture->palette);
+
+		unsigned char *dst = fb->pixels + (y * fb->width + x0) * 4;
+		if (constcolor)
+		{
+			Soft_BlendSpan(dst, texels, count, c);
+		}
+		else
+		{
+			float dc[4];
+			for (int j = 0; j < 4; j++)
+				dc[j] = (right[6 + j] - left[6 + j]) * step;
+			Soft_BlendSpanGradient(dst, texels, count, left + 6, dc);
+		}
+	}
+}
+
+// blits a sprite at its own size using the frame's opaque spans, so the
+// transparent texels around it cost nothing. when the color is opaque
+// white, the mask is solid and the frame has no partial alpha the spans
+// are copied straight into the framebuffer without blending
+static void Soft_DrawSpans(framebuffer_t *fb, const sprite_t *spr, int clipx0, int clipy0, int clipx1, int clipy1)
+{
+	spriteframe_t *frame = SpriteFrame(spr);
+	framespan_t *spans = FrameSpans(frame);
+	spriteframe_t *storage = FrameStorage(frame);
+	const unsigned char *pixels = storage->pixels;
+	const unsigned char *palette = storage->indexed ? palettes[SpritePalette(spr)][0] : NULL;
+	const image_t *mask = &builtinmasks[spr->alphatex];
+	float maskscale = AlphaScaleFactor(spr->alphatex);
+	bool flipx = spr->flipx ^ frame->mirror;
+	int w = frame->width;
+	int h = frame->height;
+	int bpp = storage->indexed ? 1 : 4;
+	int basex = spr->posx - frame->originx;
+	int basey = spr->posy - frame->originy;
+
+	int x0 = max(basex, max(clipx0, 0));
+	int y0 = max(basey, max(clipy0, 0));
+	int x1 = min(basex + w, min(clipx1, fb->width));
+	int y1 = min(basey + h, min(clipy1, fb->height));
+
+	if (x0 >= x1 || y0 >= y1)
+		return;
+
+	int c[4];
+	for (int j = 0; j < 4; j++)
+		c[j] = Soft_FloatToByte(spr->rgba[j]);
+
+	bool solidmask = spr->alphatex == BUILTIN_SOLID;
+	bool copy = solidmask && storage->opaque && c[0] == 0xff && c[1] == 0xff && c[2] == 0xff && c[3] == 0xff;
+
+	unsigned char *texels = (unsigned char*)Mem_FrameAlloc(w * 4);
+	unsigned char *indexes = (unsigned char*)Mem_FrameAlloc(w);
+
+	for (int y = y0; y < y1; y++)
+	{
+		// the mask isn't flipped, it stays fixed to the screen
+		int py = y - basey;
+		int ty = spr->flipy ? h - 1 - py : py;
+		int my = (int)floorf((py + 0.5f) * maskscale * mask->height) % mask->height;
+		const unsigned char *row = pixels + ty * w * bpp;
+		const unsigned char *maskrow = mask->data + my * mask->width * 4;
+
+		for (int i = storage->spanrows[ty]; i < storage->spanrows[ty + 1]; i++)
+		{
+			// the span in quad space, mirrored when flipped
+			int sx0 = flipx ? w - spans[i].x - spans[i].length : spans[i].x;
+			int sx1 = sx0 + spans[i].length;
+			sx0 = max(sx0, x0 - basex);
+			sx1 = min(sx1, x1 - basex);
+			if (sx0 >= sx1)
+				continue;
+
+			int count = sx1 - sx0;
+			unsigned char *dst = fb->pixels + (y * fb->width + basex + sx0) * 4;
+
+			if (palette)
+			{
+				for (int k = 0; k < count; k++)
+					indexes[k] = row[flipx ? w - 1 - (sx0 + k) : sx0 + k];
+
+				if (copy)
+				{
+					Soft_ExpandPalette(dst, indexes, count, palette);
+					continue;
+				}
+
+				Soft_ExpandPalette(texels, indexes, count, palette);
+			}
+			else if (flipx)
+			{
+				for (int k = 0; k < count; k++)
+					memcpy(texels + k * 4, row + (w - 1 - (sx0 + k)) * 4, 4);
+
+				if (copy)
+				{
+					memcpy(dst, texels, count * 4);
+					continue;
+				}
+			}
+			else
+			{
+				if (copy)
+				{
+					memcpy(dst, row + sx0 * 4, count * 4);
+					continue;
+				}
+
+				memcpy(texels, row + sx0 * 4, count * 4);
+			}
+
+			if (!solidmask)
+			{
+				for (int k = 0; k < count; k++)
+				{
+					int mx = (int)floorf((sx0 + k + 0.5f) * maskscale * mask->width) % mask->width;
+					if (!maskrow[mx * 4 + 3])
+						texels[k * 4 + 3] = 0;
+				}
+			}
+
+			Soft_BlendSpan(dst, texels, count, c);
+		}
+	}
+}
+
+// draws one sprite clipped to x0, y0 - x1, y1. ready is FrameReady for
+// the sprite's frame, taken once per frame by the caller
+static void Soft_DrawSprite(const sprite_t *spr, float vertices[4][10], bool ready, int x0, int y0, int x1, int y1)
+{
+	arenamarker_t marker = Arena_GetMarker(Mem_ThreadArena());
+
+	if (!ready)
+	{
+		Soft_DrawQuad(&softfb, vertices, &placeholderimage, &builtinmasks[spr->alphatex], x0, y0, x1, y1);
+	}
+	else if (softspans)
+	{
+		Soft_DrawSpans(&softfb, spr, x0, y0, x1, y1);
+	}
+	else
+	{
+		spriteframe_t *frame = SpriteFrame(spr);
+		image_t texture = { frame->width, frame->height, FramePixels(frame), NULL };
+		if (FrameStorage(frame)->indexed)
+			texture.palette = palettes[SpritePalette(spr)][0];
+
+		Soft_DrawQuad(&softfb, vertices, &texture, &builtinmasks[spr->alphatex], x0, y0, x1, y1);
+	}
+
+	Arena_FreeToMarker(Mem_ThreadArena(), marker);
+}
+
+// ==============================================
+// dirty rectangles
+//
+// the compositor keeps the framebuffer between frames and only redraws
+// what changed. every sprite's state and bounds are kept from the last
+// frame in draw order; where a sprite differs from the one drawn in its
+// place last frame, both its old and new bounds are dirty. any pixel
+// outside the dirty rects is covered by the same sprites in the same
+// order as before, so it's already right. overlapping rects are merged
+// and each one is cleared and recomposited from every sprite touching
+// it, clipped to the rect. past DIRTY_FULL_FRACTION of the framebuffer,
+// or with more sprites than are tracked, the whole frame is redrawn
+
+#define MAX_DIRTY_SPRITES	4096
+#define MAX_DIRTY_RECTS		64
+#define DIRTY_FULL_FRACTION	0.5f
+
+typedef struct softrect_s
+{
+	int x0, y0, x1, y1;
+
+} softrect_t;
+
+typedef struct softsprite_s
+{
+	sprite_t sprite;
+	bool ready;
+	softrect_t bounds;
+
+} softsprite_t;
+
+typedef struct dirtystats_s
+{
+	int frames;
+	int fullframes;
+	int rects;
+	long long pixels;
+
+} dirtystats_t;
+
+static bool softdirty = true;
+static softsprite_t *softsprites[2];
+static int numsoftsprites[2];
+static int softcurrent;
+static dirtystats_t dirtystats;
+
+static void Dirty_PrintStats()
+{
+	dirtystats_t *ds = &dirtystats;
+
+	if (!ds->frames)
+		return;
+
+	printf("dirty rects: %i frames, %i full redraws, %.1f rects/frame, %.1f%% of pixels composited\n",
+		ds->frames, ds->fullframes, (float)ds->rects / ds->frames,
+		100.0 * ds->pixels / ((double)ds->frames * softfb.width * softfb.height));
+}
+
+static void Dirty_Init()
+{
+	softsprites[0] = (softsprite_t*)Mem_Alloc(MAX_DIRTY_SPRITES * sizeof(softsprite_t));
+	softsprites[1] = (softsprite_t*)Mem_Alloc(MAX_DIRTY_SPRITES * sizeof(softsprite_t));
+
+	atexit(Dirty_PrintStats);
+}
+
+static bool Dirty_Overlap(const softrect_t *a, const softrect_t *b)
+{
+	return a->x0 < b->x1 && b->x0 < a->x1 && a->y0 < b->y1 && b->y0 < a->y1;
+}
+
+static bool Dirty_Empty(const softrect_t *r)
+{
+	return r->x0 >= r->x1 || r->y0 >= r->y1;
+}
+
+// adds r to the set, merging it with anything it overlaps. a merge can
+// grow it into rects it missed before so the scan starts again. the set
+// stays disjoint. false when there's no room left
+static bool Dirty_Add(softrect_t *rects, int *numrects, softrect_t r)
+{
+	if (Dirty_Empty(&r))
+		return true;
+
+	for (int i = 0; i < *numrects; i++)
+	{
+		if (!Dirty_Overlap(&rects[i], &r))
+			continue;
+
+		r.x0 = min(r.x0, rects[i].x0);
+		r.y0 = min(r.y0, rects[i].y0);
+		r.x1 = max(r.x1, rects[i].x1);
+		r.y1 = max(r.y1, rects[i].y1);
+
+		rects[i] = rects[--(*numrects)];
+		i = -1;
+	}
+
+	if (*numrects == MAX_DIRTY_RECTS)
+		return false;
+
+	rects[(*numrects)++] = r;
+	return true;
+}
+
+// the framebuffer pixels a sprite's quad touches
+static softrect_t Dirty_Bounds(float vertices[4][10])
+{
+	softrect_t r;
+
+	r.x0 = max(0, (int)floorf(min(vertices[0][0], vertices[3][0])));
+	r.y0 = max(0, (int)floorf(min(vertices[0][1], vertices[3][1])));
+	r.x1 = min(softfb.width, (int)ceilf(max(vertices[0][0], vertices[3][0])));
+	r.y1 = min(softfb.height, (int)ceilf(max(vertices[0][1], vertices[3][1])));
+
+	return r;
+}
+
+static bool Dirty_SameSprite(const softsprite_t *a, const softsprite_t *b)
+{
+	const sprite_t *sa = &a->sprite;
+	const sprite_t *sb = &b->sprite;
+
+	return a->ready == b->ready
+		&& sa->posx == sb->posx && sa->posy == sb->posy
+		&& sa->sprite == sb->sprite && SpriteFrame(sa) == SpriteFrame(sb)
+		&& sa->alphatex == sb->alphatex
+		&& sa->flipx == sb->flipx && sa->flipy == sb->flipy
+		&& !memcmp(sa->rgba, sb->rgba, sizeof(sa->rgba))
+		&& SpritePalette(sa) == SpritePalette(sb);
+}
+
+// ==============================================
+// tiled compositing
+//
+// the framebuffer is cut into SOFT_TILE_SIZE tiles and each sprite is
+// binned into every tile its bounds touch, keeping draw order within a
+// bin. tiles share no pixels so the compositor's threads take them off a
+// counter and draw them independently. every pixel still sees the same
+// sprites in the same order with the same blending, so the result is
+// identical to drawing on one thread. frames are decoded and the cache
+// frozen before the workers start; if the frames don't all fit in the
+// cache the frame is drawn on the main thread instead. a sprite pays its
+// setup once per tile it touches, so on one thread the whole
+// framebuffer is a single tile
+
+#define SOFT_TILE_SIZE		64
+#define MAX_SOFT_THREADS	16
+
+typedef struct softjob_s
+{
+	const sprite_t **sprites;
+	const softrect_t *bounds;
+	const bool *ready;
+	const softrect_t *rects;
+	int numrects;
+
+	int tilew, tileh;
+	int tilesx, tilesy;
+	int *binstart;		// tilesx * tilesy + 1 offsets into bins
+	int *bins;			// sprite indexes
+	int *tiledraws;
+
+	int nexttile;
+	int finished;
+
+} softjob_t;
+
+static int numsoftthreads = -1;		// -1 is one per cpu
+static pthread_t softthreads[MAX_SOFT_THREADS];
+static pthread_mutex_t softlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t softwake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t softdone = PTHREAD_COND_INITIALIZER;
+static int softgeneration;
+static int softacked;		// workers done with the current generation
+static softjob_t softjob;
+
+static void Soft_CompositeTile(softjob_t *job, int tile)
+{
+	softrect_t tilerect;
+	tilerect.x0 = (tile % job->tilesx) * job->tilew;
+	tilerect.y0 = (tile / job->tilesx) * job->tileh;
+	tilerect.x1 = min(tilerect.x0 + job->tilew, softfb.width);
+	tilerect.y1 = min(tilerect.y0 + job->tileh, softfb.height);
+
+	int draws = 0;
+	for (int r = 0; r < job->numrects; r++)
+	{
+		softrect_t rect = job->rects[r];
+		rect.x0 = max(rect.x0, tilerect.x0);
+		rect.y0 = max(rect.y0, tilerect.y0);
+		rect.x1 = min(rect.x1, tilerect.x1);
+		rect.y1 = min(rect.y1, tilerect.y1);
+		if (Dirty_Empty(&rect))
+			continue;
+
+		Soft_ClearRect(&softfb, rect.x0, rect.y0, rect.x1, rect.y1);
+
+		for (int b = job->binstart[tile]; b < job->binstart[tile + 1]; b++)
+		{
+			int i = job->bins[b];
+			if (!Dirty_Overlap(&job->bounds[i], &rect))
+				continue;
+
+			float vertices[4][10];
+			AssembleVertexData(job->sprites[i], vertices);
+			Soft_DrawSprite(job->sprites[i], vertices, job->ready[i], rect.x0, rect.y0, rect.x1, rect.y1);
+			draws++;
+		}
+	}
+
+	job->tiledraws[tile] = draws;
+}
+
+// draws tiles until there are none left
+static void Soft_RunTiles(softjob_t *job)
+{
+	int numtiles = job->tilesx * job->tilesy;
+	int done = 0;
+
+	for (;;)
+	{
+		int tile = __sync_fetch_and_add(&job->nexttile, 1);
+		if (tile >= numtiles)
+			break;
+
+		Soft_CompositeTile(job, tile);
+		done++;
+	}
+
+	pthread_mutex_lock(&softlock);
+	job->finished += done;
+	if (job->finished == numtiles)
+		pthread_cond_signal(&softdone);
+	pthread_mutex_unlock(&softlock);
+}
+
+// every worker acknowledges every generation, and the main thread waits
+// for all of them before it returns. the job is only rebuilt while they
+// are all parked waiting for the next generation
+static void *Soft_Worker(void *arg)
+{
+	int generation = 0;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&softlock);
+		while (softgeneration == generation)
+			pthread_cond_wait(&softwake, &softlock);
+		generation = softgeneration;
+		pthread_mutex_unlock(&softlock);
+
+		Soft_RunTiles(&softjob);
+
+		pthread_mutex_lock(&softlock);
+		softacked++;
+		pthread_cond_signal(&softdone);
+		pthread_mutex_unlock(&softlock);
+	}
+
+	return NULL;
+}
+
+static void Soft_InitThreads()
+{
+	if (numsoftthreads < 0)
+	{
+#ifdef WIN32
+		numsoftthreads = 1;
+#else
+		numsoftthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	}
+	numsoftthreads = max(1, min(numsoftthreads, MAX_SOFT_THREADS));
+
+	// the main thread is one of them
+	for (int i = 1; i < numsoftthreads; i++)
+	{
+		if (pthread_create(&softthreads[i], NULL, Soft_Worker, NULL))
+			Error("Soft_InitThreads: failed to start thread %i\n", i);
+	}
+}
+
+// bins the sprites into tiles and composites the rects, spread over the
+// compositor threads when parallel is set. returns the number of draws
+static int Soft_CompositeTiles(const sprite_t **sprites, const softrect_t *bounds, const bool *ready, int count,
+	const softrect_t *rects, int numrects, bool parallel)
+{
+	softjob_t *job = &softjob;
+
+	parallel = parallel && numsoftthreads > 1;
+	int tilew = parallel ? SOFT_TILE_SIZE : softfb.width;
+	int tileh = parallel ? SOFT_TILE_SIZE : softfb.height;
+	int tilesx = (softfb.width + tilew - 1) / tilew;
+	int tilesy = (softfb.height + tileh - 1) / tileh;
+	int numtiles = tilesx * tilesy;
+
+	job->sprites = sprites;
+	job->bounds = bounds;
+	job->ready = ready;
+	job->rects = rects;
+	job->numrects = numrects;
+	job->tilew = tilew;
+	job->tileh = tileh;
+	job->tilesx = tilesx;
+	job->tilesy = tilesy;
+	job->binstart = (int*)Mem_FrameAlloc((numtiles + 1) * sizeof(int));
+	job->tiledraws = (int*)Mem_FrameAlloc(numtiles * sizeof(int));
+	memset(job->binstart, 0, (numtiles + 1) * sizeof(int));
+
+	// count the sprites in each tile, turn the counts into offsets and
+	// fill the bins in draw order
+	for (int pass = 0; pass < 2; pass++)
+	{
+		if (pass == 1)
+		{
+			int total = 0;
+			for (int t = 0; t <= numtiles; t++)
+			{
+				int n = job->binstart[t];
+				job->binstart[t] = total;
+				total += n;
+			}
+
+			job->bins = (int*)Mem_FrameAlloc(max(total, 1) * sizeof(int));
+		}
+
+		int *fill = (int*)Mem_FrameAlloc(numtiles * sizeof(int));
+		if (pass == 1)
+			memcpy(fill, job->binstart, numtiles * sizeof(int));
+
+		for (int i = 0; i < count; i++)
+		{
+			const softrect_t *b = &bounds[i];
+			if (Dirty_Empty(b))
+				continue;
+
+			int tx1 = (b->x1 - 1) / tilew;
+			int ty1 = (b->y1 - 1) / tileh;
+			for (int ty = b->y0 / tileh; ty <= ty1; ty++)
+			{
+				for (int tx = b->x0 / tilew; tx <= tx1; tx++)
+				{
+					if (pass == 0)
+						job->binstart[ty * tilesx + tx]++;
+					else
+						job->bins[fill[ty * tilesx + tx]++] = i;
+				}
+			}
+		}
+	}
+
+	job->nexttile = 0;
+	job->finished = 0;
+
+	if (parallel)
+	{
+		pthread_mutex_lock(&softlock);
+		softgeneration++;
+		softacked = 0;
+		pthread_cond_broadcast(&softwake);
+		pthread_mutex_unlock(&softlock);
+
+		Soft_RunTiles(job);
+
+		pthread_mutex_lock(&softlock);
+		while (job->finished < numtiles || softacked < numsoftthreads - 1)
+			pthread_cond_wait(&softdone, &softlock);
+		pthread_mutex_unlock(&softlock);
+	}
+	else
+	{
+		for (int t = 0; t < numtiles; t++)
+			Soft_CompositeTile(job, t);
+	}
+
+	int draws = 0;
+	for (int t = 0; t < numtiles; t++)
+		draws += job->tiledraws[t];
+
+	return draws;
+}
+
+// composites the sorted sprites, redrawing only the parts of the
+// framebuffer that changed since the last call. returns the number of
+// sprite draws it took
+static int Soft_Composite(const sprite_t **sprites, int count)
+{
+	if (softdirty && !softsprites[0])
+		Dirty_Init();
+
+	bool track = softdirty && count <= MAX_DIRTY_SPRITES;
+	softsprite_t *cur = softsprites[softcurrent];
+	softsprite_t *prev = softsprites[softcurrent ^ 1];
+	int numprev = numsoftsprites[softcurrent ^ 1];
+
+	softrect_t *bounds = (softrect_t*)Mem_FrameAlloc(max(count, 1) * sizeof(softrect_t));
+	bool *ready = (bool*)Mem_FrameAlloc(max(count, 1) * sizeof(bool));
+
+	// decode everything up front so the workers only read. a cache too
+	// small for the frame can evict what was decoded earlier in the loop
+	bool resident = true;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			spriteframe_t *frame = SpriteFrame(sprites[i]);
+
+			if (pass == 0)
+			{
+				float vertices[4][10];
+				AssembleVertexData(sprites[i], vertices);
+				bounds[i] = Dirty_Bounds(vertices);
+				ready[i] = FrameReady(frame, false);
+
+				if (!ready[i])
+					streamstats.placeholders++;
+				else if (softspans)
+					FrameSpans(frame);
+				else
+					FramePixels(frame);
+			}
+			else if (ready[i])
+			{
+				spriteframe_t *storage = FrameStorage(frame);
+				if (!storage->pixels || (softspans && !storage->spans))
+					resident = false;
+			}
+		}
+	}
+
+	softrect_t rects[MAX_DIRTY_RECTS];
+	int numrects = 0;
+	bool full = !track || !softvalid;
+
+	if (track)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			cur[i].sprite = *sprites[i];
+			cur[i].ready = ready[i];
+			cur[i].bounds = bounds[i];
+		}
+
+		for (int i = 0; !full && i < max(count, numprev); i++)
+		{
+			if (i < count && i < numprev && Dirty_SameSprite(&cur[i], &prev[i]))
+				continue;
+
+			if (i < numprev && !Dirty_Add(rects, &numrects, prev[i].bounds))
+				full = true;
+			if (i < count && !Dirty_Add(rects, &numrects, cur[i].bounds))
+				full = true;
+		}
+	}
+
+	long long area = 0;
+	for (int i = 0; i < numrects; i++)
+		area += (long long)(rects[i].x1 - rects[i].x0) * (rects[i].y1 - rects[i].y0);
+
+	if (area > DIRTY_FULL_FRACTION * softfb.width * softfb.height)
+		full = true;
+
+	if (full)
+	{
+		rects[0].x0 = 0;
+		rects[0].y0 = 0;
+		rects[0].x1 = softfb.width;
+		rects[0].y1 = softfb.height;
+		numrects = 1;
+		area = (long long)softfb.width * softfb.height;
+		dirtystats.fullframes++;
+	}
+
+	int draws = 0;
+	if (numrects)
+	{
+		framecachefrozen = resident;
+		draws = Soft_CompositeTiles(sprites, bounds, ready, count, rects, numrects, resident);
+		framecachefrozen = false;
+	}
+
+	dirtystats.frames++;
+	dirtystats.rects += numrects;
+	dirtystats.pixels += area;
+
+	// the next frame compares against this one
+	numsoftsprites[softcurrent] = track ? count : 0;
+	softcurrent ^= 1;
+	softvalid = track;
+
+	return draws;
+}
+
+// writes the framebuffer top row first, dropping the alpha
+static void Soft_WritePPM(framebuffer_t *fb, const char *filename)
+{
+	FILE *fp = fopen(filename, "wb");
+	if (!fp)
+	{
+		Warning("failed to open \"%s\" for writing\n", filename);
+		return;
+	}
+
+	fprintf(fp, "P6\n%i %i\n255\n", fb->width, fb->height);
+	for (int y = fb->height - 1; y >= 0; y--)
+	{
+		unsigned char *p = fb->pixels + (y * fb->width * 4);
+		for (int x = 0; x < fb->width; x++, p += 4)
+			fwrite(p, 3, 1, fp);
+	}
+
+	fclose(fp);
+}
+
+static unsigned int pngcrctable[256];
+
+static unsigned int PNG_Crc(unsigned int crc, const unsigned char *data, int length)
+{
+	if (!pngcrctable[1])
+	{
+		for (unsigned int n = 0; n < 256; n++)
+		{
+			unsigned int c = n;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			pngcrctable[n] = c;
+		}
+	}
+
+	crc = ~crc;
+	for (int i = 0; i < length; i++)
+		crc = pngcrctable[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+static void PNG_Put32(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void PNG_WriteChunk(FILE *fp, const char *type, const unsigned char *data, int length)
+{
+	unsigned char header[8];
+	PNG_Put32(header, length);
+	memcpy(header + 4, type, 4);
+
+	unsigned char crc[4];
+	PNG_Put32(crc, PNG_Crc(PNG_Crc(0, header + 4, 4), data, length));
+
+	fwrite(header, 8, 1, fp);
+	fwrite(data, length, 1, fp);
+	fwrite(crc, 4, 1, fp);
+}
+
+// uncompressed png, the image data is stored in raw deflate blocks so
+// there's no dependency on zlib
+static void Soft_WritePNG(framebuffer_t *fb, const char *filename)
+{
+	FILE *fp = fopen(filename, "wb");
+	if (!fp)
+	{
+		Warning("failed to open \"%s\" for writing\n", filename);
+		return;
+	}
+
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	fwrite(signature, 8, 1, fp);
+
+	unsigned char ihdr[13];
+	PNG_Put32(ihdr + 0, fb->width);
+	PNG_Put32(ihdr + 4, fb->height);
+	ihdr[8] = 8;	// bit depth
+	ihdr[9] = 2;	// rgb
+	ihdr[10] = 0;
+	ihdr[11] = 0;
+	ihdr[12] = 0;
+	PNG_WriteChunk(fp, "IHDR", ihdr, 13);
+
+	arenamarker_t marker = Arena_GetMarker(Mem_ThreadArena());
+
+	// filter byte per row followed by the rgb, top row first
+	int rowbytes = 1 + fb->width * 3;
+	int rawsize = rowbytes * fb->height;
+	unsigned char *raw = (unsigned char*)Mem_FrameAlloc(rawsize);
+	for (int y = 0; y < fb->height; y++)
+	{
+		unsigned char *out = raw + y * rowbytes;
+		unsigned char *in = fb->pixels + ((fb->height - 1 - y) * fb->width * 4);
+		*out++ = 0;
+		for (int x = 0; x < fb->width; x++, in += 4, out += 3)
+			memcpy(out, in, 3);
+	}
+
+	// zlib stream of stored blocks
+	int numblocks = (rawsize + 65534) / 65535;
+	unsigned char *zdata = (unsigned char*)Mem_FrameAlloc(2 + numblocks * 5 + rawsize + 4);
+	unsigned char *z = zdata;
+	*z++ = 0x78;
+	*z++ = 0x01;
+
+	unsigned int s1 = 1, s2 = 0;
+	for (int offset = 0; offset < rawsize; )
+	{
+		int length = min(65535, rawsize - offset);
+		*z++ = (offset + length == rawsize);
+		*z++ = length & 0xff;
+		*z++ = length >> 8;
+		*z++ = ~length & 0xff;
+		*z++ = (~length >> 8) & 0xff;
+		memcpy(z, raw + offset, length);
+		z += length;
+
+		for (int i = 0; i < length; i++)
+		{
+			s1 = (s1 + raw[offset + i]) % 65521;
+			s2 = (s2 + s1) % 65521;
+		}
+
+		offset += length;
+	}
+
+	PNG_Put32(z, (s2 << 16) | s1);
+	z += 4;
+
+	PNG_WriteChunk(fp, "IDAT", zdata, z - zdata);
+	PNG_WriteChunk(fp, "IEND", NULL, 0);
+
+	Arena_FreeToMarker(Mem_ThreadArena(), marker);
+	fclose(fp);
+}
+
+// the largest whole number scale of the logical resolution that fits
+// the window, and where to put it so it's centred
+static int PresentScale(int *x, int *y)
+{
+	int scale = max(1, min(screenw / renderw, screenh / renderh));
+
+	*x = (screenw - renderw * scale) / 2;
+	*y = (screenh - renderh * scale) / 2;
+
+	return scale;
+}
+
+// nearest neighbour copy of src at scale times the size into dst, which
+// is allocated from the frame arena
+static void Soft_Upscale(const framebuffer_t *src, int scale, framebuffer_t *dst)
+{
+	dst->width = src->width * scale;
+	dst->height = src->height * scale;
+	dst->pixels = (unsigned char*)Mem_FrameAlloc(dst->width * dst->height * 4);
+
+	int stride = dst->width * 4;
+	for (int y = 0; y < src->height; y++)
+	{
+		const unsigned char *s = src->pixels + y * src->width * 4;
+		unsigned char *d = dst->pixels + y * scale * stride;
+
+		for (int x = 0; x < src->width; x++, s += 4)
+		{
+			for (int i = 0; i < scale; i++, d += 4)
+				memcpy(d, s, 4);
+		}
+
+		// the rest of the rows are copies of the first
+		for (int i = 1; i < scale; i++)
+			memcpy(dst->pixels + (y * scale + i) * stride, dst->pixels + y * scale * stride, stride);
+	}
+}
+
+// shows the cpu framebuffer in the window when running with -soft, at
+// the same integer scale as the gl path
+static void Soft_Present()
+{
+	// drawpixels fragments are textured and blended like any other
+	GLState_UseProgram(0);
+	GLState_EnableTexture(0, false);
+	GLState_EnableTexture(1, false);
+	GLState_Blend(false);
+
+	int x, y;
+	int scale = PresentScale(&x, &y);
+
+	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	glWindowPos2i(max(x, 0), max(y, 0));
+	glPixelZoom(scale, scale);
+	glDrawPixels(softfb.width, softfb.height, GL_RGBA, GL_UNSIGNED_BYTE, softfb.pixels);
+	glPixelZoom(1.0f, 1.0f);
+}
+
+// ==============================================
+// sprite packs
+//
+// a pack is a single file holding any number of sprites. it's mapped
+// and used in place: the frame pixels are never copied out of the
+// mapping, only the small per frame atlas placement is allocated.
+// all values are little endian
+//
+//   packheader_t
+//   packsprite_t[numsprites]
+//   packframe_t[numframes]
+//   palettes, 256 rgba entries each
+//   frame data, each frame starting on a 16 byte boundary
+//
+// palettes are copied into the palette table when the pack is loaded,
+// sprite palette numbers are relative to the first palette in the pack
+
+#define PACK_IDENT		(('K' << 24) + ('A' << 16) + ('P' << 8) + 'S')
+#define PACK_VERSION	2
+#define PACK_ALIGN		16
+
+enum
+{
+	PACK_FORMAT_RGBA,
+	PACK_FORMAT_INDEXED
+};
+
+typedef struct packheader_s
+{
+	int ident;
+	int version;
+	int numsprites;
+	int spritesofs;
+	int numframes;
+	int framesofs;
+	int numpalettes;
+	int palettesofs;
+	int filesize;
+
+} packheader_t;
+
+typedef struct packsprite_s
+{
+	char name[16];
+	int firstframe;
+	int numframes;
+	int palette;
+	int numpalettes;
+
+} packsprite_t;
+
+typedef struct packframe_s
+{
+	short width, height;
+	short originx, originy;
+	int format;
+	int offset;
+	int size;
+
+} packframe_t;
+
+// true if the directory, frames and sprites all lie inside the file.
+// the offsets come straight from the file so they're summed in 64 bits
+static bool Pack_Check(const char *filename, const unsigned char *base, int size)
+{
+	const packheader_t *header = (const packheader_t*)base;
+	if (header->ident != PACK_IDENT || header->version != PACK_VERSION || header->filesize != size)
+	{
+		Warning("\"%s\" is not a version %i sprite pack\n", filename, PACK_VERSION);
+		return false;
+	}
+
+	if (header->numsprites < 0 || header->numframes < 0
+		|| header->spritesofs < 0 || header->spritesofs + header->numsprites * (long long)sizeof(packsprite_t) > size
+		|| header->framesofs < 0 || header->framesofs + header->numframes * (long long)sizeof(packframe_t) > size
+		|| header->numpalettes < 0 || header->palettesofs < 0 || header->palettesofs + header->numpalettes * (long long)sizeof(palettes[0]) > size)
+	{
+		Warning("\"%s\" has a bad directory\n", filename);
+		return false;
+	}
+
+	const packsprite_t *packsprites = (const packsprite_t*)(base + header->spritesofs);
+	const packframe_t *packframes = (const packframe_t*)(base + header->framesofs);
+
+	for (int i = 0; i < header->numframes; i++)
+	{
+		const packframe_t *pf = &packframes[i];
+		int bpp = pf->format == PACK_FORMAT_INDEXED ? 1 : 4;
+		if ((pf->format != PACK_FORMAT_RGBA && pf->format != PACK_FORMAT_INDEXED) || pf->width <= 0 || pf->height <= 0
+			|| pf->size != (long long)pf->width * pf->height * bpp || pf->offset < 0 || (long long)pf->offset + pf->size > size)
+		{
+			Warning("\"%s\" frame %i is bad\n", filename, i);
+			return false;
+		}
+	}
+
+	for (int i = 0; i < header->numsprites; i++)
+	{
+		// the name is used in place so it has to be terminated
+		const packsprite_t *ps = &packsprites[i];
+		bool bad = !memchr(ps->name, 0, sizeof(ps->name))
+			|| ps->firstframe < 0 || ps->numframes <= 0 || (long long)ps->firstframe + ps->numframes > header->numframes
+			|| ps->palette < 0 || ps->numpalettes < 0 || (long long)ps->palette + ps->numpalettes > header->numpalettes;
+
+		// indexed frames need a palette to be drawn through
+		for (int j = 0; !bad && j < ps->numframes; j++)
+			bad = packframes[ps->firstframe + j].format == PACK_FORMAT_INDEXED && !ps->numpalettes;
+
+		if (bad)
+		{
+			Warning("\"%s\" sprite %i is bad\n", filename, i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// returns false if the file isn't there or isn't a valid pack
+static bool Pack_Load(const char *filename)
+{
+	const unsigned char *base;
+	int size = MapFile(filename, (const void**)&base);
+	if (size < (int)sizeof(packheader_t) || !Pack_Check(filename, base, size))
+	{
+		UnmapFile(base, size);
+		return false;
+	}
+
+	const packheader_t *header = (const packheader_t*)base;
+	if (numspritedefs + header->numsprites > MAX_SPRITES)
+		Error("Pack_Load: too many sprites\n");
+	if (numpalettes + header->numpalettes > MAX_PALETTES)
+		Error("Pack_Load: too many palettes\n");
+
+	const packsprite_t *packsprites = (const packsprite_t*)(base + header->spritesofs);
+	const packframe_t *packframes = (const packframe_t*)(base + header->framesofs);
+
+	// keep the only transparent entry the reserved one
+	int firstpalette = numpalettes;
+	memcpy(palettes[numpalettes], base + header->palettesofs, header->numpalettes * sizeof(palettes[0]));
+	for (int i = 0; i < header->numpalettes; i++, numpalettes++)
+	{
+		for (int j = 0; j < 256; j++)
+			palettes[numpalettes][j][3] = j == PALETTE_TRANSPARENT ? 0 : 0xff;
+	}
+
+	for (int i = 0; i < header->numsprites; i++)
+	{
+		const packsprite_t *ps = &packsprites[i];
+		spritedef_t *def = &spritedefs[numspritedefs++];
+
+		def->name = ps->name;
+		def->numframes = ps->numframes;
+		def->frames = (spriteframe_t*)Mem_Alloc(ps->numframes * sizeof(spriteframe_t));
+		def->palette = firstpalette + ps->palette;
+		def->numpalettes = ps->numpalettes;
+
+		for (int j = 0; j < ps->numframes; j++)
+		{
+			const packframe_t *pf = &packframes[ps->firstframe + j];
+			spriteframe_t *f = &def->frames[j];
+
+			memset(f, 0, sizeof(*f));
+			f->width = pf->width;
+			f->height = pf->height;
+			f->originx = pf->originx;
+			f->originy = pf->originy;
+			f->pixels = (unsigned char*)(base + pf->offset);
+			f->indexed = pf->format == PACK_FORMAT_INDEXED;
+			f->lump = -1;
+		}
+	}
+
+	printf("mapped %i sprites, %i frames from \"%s\"\n", header->numsprites, header->numframes, filename);
+
+	return true;
+}
+
+// writes every loaded sprite out as a pack
+static void Pack_Write(const char *filename)
+{
+	int numframes = 0;
+	for (int i = 0; i < numspritedefs; i++)
+		numframes += spritedefs[i].numframes;
+
+	arenamarker_t marker = Arena_GetMarker(Mem_ThreadArena());
+
+	packheader_t header;
+	packsprite_t *packsprites = (packsprite_t*)Mem_FrameAlloc(numspritedefs * sizeof(packsprite_t));
+	packframe_t *packframes = (packframe_t*)Mem_FrameAlloc(numframes * sizeof(packframe_t));
+
+	header.ident = PACK_IDENT;
+	header.version = PACK_VERSION;
+	header.numsprites = numspritedefs;
+	header.spritesofs = sizeof(packheader_t);
+	header.numframes = numframes;
+	header.framesofs = header.spritesofs + numspritedefs * sizeof(packsprite_t);
+	header.numpalettes = numpalettes;
+	header.palettesofs = header.framesofs + numframes * sizeof(packframe_t);
+
+	int offset = header.palettesofs + numpalettes * sizeof(palettes[0]);
+	int frameindex = 0;
+	for (int i = 0; i < numspritedefs; i++)
+	{
+		spritedef_t *def = &spritedefs[i];
+		packsprite_t *ps = &packsprites[i];
+
+		memset(ps->name, 0, sizeof(ps->name));
+		strncpy(ps->name, def->name, sizeof(ps->name) - 1);
+		ps->firstframe = frameindex;
+		ps->numframes = def->numframes;
+		ps->palette = def->palette;
+		ps->numpalettes = def->numpalettes;
+
+		for (int j = 0; j < def->numframes; j++, frameindex++)
+		{
+			spriteframe_t *f = &def->frames[j];
+			packframe_t *pf = &packframes[frameindex];
+
+			offset = (offset + PACK_ALIGN - 1) & ~(PACK_ALIGN - 1);
+			pf->width = f->width;
+			pf->height = f->height;
+			pf->originx = f->originx;
+			pf->originy = f->originy;
+			pf->format = FrameStorage(f)->indexed ? PACK_FORMAT_INDEXED : PACK_FORMAT_RGBA;
+			pf->offset = offset;
+			pf->size = FrameBytes(FrameStorage(f));
+			offset += pf->size;
+		}
+	}
+	header.filesize = offset;
+
+	FILE *fp = fopen(filename, "wb");
+	if (!fp)
+		Error("Pack_Write: failed to open \"%s\"\n", filename);
+
+	fwrite(&header, sizeof(header), 1, fp);
+	fwrite(packsprites, sizeof(packsprite_t), numspritedefs, fp);
+	fwrite(packframes, sizeof(packframe_t), numframes, fp);
+	fwrite(palettes, sizeof(palettes[0]), numpalettes, fp);
+
+	frameindex = 0;
+	for (int i = 0; i < numspritedefs; i++)
+	{
+		for (int j = 0; j < spritedefs[i].numframes; j++, frameindex++)
+		{
+			packframe_t *pf = &packframes[frameindex];
+
+			// pad up to the frame's aligned offset
+			static const unsigned char zero[PACK_ALIGN] = { 0 };
+			fwrite(zero, pf->offset - ftell(fp), 1, fp);
+			// mirrored frames are written out flipped
+			spriteframe_t *f = &spritedefs[i].frames[j];
+			unsigned char *pixels = FramePixels(f);
+			int bpp = FrameStorage(f)->indexed ? 1 : 4;
+			for (int y = 0; y < f->height; y++)
+			{
+				for (int x = 0; x < f->width; x++)
+				{
+					int srcx = f->mirror ? f->width - 1 - x : x;
+					fwrite(pixels + (y * f->width + srcx) * bpp, bpp, 1, fp);
+				}
+			}
+		}
+	}
+
+	fclose(fp);
+	Arena_FreeToMarker(Mem_ThreadArena(), marker);
+
+	printf("wrote %i sprites, %i frames to \"%s\"\n", numspritedefs, numframes, filename);
+}
+
+// ==============================================
+// sprite batching
+//
+// sprites are queued with SprBatch_Add and drawn by SprBatch_Flush.
+// the queue is sorted on layer, then texture and mask, so each run of
+// sprites sharing state goes out as one glDrawElements from a vbo.
+// sprites keep their submission order within a run and across layers;
+// only sprites on the same layer with different state are reordered
+
+#define MAX_BATCH_SPRITES	65536
+
+typedef struct batchvertex_s
+{
+	float xy[2];
+	float st[2];
+	float uv[3];	// atlas coordinates and palette row
+	unsigned char rgba[4];
+
+} batchvertex_t;
+
+typedef struct batchstats_s
+{
+	int sprites;
+	int draws;
+
+} batchstats_t;
+
+static sprite_t *batchsprites;
+static unsigned long long *batchkeys;
+static int numbatchsprites;
+static batchstats_t batchstats;
+
+static bool usevbo = true;
+static bool immediatemode = false;
+static GLuint batchvbo;
+static GLuint batchibo;
+
+static void SprBatch_Init(bool initgl)
+{
+	batchsprites = (sprite_t*)Mem_Alloc(MAX_BATCH_SPRITES * sizeof(sprite_t));
+	batchkeys = (unsigned long long*)Mem_Alloc(MAX_BATCH_SPRITES * sizeof(unsigned long long));
+
+	if (!initgl || !usevbo)
+		return;
+
+	// the index buffer never changes, two triangles per sprite
+	arenamarker_t marker = Arena_GetMarker(Mem_ThreadArena());
+	unsigned int *indexes = (unsigned int*)Mem_FrameAlloc(MAX_BATCH_SPRITES * 6 * sizeof(unsigned int));
+	for (int i = 0; i < MAX_BATCH_SPRITES; i++)
+	{
+		indexes[i * 6 + 0] = i * 4 + 0;
+		indexes[i * 6 + 1] = i * 4 + 1;
+		indexes[i * 6 + 2] = i * 4 + 2;
+		indexes[i * 6 + 3] = i * 4 + 2;
+		indexes[i * 6 + 4] = i * 4 + 1;
+		indexes[i * 6 + 5] = i * 4 + 3;
+	}
+
+	glGenBuffers(1, &batchibo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batchibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, MAX_BATCH_SPRITES * 6 * sizeof(unsigned int), indexes, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	Arena_FreeToMarker(Mem_ThreadArena(), marker);
+
+	glGenBuffers(1, &batchvbo);
+}
+
+// the atlas page a sprite samples from, or MAX_ATLAS_PAGES when it's
+// still streaming and the placeholder is drawn instead
+static int SprBatch_TextureKey(const sprite_t *spr)
+{
+	spriteframe_t *frame = SpriteFrame(spr);
+	if (!FrameReady(frame, !softrender))
+		return MAX_ATLAS_PAGES;
+	return FrameStorage(frame)->page;
+}
+
+static int SprBatch_Page(unsigned long long key)
+{
+	return (key >> 32) & 0xffff;
+}
+
+static void SprBatch_Add(const sprite_t *spr)
+{
+	if (numbatchsprites == MAX_BATCH_SPRITES)
+	{
+		Warning("SprBatch_Add: batch full, sprite dropped\n");
+		return;
+	}
+
+	int index = numbatchsprites++;
+	batchsprites[index] = *spr;
+
+	// layer | texture | mask | submission order
+	unsigned long long layer = (spr->layer + 0x8000) & 0xffff;
+	unsigned long long texture = SprBatch_TextureKey(spr) & 0xffff;
+	unsigned long long mask = spr->alphatex & 0xff;
+	batchkeys[index] = (layer << 48) | (texture << 32) | (mask << 24) | index;
+}
+
+static int SprBatch_CompareKeys(const void *a, const void *b)
+{
+	unsigned long long ka = *(const unsigned long long*)a;
+	unsigned long long kb = *(const unsigned long long*)b;
+	return (ka > kb) - (ka < kb);
+}
+
+static void SprBatch_EmitVertices(batchvertex_t *out, const sprite_t *spr, bool placeholder)
+{
+	spriteframe_t *frame = SpriteFrame(spr);
+	float vertices[4][10];
+	AssembleVertexData(spr, vertices);
+
+	for (int i = 0; i < 4; i++, out++)
+	{
+		out->xy[0] = vertices[i][0];
+		out->xy[1] = vertices[i][1];
+		out->st[0] = vertices[i][4];
+		out->st[1] = vertices[i][5];
+		out->uv[0] = vertices[i][2];
+		out->uv[1] = vertices[i][3];
+		if (!placeholder)
+			FrameTexCoord(frame, &vertices[i][2], out->uv);
+		out->uv[2] = PaletteCoord(SpritePalette(spr));
+		out->rgba[0] = Soft_FloatToByte(vertices[i][6]);
+		out->rgba[1] = Soft_FloatToByte(vertices[i][7]);
+		out->rgba[2] = Soft_FloatToByte(vertices[i][8]);
+		out->rgba[3] = Soft_FloatToByte(vertices[i][9]);
+	}
+}
+
+static void SprBatch_FlushGL()
+{
+	int count = numbatchsprites;
+	batchvertex_t *verts = (batchvertex_t*)Mem_FrameAlloc(count * 4 * sizeof(batchvertex_t));
+	unsigned int *indexes = NULL;
+
+	for (int i = 0; i < count; i++)
+	{
+		const sprite_t *spr = &batchsprites[batchkeys[i] & 0xffffff];
+		bool placeholder = SprBatch_Page(batchkeys[i]) == MAX_ATLAS_PAGES;
+		if (placeholder)
+			streamstats.placeholders++;
+		else
+			Atlas_Upload(SpriteFrame(spr));
+		SprBatch_EmitVertices(verts + i * 4, spr, placeholder);
+	}
+
+	// offsets into the vbo, or client memory when vbos are off
+	const unsigned char *base = (const unsigned char*)verts;
+	const unsigned char *indexbase = NULL;
+	if (usevbo)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, batchvbo);
+		glBufferData(GL_ARRAY_BUFFER, count * 4 * sizeof(batchvertex_t), NULL, GL_STREAM_DRAW);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, count * 4 * sizeof(batchvertex_t), verts);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batchibo);
+		base = NULL;
+	}
+	else
+	{
+		indexes = (unsigned int*)Mem_FrameAlloc(count * 6 * sizeof(unsigned int));
+		for (int i = 0; i < count; i++)
+		{
+			indexes[i * 6 + 0] = i * 4 + 0;
+			indexes[i * 6 + 1] = i * 4 + 1;
+			indexes[i * 6 + 2] = i * 4 + 2;
+			indexes[i * 6 + 3] = i * 4 + 2;
+			indexes[i * 6 + 4] = i * 4 + 1;
+			indexes[i * 6 + 5] = i * 4 + 3;
+		}
+		indexbase = (const unsigned char*)indexes;
+	}
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(2, GL_FLOAT, sizeof(batchvertex_t), base + offsetof(batchvertex_t, xy));
+	glEnableClientState(GL_COLOR_ARRAY);
+	glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(batchvertex_t), base + offsetof(batchvertex_t, rgba));
+	glClientActiveTexture(GL_TEXTURE0);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glTexCoordPointer(2, GL_FLOAT, sizeof(batchvertex_t), base + offsetof(batchvertex_t, st));
+	glClientActiveTexture(GL_TEXTURE1);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glTexCoordPointer(3, GL_FLOAT, sizeof(batchvertex_t), base + offsetof(batchvertex_t, uv));
+
+	GLState_Blend(true);
+	GLState_BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	GLState_EnableTexture(0, true);
+	GLState_EnableTexture(1, true);
+
+	// one draw per run of sprites sharing texture and mask. the palette
+	// row is a vertex attribute so palette swaps don't split runs
+	for (int first = 0; first < count; )
+	{
+		const sprite_t *spr = &batchsprites[batchkeys[first] & 0xffffff];
+		unsigned long long state = batchkeys[first] >> 24;
+
+		int last = first + 1;
+		while (last < count && (batchkeys[last] >> 24) == state)
+			last++;
+
+		int page = SprBatch_Page(batchkeys[first]);
+		bool placeholder = page == MAX_ATLAS_PAGES;
+		Palette_Bind(!placeholder && atlaspages[page].indexed);
+
+		Tex_BindUnit(0, spr->alphatex);
+		Tex_BindUnit(1, placeholder ? PLACEHOLDER_TEXTURE : SPR0 + page);
+
+		glDrawElements(GL_TRIANGLES, (last - first) * 6, GL_UNSIGNED_INT, indexbase + first * 6 * sizeof(unsigned int));
+		batchstats.draws++;
+
+		first = last;
+	}
+
+	glClientActiveTexture(GL_TEXTURE1);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glClientActiveTexture(GL_TEXTURE0);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glDisableClientState(GL_COLOR_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+
+	if (usevbo)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	}
+}
+
+// draws everything queued since the last flush. the software compositor
+// runs even with nothing queued since sprites that went away leave
+// dirty rects behind
+static void SprBatch_Flush()
+{
+	int count = numbatchsprites;
+	if (!count && !softrender)
+		return;
+
+	arenamarker_t marker = Arena_GetMarker(Mem_ThreadArena());
+
+	qsort(batchkeys, count, sizeof(unsigned long long), SprBatch_CompareKeys);
+
+	if (softrender)
+	{
+		const sprite_t **sorted = (const sprite_t**)Mem_FrameAlloc(max(count, 1) * sizeof(sprite_t*));
+		for (int i = 0; i < count; i++)
+			sorted[i] = &batchsprites[batchkeys[i] & 0xffffff];
+
+		batchstats.draws += Soft_Composite(sorted, count);
+	}
+	else if (immediatemode)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			const sprite_t *spr = &batchsprites[batchkeys[i] & 0xffffff];
+			float vertices[4][10];
+			AssembleVertexData(spr, vertices);
+			DrawMultiTex(spr, vertices);
+		}
+
+		batchstats.draws += count;
+	}
+	else
+	{
+		SprBatch_FlushGL();
+	}
+
+	batchstats.sprites += count;
+	numbatchsprites = 0;
+
+	Arena_FreeToMarker(Mem_ThreadArena(), marker);
+}
+
+//
+// benchmark
+//
+static int benchsprites = 0;
+static double benchtime;
+static int benchframes;
+
+// a spread of random sprites covering every mask, flip and frame
+static void QueueBenchSprites(int count)
 {
-	BUILTIN_SOLID,
-	BUILTIN_HLINE,
-	BUILTIN_VLINE,
-	BUILTIN_DLINE,
-	BUILTIN_CHECK,
-	BUILTIN_POINT,
-	SPR0,
-	NUM_SPR
-};
+	for (int i = 0; i < count; i++)
+	{
+		sprite_t spr;
 
-// sprite data
-static int sizex = 40;
-static int sizey = 55;
-static int centerx = 0;
-static int centery = 0;
-static int numframes = 1;
-static int framestride = sizex * sizey * 4;
-static unsigned char *sprdata;
+		spr.sprite = rand() % numspritedefs;
+		spr.frame = rand() % spritedefs[spr.sprite].numframes;
 
-int ReadFile(const char* filename, void **data)
+		spriteframe_t *frame = SpriteFrame(&spr);
+		spr.posx = rand() % (renderw + frame->width) - frame->width;
+		spr.posy = rand() % (renderh + frame->height) - frame->height;
+		spr.layer = 0;
+		spr.alphatex = rand() % SPR0;
+		spr.flipx = rand() & 1;
+		spr.flipy = rand() & 1;
+		spr.rgba[0] = 0.5f + (rand() % 128) / 255.0f;
+		spr.rgba[1] = 0.5f + (rand() % 128) / 255.0f;
+		spr.rgba[2] = 0.5f + (rand() % 128) / 255.0f;
+		spr.rgba[3] = 0.5f + (rand() % 128) / 255.0f;
+		spr.palette = rand() % 2;
+
+		SprBatch_Add(&spr);
+	}
+}
+
+static void Bench_Report(double elapsed)
 {
-	FILE *fp = fopen(filename, "rb");
-	if(!fp)
-		printf("Failed to open file \"%s\"\n", filename);
+	benchtime += elapsed;
+	benchframes++;
 
-	int curpos = ftell(fp);
-	fseek(fp, 0, SEEK_END);
-	int size = ftell(fp);
-	fseek(fp, curpos, SEEK_SET);
+	if (benchtime < 1000.0)
+		return;
 
-	*data = malloc(size);
-	fread(*data, size, 1, fp);
-	fclose(fp);
+	printf("%i sprites/frame, %.1f draws/frame, %.3f ms/frame, %.0f sprites/sec\n",
+		batchstats.sprites / benchframes, (float)batchstats.draws / benchframes,
+		benchtime / benchframes, batchstats.sprites / (benchtime / 1000.0));
+	if (!softrender)
+	{
+		printf("%.1f gl state calls/frame issued, %.1f elided\n",
+			(float)glstate.issued / benchframes, (float)glstate.elided / benchframes);
+	}
 
-	return size;
+	benchtime = 0.0;
+	benchframes = 0;
+	memset(&batchstats, 0, sizeof(batchstats));
+	glstate.issued = 0;
+	glstate.elided = 0;
 }
 
-// fixme:
-// modern opengl says that internal format and external format must match
-// also, use a sized internal format
-// this needs to happen anyway to use a luminance mask
-static void InitTexture()
+static void DrawSpr()
 {
-	// allow small rows on a byte alignment
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	sprite_t spr;
 
-	// solid
-	{
-		unsigned char data[4] = { 0xff, 0xff, 0xff, 0xff };
-		glBindTexture(GL_TEXTURE_2D, BUILTIN_SOLID);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	}
-
-	// alpha hline
-	{
-		unsigned char data[8] =
-		{
-			0xff, 0xff, 0xff, 0xff,
-			0xff, 0xff, 0xff, 0x0
-		};
-		glBindTexture(GL_TEXTURE_2D, BUILTIN_HLINE);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 2, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	}
-	
-	// alpha vline
+	// setup the state
+	// this would all be done by the client normally
 	{
-		// this is the same as hline, just the dimensions have changed
-		unsigned char data[8] =
+		spr.posx = 0;
+		spr.posy = 0;
+		spr.sprite = 0;
+		spr.frame = framenum;
+		spr.layer = 0;
+		spr.alphatex = BUILTIN_SOLID;
+		spr.flipx = 1;
+		spr.flipy = 1;
+		spr.rgba[0] = 1.0f;
+		spr.rgba[1] = 1.0f;
+		spr.rgba[2] = 1.0f;
+		spr.rgba[3] = 1.0f;
+
+		// this would be done by the client
+		if ((framenum & 0x3) == (rand() %4))
 		{
-			0xff, 0xff, 0xff, 0xff,
-			0xff, 0xff, 0xff, 0x0
-		};
-		glBindTexture(GL_TEXTURE_2D, BUILTIN_VLINE);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 2, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+			static GLuint temp[] = { BUILTIN_DLINE, BUILTIN_POINT, BUILTIN_VLINE };
+			spr.alphatex = temp[rand() % 3];
+		}
+
+		static float trans[] = { 1.0f, 0.9f, 0.8f, 0.7f, 0.6f, 0.5f, 0.6f, 0.7f, 0.8f, 0.8f, 1.0f };
+		spr.rgba[3] = trans[framenum % 11];
+
+		// flash as if hit every few seconds
+		spr.palette = (framenum % 20) < 2;
 	}
 
-	// alpha checkerboard
+	SprBatch_Add(&spr);
+}
+
+static void Draw()
+{
+	double start = Sys_Milliseconds();
+
+	Tex_BeginFrame();
+	Stream_Update(!softrender);
+
+	DrawSpr();
+
+	QueueBenchSprites(benchsprites);
+
+	SprBatch_Flush();
+
+	if (benchsprites)
 	{
-		unsigned char data[16] =
-		{
-			0xff, 0xff, 0xff, 0xff,
-			0xff, 0xff, 0xff, 0x0,
-			0xff, 0xff, 0xff, 0x0,
-			0xff, 0xff, 0xff, 0xff
-		};
-		glBindTexture(GL_TEXTURE_2D, BUILTIN_CHECK);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 2, 2, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		// wait for gl so the timing covers the actual rendering
+		if (!softrender)
+			glFinish();
+		Bench_Report(Sys_Milliseconds() - start);
 	}
+}
+
+static const char *packname = "sprites.spk";
+static const char *mkpackname = NULL;
+static const char *wadname = NULL;
 
-	// alpha point
+static void LoadData(bool initgl)
+{
+	// the raw files are only used when there's no pack
+	if (!Pack_Load(packname) || mkpackname)
 	{
-		unsigned char data[16] =
-		{
-			0xff, 0xff, 0xff, 0xff,
-			0xff, 0xff, 0xff, 0x0,
-			0xff, 0xff, 0xff, 0x0,
-			0xff, 0xff, 0xff, 0x0
-		};
-		glBindTexture(GL_TEXTURE_2D, BUILTIN_POINT);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 2, 2, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		numspritedefs = 0;
+		for (unsigned int i = 0; i < sizeof(rawsprites) / sizeof(rawsprites[0]); i++)
+			LoadRawSprite(&rawsprites[i]);
 	}
 
-	// alpha diagonal lines
+	if (wadname)
 	{
-		unsigned char data[64] =
-		{
-			0xff, 0xff, 0xff, 0x0,
-			0xff, 0xff, 0xff, 0x0,
-			0xff, 0xff, 0xff, 0xff,
-			0xff, 0xff, 0xff, 0x0,
-			0xff, 0xff, 0xff, 0x0,
-			0xff, 0xff, 0xff, 0x0,
-			0xff, 0xff, 0xff, 0x0,
-			0xff, 0xff, 0xff, 0xff,
-			0xff, 0xff, 0xff, 0xff,
-			0xff, 0xff, 0xff, 0x0,
-			0xff, 0xff, 0xff, 0x0,
-			0xff, 0xff, 0xff, 0x0,
-			0xff, 0xff, 0xff, 0x0,
-			0xff, 0xff, 0xff, 0xff,
-			0xff, 0xff, 0xff, 0x0,
-			0xff, 0xff, 0xff, 0x0
-		};
-		glBindTexture(GL_TEXTURE_2D, BUILTIN_DLINE);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 4, 4, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		if (!Wad_Load(wadname))
+			Error("failed to load wad \"%s\"\n", wadname);
+		atexit(FrameCache_PrintStats);
 	}
 
-	// spr0
+	if (mkpackname)
 	{
-		glBindTexture(GL_TEXTURE_2D, SPR0);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, sizex, sizey, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		Pack_Write(mkpackname);
+		exit(0);
 	}
-}
 
-static void LoadData()
-{
-	ReadFile("troo", (void**)&sprdata);
+	if (initgl)
+	{
+		InitTexture();
+		atexit(Tex_PrintStats);
+	}
 
-	InitTexture();
-}
+	Atlas_Build(initgl);
 
-static void UploadTexture()
-{
-	unsigned char *pixels = sprdata + ((framenum % numframes) * framestride);
-	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, sizex, sizey, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
-	glBindTexture(GL_TEXTURE_2D, SPR0);
+	if (initgl)
+		Palette_InitGL();
+
+	Stream_Init(initgl);
+
+	SprBatch_Init(initgl);
 }
 
+// ==============================================
+// dynamic resolution
 //
-// interface to drawsprite
-//
-static int posx = 0;
-static int posy = 0;
-static GLuint alphatex = BUILTIN_SOLID;
-static bool flipx = false;
-static bool flipy = false;
-static float rgba[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
-#if 0
-static int posx = renderw - sizex - 2;
-static int posy = renderh - sizey - 2;
-#endif
+// with -dynres the gl path draws into a smaller part of the render
+// target when frames run over budget. the cost of a frame is the larger
+// of the cpu time spent in DisplayFunc and the gpu time from a timer
+// query read back a couple of frames later. costs are averaged over
+// DYNRES_WINDOW frames before anything changes, and the scale only goes
+// up again once the average is well under the target, so a frame
+// sitting near the budget doesn't flip between two sizes. a change
+// throws the samples away so the next decision is made on frames drawn
+// at the new size
 
-// internal draw sprite data
-static float vertices[4][10];
+#define DYNRES_WINDOW		16
+#define DYNRES_STEP			0.125f
+#define DYNRES_NUM_LEVELS	8
+#define DYNRES_RAISE		0.7f
+#define DYNRES_QUERIES		3
 
-static float AlphaScaleFactor()
+typedef struct dynres_s
 {
-	if (alphatex == BUILTIN_SOLID)
-		return 1.0f;
-	else if (alphatex == BUILTIN_DLINE)
-		return 0.25f;
-	else
-		return 0.5f;
-}
+	bool enabled;
+	float target;
+	float minscale;
+	float scale;
 
-static void SwapFloat(float *x, float *y)
+	double samples[DYNRES_WINDOW];
+	int numsamples;
+
+	GLuint queries[DYNRES_QUERIES];
+	int querynum;
+	double lastgpu;
+
+	// telemetry
+	double reporttime;
+	double cputime, gputime;
+	int reportframes;
+	int changes;
+	int levelframes[DYNRES_NUM_LEVELS + 1];
+
+} dynres_t;
+
+static dynres_t dynres = { false, 16.6f, 0.5f, 1.0f };
+
+static int DynRes_Width()
 {
-	float temp = *x;
-	*x = *y;
-	*y = temp;
+	return max(1, (int)(renderw * dynres.scale + 0.5f));
 }
 
-static void AssembleVertexData()
+static int DynRes_Height()
 {
-	int basex = posx - centerx;
-	int basey = posy - centery;
+	return max(1, (int)(renderh * dynres.scale + 0.5f));
+}
 
-	float alphascale = AlphaScaleFactor();
+static void DynRes_PrintStats()
+{
+	dynres_t *dr = &dynres;
 
-	// assemble the vertex data xy, uv
-	vertices[0][0] = basex;
-	vertices[0][1] = basey;
-	vertices[0][2] = 0.0f;
-	vertices[0][3] = 0.0f;
-	vertices[0][4] = 0.0f;
-	vertices[0][5] = 0.0f;
-	vertices[0][6] = rgba[0];
-	vertices[0][7] = rgba[1];
-	vertices[0][8] = rgba[2];
-	vertices[0][9] = rgba[3];
+	printf("dynamic resolution, target %.1f ms, %i changes\n", dr->target, dr->changes);
+	for (int i = DYNRES_NUM_LEVELS; i > 0; i--)
+	{
+		if (dr->levelframes[i])
+			printf("  scale %.3f: %i frames\n", i * DYNRES_STEP, dr->levelframes[i]);
+	}
+}
 
-	vertices[1][0] = basex + sizex;
-	vertices[1][1] = basey;
-	vertices[1][2] = 1.0f;
-	vertices[1][3] = 0.0f;
-	vertices[1][4] = sizex * alphascale;
-	vertices[1][5] = 0.0f;
-	vertices[1][6] = rgba[0];
-	vertices[1][7] = rgba[1];
-	vertices[1][8] = rgba[2];
-	vertices[1][9] = rgba[3];
+static void DynRes_Init()
+{
+	dynres_t *dr = &dynres;
 
-	vertices[2][0] = basex;
-	vertices[2][1] = basey + sizey;
-	vertices[2][2] = 0.0f;
-	vertices[2][3] = 1.0f;
-	vertices[2][4] = 0.0f;
-	vertices[2][5] = sizey * alphascale;
-	vertices[2][6] = rgba[0];
-	vertices[2][7] = rgba[1];
-	vertices[2][8] = rgba[2];
-	vertices[2][9] = rgba[3];
+	if (!dr->enabled)
+		return;
 
-	vertices[3][0] = basex + sizex;
-	vertices[3][1] = basey + sizey;
-	vertices[3][2] = 1.0f;
-	vertices[3][3] = 1.0f;
-	vertices[3][4] = sizex * alphascale;
-	vertices[3][5] = sizey * alphascale;
-	vertices[3][6] = rgba[0];
-	vertices[3][7] = rgba[1];
-	vertices[3][8] = rgba[2];
-	vertices[3][9] = rgba[3];
+	dr->minscale = max(DYNRES_STEP, min(dr->minscale, 1.0f));
+	dr->minscale = ceilf(dr->minscale / DYNRES_STEP) * DYNRES_STEP;
+	dr->scale = 1.0f;
+	dr->reporttime = Sys_Milliseconds();
 
-	if (flipx)
-	{
-		SwapFloat(&vertices[0][2], &vertices[1][2]);
-		SwapFloat(&vertices[2][2], &vertices[3][2]);
-	}
+	glGenQueries(DYNRES_QUERIES, dr->queries);
 
-	if (flipy)
-	{
-		SwapFloat(&vertices[0][3], &vertices[2][3]);
-		SwapFloat(&vertices[1][3], &vertices[3][3]);
-	}
+	atexit(DynRes_PrintStats);
 }
 
+static void DynRes_BeginFrame()
+{
+	dynres_t *dr = &dynres;
+
+	if (dr->enabled)
+		glBeginQuery(GL_TIME_ELAPSED, dr->queries[dr->querynum % DYNRES_QUERIES]);
+}
 
-static void DrawAlphaLayer()
+// reads back the oldest query, which has usually finished by now. if
+// it hasn't the last gpu time is reused rather than stalling on it
+static double DynRes_EndFrame()
 {
-	glColorMask(0, 0, 0, 1);
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_ONE, GL_ZERO);
+	dynres_t *dr = &dynres;
 
-	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, alphatex);
-	glColor3f(1, 1, 1);
+	glEndQuery(GL_TIME_ELAPSED);
+	dr->querynum++;
 
-	glBegin(GL_TRIANGLE_STRIP);
+	if (dr->querynum < DYNRES_QUERIES)
+		return 0.0;
 
-	glBegin(GL_TRIANGLE_STRIP);
-	for (int i = 0; i < 4; i++)
+	GLuint query = dr->queries[dr->querynum % DYNRES_QUERIES];
+	GLint available = 0;
+	glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+	if (available)
 	{
-		glTexCoord2f(vertices[i][4], vertices[i][5]);
-		glColor4f(1, 1, 1, 1);
-		glVertex2f(vertices[i][0], vertices[i][1]);
+		GLuint64 ns;
+		glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+		dr->lastgpu = ns / 1000000.0;
 	}
 
-	glEnd();
-
-	glDisable(GL_BLEND);
-	glColorMask(1, 1, 1, 1);
+	return dr->lastgpu;
 }
 
-
-static void DrawColorLayer()
+static void DynRes_Report(double cpu, double gpu)
 {
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_DST_ALPHA, GL_ONE_MINUS_DST_ALPHA);
+	dynres_t *dr = &dynres;
 
-	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, SPR0);
-	glColor3f(1, 1, 1);
+	dr->cputime += cpu;
+	dr->gputime += gpu;
+	dr->reportframes++;
+	dr->levelframes[(int)(dr->scale / DYNRES_STEP + 0.5f)]++;
 
-	glBegin(GL_TRIANGLE_STRIP);
-	for (int i = 0; i < 4; i++)
-	{
-		glTexCoord2f(vertices[i][2], vertices[i][3]);
-		glColor4f(vertices[i][6], vertices[i][7], vertices[i][8], vertices[i][9]);
-		glVertex2f(vertices[i][0], vertices[i][1]);
-	}
+	double now = Sys_Milliseconds();
+	if (now - dr->reporttime < 1000.0)
+		return;
 
-	glEnd();
+	printf("dynres: scale %.3f (%ix%i), cpu %.2f ms, gpu %.2f ms, target %.1f ms, %i changes\n",
+		dr->scale, DynRes_Width(), DynRes_Height(),
+		dr->cputime / dr->reportframes, dr->gputime / dr->reportframes, dr->target, dr->changes);
 
-	glDisable(GL_BLEND);
+	dr->reporttime = now;
+	dr->cputime = 0.0;
+	dr->gputime = 0.0;
+	dr->reportframes = 0;
 }
 
-static void DrawMultiTex()
+// feeds the cost of the frame just drawn into the controller
+static void DynRes_Frame(double cpu, double gpu)
 {
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	dynres_t *dr = &dynres;
 
-	glActiveTexture(GL_TEXTURE0);
-	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, alphatex);
+	if (!dr->enabled)
+		return;
 
-	glActiveTexture(GL_TEXTURE1);
-	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, SPR0);
+	DynRes_Report(cpu, gpu);
 
-	glBegin(GL_TRIANGLE_STRIP);
-	for (int i = 0; i < 4; i++)
+	dr->samples[dr->numsamples++] = max(cpu, gpu);
+	if (dr->numsamples < DYNRES_WINDOW)
+		return;
+
+	double average = 0.0;
+	for (int i = 0; i < DYNRES_WINDOW; i++)
+		average += dr->samples[i];
+	average /= DYNRES_WINDOW;
+	dr->numsamples = 0;
+
+	float scale = dr->scale;
+	if (average > dr->target)
 	{
-		glMultiTexCoord2f(0, vertices[i][4], vertices[i][5]);
-		glMultiTexCoord2f(1, vertices[i][2], vertices[i][3]);
-		glColor4f(vertices[i][6], vertices[i][7], vertices[i][8], vertices[i][9]);
-		glVertex2f(vertices[i][0], vertices[i][1]);
+		// fill cost goes with the square of the scale so aim straight for
+		// the size that should fit, at least one step down
+		float fit = dr->scale * sqrtf(dr->target / average);
+		scale = min(dr->scale - DYNRES_STEP, floorf(fit / DYNRES_STEP) * DYNRES_STEP);
+	}
+	else if (average < dr->target * DYNRES_RAISE)
+	{
+		scale = dr->scale + DYNRES_STEP;
 	}
 
-	glEnd();
+	scale = max(dr->minscale, min(scale, 1.0f));
+	if (scale != dr->scale)
+	{
+		dr->scale = scale;
+		dr->changes++;
+	}
+}
 
-	glActiveTexture(GL_TEXTURE0);
-	glDisable(GL_TEXTURE_2D);
-	glActiveTexture(GL_TEXTURE0);
-	glDisable(GL_TEXTURE_2D);
+// ==============================================
+// render target
+//
+// the gl path draws into an offscreen framebuffer at renderw x renderh
+// and copies it to the window with one nearest blit, scaled up by the
+// largest whole number that fits. fill cost follows the logical
+// resolution however big the window is. dynamic resolution draws into
+// the lower left corner and stretches that instead. -nofbo draws
+// straight into the window stretched to fit, like before
 
-	glDisable(GL_BLEND);
-}
+static bool usefbo = true;
+static GLuint renderfbo;
+static GLuint rendercolor;
 
-static void DrawSpr()
+static void Target_Init()
 {
-
-	// setup the state
-	// this would all be done by the client normally
+	if (dynres.enabled && !usefbo)
 	{
-		alphatex = BUILTIN_SOLID;
-		flipx = 1;
-		flipy = 1;
-		rgba[3] = 1.0f;
+		Warning("dynamic resolution needs the render target, disabled\n");
+		dynres.enabled = false;
+	}
 
-		// this would be done by the client
-		if ((framenum & 0x3) == (rand() %4))
-		{
-			static GLuint temp[] = { BUILTIN_DLINE, BUILTIN_POINT, BUILTIN_VLINE };
-			alphatex = temp[rand() % 3];
-		}
+	if (!usefbo)
+		return;
 
-		static float trans[] = { 1.0f, 0.9f, 0.8f, 0.7f, 0.6f, 0.5f, 0.6f, 0.7f, 0.8f, 0.8f, 1.0f };
-		rgba[3] = trans[framenum % 11];
-	}
+	glGenRenderbuffers(1, &rendercolor);
+	glBindRenderbuffer(GL_RENDERBUFFER, rendercolor);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, renderw, renderh);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
 
-	AssembleVertexData();
+	glGenFramebuffers(1, &renderfbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, renderfbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rendercolor);
+	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-//	DrawAlphaLayer();
+	if (status != GL_FRAMEBUFFER_COMPLETE)
+	{
+		Warning("render target incomplete (0x%x), drawing to the window\n", status);
+		usefbo = false;
+	}
 
-//      DrawColorLayer();
-	DrawMultiTex();
+	DynRes_Init();
 }
 
-static void Draw()
+static void Target_Begin()
+{
+	if (usefbo)
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, renderfbo);
+		glViewport(0, 0, DynRes_Width(), DynRes_Height());
+	}
+	else
+	{
+		glViewport(0, 0, screenw, screenh);
+	}
+}
+
+static void Target_Present()
 {
-	UploadTexture();
+	if (!usefbo)
+		return;
 
-	DrawSpr();
+	int x, y;
+	int scale = PresentScale(&x, &y);
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, renderfbo);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	glViewport(0, 0, screenw, screenh);
+	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glBlitFramebuffer(0, 0, DynRes_Width(), DynRes_Height(), x, y, x + renderw * scale, y + renderh * scale, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
 static void ReshapeFunc(int w, int h)
 {
+	screenw = w;
+	screenh = h;
+
 	glMatrixMode(GL_PROJECTION);
 	glLoadIdentity();
 
@@ -428,12 +4589,33 @@ static void DisplayFunc()
 	glLoadIdentity();
 	glOrtho(0, renderw, 0, renderh, -1, 1);
 
-	glClearColor(0.3f, 0.3f, 0.3f, 0.0f);
-	glClear(GL_COLOR_BUFFER_BIT);
+	if (softrender)
+	{
+		Soft_ClearColor(0.3f, 0.3f, 0.3f, 0.0f);
+		Draw();
+		Soft_Present();
+	}
+	else
+	{
+		double start = Sys_Milliseconds();
+		DynRes_BeginFrame();
 
-	Draw();
+		Target_Begin();
+		glClearColor(0.3f, 0.3f, 0.3f, 0.0f);
+		glClear(GL_COLOR_BUFFER_BIT);
+		Draw();
+		Target_Present();
+
+		if (dynres.enabled)
+		{
+			double gpu = DynRes_EndFrame();
+			DynRes_Frame(Sys_Milliseconds() - start, gpu);
+		}
+	}
 
 	glutSwapBuffers();
+
+	Mem_EndFrame();
 }
 
 static void TimerFunc(int value)
@@ -455,20 +4637,173 @@ static void InitGlut(int argc, char *argv[])
 
 	glutTimerFunc(33, TimerFunc, 0);
 
+	// redraw as fast as possible when benchmarking
+	if (benchsprites)
+		glutIdleFunc(glutPostRedisplay);
+
 	// need to explictly request an alpha plane or it isn't created
 	//int alphabits;
 	//glGetIntegerv(GL_ALPHA_BITS, &alphabits);
 	//printf("alphabits = %i\n", alphabits);
 }
 
+// renders frames with the software compositor without opening a window.
+// the capture is scaled up by capturescale
+static int capturescale = 1;
+
+static void RunHeadless(int numframes, const char *outname)
+{
+	double start = Sys_Milliseconds();
+
+	for (int i = 0; i < numframes; i++)
+	{
+		Soft_ClearColor(0.3f, 0.3f, 0.3f, 0.0f);
+		Draw();
+
+		// keep the last frame for the capture
+		if (i != numframes - 1)
+			framenum += 1;
+
+		Mem_EndFrame();
+	}
+
+	double elapsed = Sys_Milliseconds() - start;
+	printf("%i frames in %.2f ms, %.4f ms/frame\n", numframes, elapsed, elapsed / max(numframes, 1));
+	if (benchsprites)
+		printf("%.0f sprites/sec\n", numframes * (benchsprites + 1) / (elapsed / 1000.0));
+
+	if (outname)
+	{
+		framebuffer_t capture = softfb;
+		if (capturescale > 1)
+			Soft_Upscale(&softfb, capturescale, &capture);
+
+		const char *ext = strrchr(outname, '.');
+		if (ext && !strcmp(ext, ".png"))
+			Soft_WritePNG(&capture, outname);
+		else
+			Soft_WritePPM(&capture, outname);
+	}
+}
+
+static void PrintUsage()
+{
+	printf("usage: hld [-soft] [-headless numframes] [-o capture.ppm|capture.png]\n");
+	printf("           [-bench numsprites] [-novbo] [-immediate] [-pack file] [-mkpack file]\n");
+	printf("           [-wad file] [-cache megabytes] [-nospans] [-nodirty] [-threads n]\n");
+	printf("           [-stream numworkers] [-texmem megabytes] [-nofbo] [-scale n]\n");
+	printf("           [-dynres ms] [-minscale f]\n");
+	printf("  -soft       composite sprites on the cpu and show the result in the window\n");
+	printf("  -headless   render numframes with the cpu compositor without a window\n");
+	printf("  -o          write the last headless frame as a ppm or png\n");
+	printf("  -scale      scale the headless capture up n times with nearest filtering\n");
+	printf("  -bench      add numsprites random sprites a frame and report sprites/sec\n");
+	printf("  -novbo      submit batches from client memory instead of a vbo\n");
+	printf("  -immediate  draw each sprite with DrawMultiTex instead of batching\n");
+	printf("  -pack       load sprites from this pack instead of sprites.spk\n");
+	printf("  -mkpack     write the loaded sprites out as a pack and exit\n");
+	printf("  -wad        also load the sprites from a doom wad\n");
+	printf("  -cache      size of the decoded wad frame cache, default 8\n");
+	printf("  -nodirty    redraw the whole frame in the software compositor\n");
+	printf("  -threads    software compositor threads, default one per cpu\n");
+	printf("  -nospans    composite every texel instead of only the opaque spans\n");
+	printf("  -stream     decode wad frames on worker threads, drawing placeholders until ready\n");
+	printf("  -texmem     texture memory budget, least recently used atlas pages are evicted, default 32\n");
+	printf("  -nofbo      draw straight into the window instead of an offscreen target\n");
+	printf("  -dynres     lower the render resolution to keep frames under ms milliseconds\n");
+	printf("  -minscale   lowest dynamic resolution scale, default 0.5\n");
+	printf("run with LIBGL_ALWAYS_SOFTWARE=1 to benchmark mesa's software gl\n");
+}
+
 int main(int argc, char *argv[])
 {
+	int headlessframes = 0;
+	const char *outname = NULL;
+
+	Mem_Init();
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-soft"))
+			softrender = true;
+		else if (!strcmp(argv[i], "-headless") && i + 1 < argc)
+			headlessframes = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+			outname = argv[++i];
+		else if (!strcmp(argv[i], "-bench") && i + 1 < argc)
+			benchsprites = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-novbo"))
+			usevbo = false;
+		else if (!strcmp(argv[i], "-immediate"))
+			immediatemode = true;
+		else if (!strcmp(argv[i], "-nospans"))
+			softspans = false;
+		else if (!strcmp(argv[i], "-stream") && i + 1 < argc)
+			numstreamworkers = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-texmem") && i + 1 < argc)
+			texturebudget = (size_t)atoi(argv[++i]) * 1024 * 1024;
+		else if (!strcmp(argv[i], "-nodirty"))
+			softdirty = false;
+		else if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+			numsoftthreads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-nofbo"))
+			usefbo = false;
+		else if (!strcmp(argv[i], "-dynres") && i + 1 < argc)
+		{
+			dynres.enabled = true;
+			dynres.target = atof(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-minscale") && i + 1 < argc)
+			dynres.minscale = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-scale") && i + 1 < argc)
+			capturescale = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-pack") && i + 1 < argc)
+			packname = argv[++i];
+		else if (!strcmp(argv[i], "-mkpack") && i + 1 < argc)
+			mkpackname = argv[++i];
+		else if (!strcmp(argv[i], "-wad") && i + 1 < argc)
+			wadname = argv[++i];
+		else if (!strcmp(argv[i], "-cache") && i + 1 < argc)
+			framecachebudget = (size_t)atoi(argv[++i]) * 1024 * 1024;
+		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "-help"))
+		{
+			PrintUsage();
+			return 0;
+		}
+	}
+
+	benchsprites = max(0, min(benchsprites, MAX_BATCH_SPRITES - 1));
+	numstreamworkers = max(0, min(numstreamworkers, MAX_STREAM_WORKERS));
+	capturescale = max(1, min(capturescale, 16));
+
+	// the software compositor blits spans pixel for pixel, it always draws
+	// at the full logical resolution
+	if (dynres.enabled && (softrender || headlessframes > 0))
+	{
+		Warning("dynamic resolution is only used by the gl path\n");
+		dynres.enabled = false;
+	}
+
+	if (headlessframes > 0 || mkpackname)
+	{
+		softrender = true;
+		Soft_Init(renderw, renderh);
+		LoadData(false);
+		RunHeadless(headlessframes, outname);
+		return 0;
+	}
+
 	InitGlut(argc, argv);
 
-	LoadData();
+	if (softrender)
+		Soft_Init(renderw, renderh);
+
+	LoadData(true);
+
+	if (!softrender)
+		Target_Init();
 
 	glutMainLoop();
 
 	return 0;
 }
-